@@ -22,6 +22,8 @@
  * SOFTWARE.
  */
 
+#include "../firmware/CMSIS/m2sxxx.h"
+#include "../firmware/CMSIS/system_m2sxxx.h"
 #include "../firmware/drivers/mss_gpio/mss_gpio.h"
 #include "../firmware/drivers/mss_i2c/mss_i2c.h"
 #include "hk_adc.h"
@@ -36,6 +38,81 @@
 /* Local Function prototypes */
 static int hk_adc_reg_write(hk_adc_register_t reg, uint8_t *write_buffer);
 static int hk_adc_reg_read(hk_adc_register_t reg, uint16_t *read_buffer);
+static void hk_adc_sample_add(hk_adc_channel_t ch, uint16_t sample);
+static void hk_adc_filter_reset(hk_adc_channel_t ch);
+static int hk_adc_conv_read(uint16_t mux, uint16_t *value);
+
+
+/*
+ * Shadow copies of the CONFIG register (as last written, without the OS bit)
+ * and of the address pointer register, so that CONFIG is never read back to
+ * be modified and the pointer is only written when it changes. Registers are
+ * read with a repeated start after the pointer write, or with a plain read if
+ * the pointer is already right. `xfers_saved` counts the I2C transactions
+ * saved over writing the pointer and reading in separate transactions.
+ */
+#define PTR_UNKNOWN                     (0xff)
+
+static uint16_t config_shadow = 0x0583;     /* reset value */
+static uint8_t ptr_shadow = PTR_UNKNOWN;
+static uint32_t xfers = 0;
+static uint32_t xfers_saved = 0;
+
+
+/*
+ * Background sampler states. The I2C0 transfers are run by the MSS I2C
+ * interrupt handler; hk_adc_poll() only starts them and checks their status.
+ * The conversion result is read once the conversion time for the data rate
+ * has elapsed, as the ALERT/RDY pin is not connected to the MSS.
+ */
+#define SMP_IDLE                        (0)     /* waiting for next period */
+#define SMP_START                       (1)     /* config write, starting conversion */
+#define SMP_CONV                        (2)     /* conversion in progress */
+#define SMP_READ                        (3)     /* conversion register read */
+
+/*
+ * Per-channel filter state. `acc` is the sum of the boxcar samples, or the
+ * IIR output scaled by 2^shift; `param` is the boxcar length or IIR shift.
+ */
+struct hk_adc_chan {
+    uint16_t mux;
+    uint8_t filter;
+    uint8_t param;
+    uint16_t samples[HK_ADC_BOXCAR_MAX];
+    uint32_t acc;
+    uint8_t idx;
+    uint8_t count;
+};
+
+#define CHAN(m)     { .mux = (m), .filter = HK_ADC_FILTER_BOXCAR, \
+                      .param = HK_ADC_BOXCAR_DEFAULT }
+
+static struct hk_adc_chan chans[HK_ADC_CH_COUNT] = {
+    [HK_ADC_CH_BATT_CURR] = CHAN(HK_ADC_CONFIG_MUX_SINGLE_0),
+    [HK_ADC_CH_BATT_VOLT] = CHAN(HK_ADC_CONFIG_MUX_SINGLE_1),
+    [HK_ADC_CH_CITI_TEMP] = CHAN(HK_ADC_CONFIG_MUX_SINGLE_2),
+};
+
+/* CONFIG register DR[2:0] and PGA[2:0] fields */
+#define CONFIG_DR_MASK                  (0x00E0)
+#define CONFIG_DR_SHIFT                 (5)
+#define CONFIG_PGA_MASK                 (0x0E00)
+#define CONFIG_PGA_SHIFT                (9)
+
+/* Conversion time per DR[2:0] setting, with margin for the -10% DR tolerance */
+static const uint16_t conv_time_us[8] = {
+    8700, 4450, 2300, 1250, 750, 500, 370, 370
+};
+
+static uint16_t smp_config;             /* CONFIG value, except MUX and OS */
+static uint8_t smp_state = SMP_IDLE;
+static uint8_t smp_ch = 0;
+static uint16_t smp_period_ms = HK_ADC_SAMPLE_PERIOD_MS;
+static uint8_t smp_discard = 0;         /* conversion started with old DR/PGA */
+static uint32_t smp_period_start;
+static uint32_t smp_conv_start;
+static uint8_t smp_tx[3];
+static uint8_t smp_rx[2];
 
 
 
@@ -61,7 +138,7 @@ int hk_adc_init(void)
                       | HK_ADC_CONFIG_CMODE_TRAD | HK_ADC_CONFIG_CPOL_ACTIVE_LOW
                       | HK_ADC_CONFIG_CLAT_NON_LATCH | HK_ADC_CONFIG_CQUE_DISABLE;
 
-    uint8_t send_buffer[2] = {CONFIG>>8, CONFIG};
+    uint8_t send_buffer[2] = {(uint8_t)(CONFIG >> 8), (uint8_t)(CONFIG & 0xff)};
 
     // Set the clock for i2c0 instance; Clock div:10^8/256 = 390,625Hz =~ 390KHz
     MSS_I2C_init(&g_mss_i2c0, DUMMY_SERIAL_ADDR, MSS_I2C_PCLK_DIV_256);
@@ -69,6 +146,16 @@ int hk_adc_init(void)
     // Write to the CONFIG register
     err = hk_adc_reg_write(HK_ADC_REG_CONFIG, &send_buffer[0]);
 
+    // The background sampler sets the MUX and starts conversions itself
+    smp_config = CONFIG & ~(HK_ADC_CONFIG_MUX_SINGLE_3 | HK_ADC_CONFIG_OS_SINGLE_CONV);
+    smp_state = SMP_IDLE;
+    smp_ch = 0;
+
+    // Conversion times are measured with the DWT cycle counter
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    smp_period_start = DWT->CYCCNT;
+
     if (err == HK_ADC_NO_ERR)
     {
         return err;
@@ -96,51 +183,12 @@ int hk_adc_init(void)
  */
 int hk_adc_conv_read_volt(uint16_t * batt_volt)
 {
-    int err = HK_ADC_ERR_VOLT_READ_FAILED;
-
-    uint8_t os_bit = 0;
-    uint16_t read_value;
-
-    uint8_t send_buffer[2] = {0};
-
-    err = hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
-
-    if (err == HK_ADC_NO_ERR)
+    if (hk_adc_conv_read(HK_ADC_CONFIG_MUX_SINGLE_1, batt_volt) == HK_ADC_NO_ERR)
     {
-        // Let the rest of the configurations remain intact, just change MUX
-        // input config and start single-shot conversion
-        read_value = read_value & 0x8fff;
-        read_value = read_value | HK_ADC_CONFIG_MUX_SINGLE_1;
-
-        send_buffer[0] = (read_value >> 8) | HK_ADC_CONFIG_OS_SINGLE_CONV;
-        send_buffer[1] = read_value;
-
-        // Write changed MUX input back to the CONFIG register
-        err = hk_adc_reg_write(HK_ADC_REG_CONFIG, &send_buffer[0]);
-
-        if (err == HK_ADC_NO_ERR)
-        {
-            //INSERT DELAY FN (1sec), do not use WHILE Loops
-            //Wait until OS bit turns 1
-            do{
-                hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
-                os_bit = read_value >> 15;
-            }while(os_bit == HK_ADC_CONFIG_OS_NOT_READY);
-
-            err = hk_adc_reg_read(HK_ADC_REG_CONVERSION, &read_value);
-            if (err == HK_ADC_NO_ERR)
-            {
-                // Right shift the received result by 4 bits. Conversion value
-                // are 12 most significant bits
-                read_value = read_value >> 4;
-                *batt_volt = read_value;
-                return err;
-            }
-        }
+        return HK_ADC_NO_ERR;
     }
 
-    err = HK_ADC_ERR_VOLT_READ_FAILED;
-    return err;
+    return HK_ADC_ERR_VOLT_READ_FAILED;
 }
 
 
@@ -161,50 +209,12 @@ int hk_adc_conv_read_volt(uint16_t * batt_volt)
  */
 int hk_adc_conv_read_curr(uint16_t * batt_curr)
 {
-    uint8_t os_bit = 0;
-    uint16_t read_value;
-    uint8_t err = HK_ADC_ERR_CURR_READ_FAILED;
-
-    uint8_t send_buffer[2] = {0};
-
-    err = hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
-
-    if (err == HK_ADC_NO_ERR)
+    if (hk_adc_conv_read(HK_ADC_CONFIG_MUX_SINGLE_0, batt_curr) == HK_ADC_NO_ERR)
     {
-        // Let the rest of the configurations remain intact, just change MUX
-        // input config and start single-shot conversion
-        read_value = read_value & 0x8fff;
-        read_value = read_value | HK_ADC_CONFIG_MUX_SINGLE_0;
-
-        send_buffer[0] = (read_value >> 8) | HK_ADC_CONFIG_OS_SINGLE_CONV;
-        send_buffer[1] = read_value;
-
-        // Write changed MUX input back to the CONFIG register
-        err = hk_adc_reg_write(HK_ADC_REG_CONFIG, &send_buffer[0]);
-
-        if (err == HK_ADC_NO_ERR)
-        {
-            //INSERT DELAY FN (1sec), do not use WHILE Loops
-            //Wait until OS bit turns 1
-            do{
-                hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
-                os_bit = read_value >> 15;
-            }while(os_bit == HK_ADC_CONFIG_OS_NOT_READY);
-
-            err = hk_adc_reg_read(HK_ADC_REG_CONVERSION, &read_value);
-            if (err == HK_ADC_NO_ERR)
-            {
-                // Right shift the received result by 4 bits. Conversion value
-                // are 12 most significant bits
-                read_value = read_value >> 4;
-                *batt_curr = read_value;
-                return err;
-            }
-        }
+        return HK_ADC_NO_ERR;
     }
 
-    err = HK_ADC_ERR_CURR_READ_FAILED;
-    return err;
+    return HK_ADC_ERR_CURR_READ_FAILED;
 }
 
 
@@ -226,56 +236,97 @@ int hk_adc_conv_read_curr(uint16_t * batt_curr)
 
 int hk_adc_conv_read_citi_temp(uint16_t * citi_temp)
 {
-    int err = HK_ADC_ERR_TEMP_READ_FAILED;
+    if (hk_adc_conv_read(HK_ADC_CONFIG_MUX_SINGLE_2, citi_temp) == HK_ADC_NO_ERR)
+    {
+        return HK_ADC_NO_ERR;
+    }
+
+    return HK_ADC_ERR_TEMP_READ_FAILED;
+}
+
+
+
+
+/**
+ * @brief HK ADC single conversion function
+ *
+ * This function starts a single-shot conversion on an input, keeping the rest
+ * of the configuration as it is in the CONFIG shadow, waits for it to complete
+ * and reads its result.
+ *
+ * @param mux[in]        MUX setting of the input, HK_ADC_CONFIG_MUX_*.
+ * @param value[out]     pointer to unsigned 16-bit variable to store the result in.
+ * @return HK_ADC_ERR_READ_FAILED if any error occurs otherwise HK_ADC_NO_ERR.
+ *
+ */
+static int hk_adc_conv_read(uint16_t mux, uint16_t *value)
+{
+    int err = HK_ADC_ERR_READ_FAILED;
 
     uint8_t os_bit = 0;
     uint16_t read_value;
 
     uint8_t send_buffer[2] = {0};
 
-    err = hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
+    // Let the rest of the configurations remain intact, just change MUX
+    // input config and start single-shot conversion; the shadow saves
+    // reading CONFIG back
+    read_value = (config_shadow & 0x8fff) | mux;
+    xfers_saved += 2;
 
-    if (err == HK_ADC_NO_ERR)
-    {
-        // Let the rest of the configurations remain intact, just change MUX
-        // input config and start single-shot conversion
-        read_value = read_value & 0x8fff;
-        read_value = read_value | HK_ADC_CONFIG_MUX_SINGLE_2;
+    send_buffer[0] = (read_value >> 8) | (HK_ADC_CONFIG_OS_SINGLE_CONV >> 8);
+    send_buffer[1] = read_value;
 
-        send_buffer[0] = (read_value >> 8) | HK_ADC_CONFIG_OS_SINGLE_CONV;
-        send_buffer[1] = read_value;
+    // Write changed MUX input back to the CONFIG register
+    err = hk_adc_reg_write(HK_ADC_REG_CONFIG, &send_buffer[0]);
 
-        // Write changed MUX input back to the CONFIG register
-        err = hk_adc_reg_write(HK_ADC_REG_CONFIG, &send_buffer[0]);
+    if (err == HK_ADC_NO_ERR)
+    {
+        //Wait until OS bit turns 1
+        do{
+            err = hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
+            os_bit = read_value >> 15;
+        }while((err == HK_ADC_NO_ERR) && (os_bit == HK_ADC_CONFIG_OS_NOT_READY));
 
         if (err == HK_ADC_NO_ERR)
         {
-            //INSERT DELAY FN (1sec), do not use WHILE Loops
-            //Wait until OS bit turns 1
-            do{
-                hk_adc_reg_read(HK_ADC_REG_CONFIG, &read_value);
-                os_bit = read_value >> 15;
-            }while(os_bit == HK_ADC_CONFIG_OS_NOT_READY);
-
             err = hk_adc_reg_read(HK_ADC_REG_CONVERSION, &read_value);
-            if (err == HK_ADC_NO_ERR)
-            {
-                // Right shift the received result by 4 bits. Conversion value
-                // are 12 most significant bits
-                read_value = read_value >> 4;
-                *citi_temp = read_value;
-                return err;
-            }
+        }
+
+        if (err == HK_ADC_NO_ERR)
+        {
+            // Right shift the received result by 4 bits. Conversion value
+            // are 12 most significant bits
+            *value = read_value >> 4;
+            return err;
         }
     }
 
-    err = HK_ADC_ERR_TEMP_READ_FAILED;
+    err = HK_ADC_ERR_READ_FAILED;
     return err;
 }
 
 
 
 
+/**
+ * @brief HK ADC I2C transaction count function
+ *
+ * @param done[out]      number of I2C0 transactions made to the HK ADC.
+ * @param saved[out]     number of I2C0 transactions saved by the CONFIG and
+ *                       pointer shadows and repeated-start reads.
+ * @return None.
+ *
+ */
+void hk_adc_get_xfer_counts(uint32_t *done, uint32_t *saved)
+{
+    *done = xfers;
+    *saved = xfers_saved;
+}
+
+
+
+
 /**
  * @brief HK ADC register write function
  *
@@ -330,13 +381,23 @@ static int hk_adc_reg_write(hk_adc_register_t reg, uint8_t *write_buffer)
 
     // Wait for completion and record the outcome
     status = MSS_I2C_wait_complete(&g_mss_i2c0, MSS_I2C_NO_TIMEOUT);
+    xfers++;
 
     if (status == MSS_I2C_SUCCESS)
     {
+        // The write leaves the pointer at the register
+        ptr_shadow = send_buffer[0];
+        if (reg == HK_ADC_REG_CONFIG)
+        {
+            config_shadow = ((send_buffer[1] << 8) | send_buffer[2]) &
+                            ~HK_ADC_CONFIG_OS_SINGLE_CONV;
+        }
+
         err = HK_ADC_NO_ERR;
         return err;
     }
 
+    ptr_shadow = PTR_UNKNOWN;
     err = HK_ADC_ERR_WRITE_FAILED;
     return err;
 }
@@ -391,31 +452,36 @@ static int hk_adc_reg_read(hk_adc_register_t reg, uint16_t *read_buffer)
             //no other register possible
     }
 
-    // Write to Address Pointer Register - pointing to 'reg'
-    MSS_I2C_write(&g_mss_i2c0, HK_ADC_ADDRESS_GND, &send_buffer, TX_LENGTH,
-                    MSS_I2C_RELEASE_BUS);
-
-    // Wait for completion and record the outcome
-    status = MSS_I2C_wait_complete(&g_mss_i2c0, MSS_I2C_NO_TIMEOUT);
-
-    // Proceed only if it is a success
-    if (status == MSS_I2C_SUCCESS)
+    if (ptr_shadow == send_buffer)
     {
-        // Read data from target slave (we always read 2B)
+        // Pointer already at 'reg': read straight away
         MSS_I2C_read(&g_mss_i2c0, HK_ADC_ADDRESS_GND, &rx_buffer[0], RX_LENGTH,
                         MSS_I2C_RELEASE_BUS);
+    }
+    else
+    {
+        // Write to Address Pointer Register - pointing to 'reg' - and read
+        // data (we always read 2B) after a repeated start
+        MSS_I2C_write_read(&g_mss_i2c0, HK_ADC_ADDRESS_GND, &send_buffer,
+                        TX_LENGTH, &rx_buffer[0], RX_LENGTH,
+                        MSS_I2C_RELEASE_BUS);
+    }
 
-        status = MSS_I2C_wait_complete(&g_mss_i2c0, MSS_I2C_NO_TIMEOUT);
+    // Wait for completion and record the outcome
+    status = MSS_I2C_wait_complete(&g_mss_i2c0, MSS_I2C_NO_TIMEOUT);
+    xfers++;
+    xfers_saved++;
 
-        if(status == MSS_I2C_SUCCESS)
-        {
-            read_value = rx_buffer[0] << 8 | rx_buffer[1];
-            *read_buffer = read_value;
-            err = HK_ADC_NO_ERR;
-            return err;
-        }
+    if(status == MSS_I2C_SUCCESS)
+    {
+        ptr_shadow = send_buffer;
+        read_value = rx_buffer[0] << 8 | rx_buffer[1];
+        *read_buffer = read_value;
+        err = HK_ADC_NO_ERR;
+        return err;
     }
 
+    ptr_shadow = PTR_UNKNOWN;
     err = HK_ADC_ERR_READ_FAILED;
     return err;
 }
@@ -426,8 +492,8 @@ static int hk_adc_reg_read(hk_adc_register_t reg, uint16_t *read_buffer)
 /**
  * @brief HK ADC average voltage calculation function
  *
- * This function calculates the average battery voltage from raw ADC voltage
- * values. Number of samples to be averaged is 8.
+ * This function returns the average battery voltage from raw ADC voltage
+ * values, filtered from the samples taken by the background sampler.
  *
  * @param None.
  *
@@ -436,16 +502,7 @@ static int hk_adc_reg_read(hk_adc_register_t reg, uint16_t *read_buffer)
  */
 uint16_t hk_adc_calc_avg_voltage(void)
 {
-    uint16_t sum = 0;
-    uint16_t volt_array[8];
-
-    for (int i = 0; i < 8; i ++)
-    {
-        hk_adc_conv_read_volt(&volt_array[i]);
-        sum += volt_array[i];
-    }
-
-    return (sum >> 3);
+    return hk_adc_get_avg(HK_ADC_CH_BATT_VOLT);
 }
 
 
@@ -454,8 +511,8 @@ uint16_t hk_adc_calc_avg_voltage(void)
 /**
  * @brief HK ADC average current calculation function
  *
- * This function calculates the average battery current from raw ADC voltage
- * values. Number of samples to be averaged is 8.
+ * This function returns the average battery current from raw ADC voltage
+ * values, filtered from the samples taken by the background sampler.
  *
  * @param None.
  *
@@ -464,44 +521,314 @@ uint16_t hk_adc_calc_avg_voltage(void)
  */
 uint16_t hk_adc_calc_avg_current(void)
 {
-    uint16_t sum = 0;
-    uint16_t curr_array[8];
+    return hk_adc_get_avg(HK_ADC_CH_BATT_CURR);
+}
+
+
+
+
+/**
+ * @brief HK ADC average CITIROC temperature calculation function
+ *
+ * This function returns the average CITIROC temperature from raw ADC voltage
+ * values, filtered from the samples taken by the background sampler.
+ *
+ * @param None.
+ *
+ * @return Average CITIROC temperature raw value.
+ *
+ */
+uint16_t hk_adc_calc_avg_citi_temp(void)
+{
+    return hk_adc_get_avg(HK_ADC_CH_CITI_TEMP);
+}
+
+
+
 
-    for (int i = 0; i < 8; i ++)
+/**
+ * @brief HK ADC channel average function
+ *
+ * @param ch[in]     Channel to get the average of.
+ *
+ * @return Filtered raw value of the channel, see hk_adc_set_filter(); 0 if no
+ *         sample has been taken yet.
+ *
+ */
+uint16_t hk_adc_get_avg(hk_adc_channel_t ch)
+{
+    const struct hk_adc_chan *c = &chans[ch];
+
+    if (c->count == 0)
+    {
+        return 0;
+    }
+
+    if (c->filter == HK_ADC_FILTER_IIR)
     {
-        hk_adc_conv_read_curr(&curr_array[i]);
-        sum += curr_array[i];
+        return c->acc >> c->param;
     }
 
-    return (sum >> 3);
+    return c->acc / c->count;
 }
 
 
 
 
 /**
- * @brief HK ADC average CITIROC temperature calculation function
+ * @brief HK ADC channel filter setting function
+ *
+ * @param ch[in]         Channel to set the filter of.
+ * @param filter[in]     HK_ADC_FILTER_BOXCAR or HK_ADC_FILTER_IIR.
+ * @param param[in]      Number of samples averaged (boxcar) or shift (IIR).
+ * @return HK_ADC_ERR_INVALID_PARAM if any argument is out of range otherwise
+ *         HK_ADC_NO_ERR.
+ *
+ */
+int hk_adc_set_filter(hk_adc_channel_t ch, hk_adc_filter_t filter, uint8_t param)
+{
+    uint8_t max;
+
+    if ((ch >= HK_ADC_CH_COUNT) || (filter > HK_ADC_FILTER_IIR))
+    {
+        return HK_ADC_ERR_INVALID_PARAM;
+    }
+
+    max = (filter == HK_ADC_FILTER_IIR) ? HK_ADC_IIR_SHIFT_MAX :
+                                          HK_ADC_BOXCAR_MAX;
+    if ((param == 0) || (param > max))
+    {
+        return HK_ADC_ERR_INVALID_PARAM;
+    }
+
+    chans[ch].filter = filter;
+    chans[ch].param = param;
+    hk_adc_filter_reset(ch);
+
+    return HK_ADC_NO_ERR;
+}
+
+
+
+
+/**
+ * @brief HK ADC sampling setting function
  *
- * This function calculates the average CITIROC temperature from raw ADC voltage
- * values. Number of samples to be averaged is 8.
+ * The data rate and PGA take effect from the next conversion. As the PGA sets
+ * the scale of the raw values, all filters are restarted.
+ *
+ * @param dr[in]         Data rate, DR[2:0] field of the CONFIG register
+ *                       (HK_ADC_CONFIG_DR_* >> 5).
+ * @param pga[in]        Full-scale range, PGA[2:0] field of the CONFIG
+ *                       register (HK_ADC_CONFIG_FSR_* >> 9).
+ * @param period_ms[in]  Time between the start of two conversions, from
+ *                       HK_ADC_SAMPLE_PERIOD_MIN_MS to
+ *                       HK_ADC_SAMPLE_PERIOD_MAX_MS.
+ * @return HK_ADC_ERR_INVALID_PARAM if any argument is out of range otherwise
+ *         HK_ADC_NO_ERR.
+ *
+ */
+int hk_adc_set_sampling(uint8_t dr, uint8_t pga, uint16_t period_ms)
+{
+    int ch;
+
+    if ((dr > (CONFIG_DR_MASK >> CONFIG_DR_SHIFT)) ||
+            (pga > (CONFIG_PGA_MASK >> CONFIG_PGA_SHIFT)) ||
+            (period_ms < HK_ADC_SAMPLE_PERIOD_MIN_MS) ||
+            (period_ms > HK_ADC_SAMPLE_PERIOD_MAX_MS))
+    {
+        return HK_ADC_ERR_INVALID_PARAM;
+    }
+
+    smp_config = (smp_config & ~(CONFIG_DR_MASK | CONFIG_PGA_MASK)) |
+                 (dr << CONFIG_DR_SHIFT) | (pga << CONFIG_PGA_SHIFT);
+    smp_period_ms = period_ms;
+    smp_discard = (smp_state != SMP_IDLE);
+
+    for (ch = 0; ch < HK_ADC_CH_COUNT; ch++)
+    {
+        hk_adc_filter_reset(ch);
+    }
+
+    return HK_ADC_NO_ERR;
+}
+
+
+
+
+/**
+ * @brief HK ADC background sampler function
+ *
+ * This function is called from the main loop. It advances the sampler by at
+ * most one step and never waits on the I2C bus: one single-shot conversion is
+ * started every sample period, on the next channel in turn, and its
+ * result is read once the conversion time has elapsed. Failed transfers are
+ * dropped, and the channel keeps its previous samples.
+ *
+ * The blocking hk_adc_conv_read_*() functions must not be used while the
+ * sampler runs, as they share I2C0.
  *
  * @param None.
+ * @return None.
  *
- * @return Average CITIROC temperature raw value.
+ */
+void hk_adc_poll(void)
+{
+    const uint32_t cycles_per_us = SystemCoreClock / 1000000;
+    mss_i2c_status_t status;
+    uint16_t config;
+
+    switch (smp_state)
+    {
+        case SMP_IDLE:
+            if ((DWT->CYCCNT - smp_period_start) <
+                    cycles_per_us * 1000 * smp_period_ms)
+            {
+                break;
+            }
+
+            // Select the channel and start a single-shot conversion
+            config = smp_config | chans[smp_ch].mux |
+                     HK_ADC_CONFIG_OS_SINGLE_CONV;
+            smp_tx[0] = HK_ADC_REG_PTR_CONFIG;
+            smp_tx[1] = config >> 8;
+            smp_tx[2] = config;
+
+            smp_period_start = DWT->CYCCNT;
+            MSS_I2C_write(&g_mss_i2c0, HK_ADC_ADDRESS_GND, &smp_tx[0], 3,
+                    MSS_I2C_RELEASE_BUS);
+            smp_state = SMP_START;
+            break;
+
+        case SMP_START:
+            status = MSS_I2C_get_status(&g_mss_i2c0);
+            if (status == MSS_I2C_IN_PROGRESS)
+            {
+                break;
+            }
+
+            xfers++;
+            xfers_saved += 2;       // CONFIG not read back
+            if (status == MSS_I2C_SUCCESS)
+            {
+                ptr_shadow = HK_ADC_REG_PTR_CONFIG;
+                config_shadow = ((smp_tx[1] << 8) | smp_tx[2]) &
+                                ~HK_ADC_CONFIG_OS_SINGLE_CONV;
+                smp_conv_start = DWT->CYCCNT;
+                smp_state = SMP_CONV;
+            }
+            else
+            {
+                ptr_shadow = PTR_UNKNOWN;
+                smp_ch = (smp_ch + 1) % HK_ADC_CH_COUNT;
+                smp_discard = 0;
+                smp_state = SMP_IDLE;
+            }
+            break;
+
+        case SMP_CONV:
+            if ((DWT->CYCCNT - smp_conv_start) <
+                    cycles_per_us * conv_time_us[(smp_config & CONFIG_DR_MASK)
+                                                 >> CONFIG_DR_SHIFT])
+            {
+                break;
+            }
+
+            // Point to the conversion register and read it, in one transfer
+            smp_tx[0] = HK_ADC_REG_PTR_CONVERSION;
+            MSS_I2C_write_read(&g_mss_i2c0, HK_ADC_ADDRESS_GND, &smp_tx[0], 1,
+                    &smp_rx[0], RX_LENGTH, MSS_I2C_RELEASE_BUS);
+            smp_state = SMP_READ;
+            break;
+
+        case SMP_READ:
+            status = MSS_I2C_get_status(&g_mss_i2c0);
+            if (status == MSS_I2C_IN_PROGRESS)
+            {
+                break;
+            }
+
+            // Conversion value are 12 most significant bits
+            xfers++;
+            xfers_saved++;          // pointer write and read in one
+            ptr_shadow = (status == MSS_I2C_SUCCESS) ?
+                         HK_ADC_REG_PTR_CONVERSION : PTR_UNKNOWN;
+            if ((status == MSS_I2C_SUCCESS) && !smp_discard)
+            {
+                hk_adc_sample_add(smp_ch, ((smp_rx[0] << 8) | smp_rx[1]) >> 4);
+            }
+            smp_discard = 0;
+
+            smp_ch = (smp_ch + 1) % HK_ADC_CH_COUNT;
+            smp_state = SMP_IDLE;
+            break;
+
+        default:
+            smp_state = SMP_IDLE;
+            break;
+    }
+}
+
+
+
+
+/**
+ * @brief HK ADC sample storage function
+ *
+ * This function feeds a sample to the filter of a channel. The boxcar filter
+ * replaces the oldest sample and keeps the sum of its samples up to date; the
+ * IIR filter starts from the first sample.
+ *
+ * @param ch[in]         Channel the sample was taken on.
+ * @param sample[in]     Raw conversion value.
+ * @return None.
  *
  */
-uint16_t hk_adc_calc_avg_citi_temp(void)
+static void hk_adc_sample_add(hk_adc_channel_t ch, uint16_t sample)
 {
-    uint16_t sum = 0;
-    uint16_t citi_temp_array[8];
+    struct hk_adc_chan *c = &chans[ch];
 
-    for (int i = 0; i < 8; i ++)
+    if (c->filter == HK_ADC_FILTER_IIR)
     {
-        hk_adc_conv_read_citi_temp(&citi_temp_array[i]);
-        sum += citi_temp_array[i];
+        if (c->count == 0)
+        {
+            c->acc = (uint32_t)sample << c->param;
+            c->count = 1;
+        }
+        else
+        {
+            c->acc = c->acc - (c->acc >> c->param) + sample;
+        }
+        return;
+    }
+
+    if (c->count == c->param)
+    {
+        c->acc -= c->samples[c->idx];
+    }
+    else
+    {
+        c->count++;
     }
 
-    return (sum >> 3);
+    c->samples[c->idx] = sample;
+    c->acc += sample;
+    c->idx = (c->idx + 1) % c->param;
 }
 
 
+
+
+/**
+ * @brief HK ADC filter restart function
+ *
+ * @param ch[in]         Channel to restart the filter of.
+ * @return None.
+ *
+ */
+static void hk_adc_filter_reset(hk_adc_channel_t ch)
+{
+    chans[ch].acc = 0;
+    chans[ch].idx = 0;
+    chans[ch].count = 0;
+}
@@ -216,7 +216,8 @@ typedef enum {
     HK_ADC_ERR_CURR_READ_FAILED,        /* HK ADC battery current read operation failed */
     HK_ADC_ERR_TEMP_READ_FAILED,        /* HK ADC CITIROC temperature read operation failed */
     HK_ADC_ERR_WRITE_FAILED,            /* HK ADC Write operation failed */
-    HK_ADC_ERR_CONV_CONFIG_FAILED       /* HK ADC Configuration operation for conversion register failed */
+    HK_ADC_ERR_CONV_CONFIG_FAILED,      /* HK ADC Configuration operation for conversion register failed */
+    HK_ADC_ERR_INVALID_PARAM            /* HK ADC sampler or filter setting out of range */
 } hk_adc_return_t;
 
 
@@ -231,6 +232,39 @@ typedef enum {
 
 
 
+/******* HK ADC background sampler *******/
+
+/*
+ * Channels sampled in the background by hk_adc_poll(), in turn, one
+ * single-shot conversion per sample period, so that the samples of each
+ * channel are spread over the HK period. Each channel has its own filter:
+ *   HK_ADC_FILTER_BOXCAR : average of the last N samples, N from 1 to
+ *                          HK_ADC_BOXCAR_MAX;
+ *   HK_ADC_FILTER_IIR    : first-order IIR, y += (x - y) / 2^shift, shift
+ *                          from 1 to HK_ADC_IIR_SHIFT_MAX.
+ * Setting a filter, the data rate or the PGA restarts the filters.
+ */
+typedef enum {
+    HK_ADC_CH_BATT_CURR = 0,                    /* AIN0 */
+    HK_ADC_CH_BATT_VOLT,                        /* AIN1 */
+    HK_ADC_CH_CITI_TEMP,                        /* AIN2 */
+    HK_ADC_CH_COUNT
+} hk_adc_channel_t;
+
+typedef enum {
+    HK_ADC_FILTER_BOXCAR = 0,
+    HK_ADC_FILTER_IIR
+} hk_adc_filter_t;
+
+#define HK_ADC_SAMPLE_PERIOD_MS             (40)        /* default */
+#define HK_ADC_SAMPLE_PERIOD_MIN_MS         (10)
+#define HK_ADC_SAMPLE_PERIOD_MAX_MS         (1000)
+#define HK_ADC_BOXCAR_MAX                   (16)
+#define HK_ADC_BOXCAR_DEFAULT               (8)
+#define HK_ADC_IIR_SHIFT_MAX                (8)
+
+
+
 /******* Exported Function prototypes *******/
 int hk_adc_init(void);
 int hk_adc_conv_read_volt(uint16_t * batt_volt);               //instantaneous value
@@ -239,6 +273,11 @@ int hk_adc_conv_read_citi_temp(uint16_t * citi_temp);          //instantaneous v
 uint16_t hk_adc_calc_avg_voltage(void);                        //average value
 uint16_t hk_adc_calc_avg_current(void);                        //average value
 uint16_t hk_adc_calc_avg_citi_temp(void);                      //average value
+uint16_t hk_adc_get_avg(hk_adc_channel_t ch);
+int hk_adc_set_filter(hk_adc_channel_t ch, hk_adc_filter_t filter, uint8_t param);
+int hk_adc_set_sampling(uint8_t dr, uint8_t pga, uint16_t period_ms);
+void hk_adc_poll(void);
+void hk_adc_get_xfer_counts(uint32_t *done, uint32_t *saved);
 
 
 #endif /* HK_ADC_HK_ADC_H_ */
@@ -26,12 +26,12 @@
 
 
 #include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
 #include <math.h>
 
 #include "hvps_c11204-02.h"
 
+#include "../firmware/CMSIS/m2sxxx.h"
+#include "../firmware/CMSIS/system_m2sxxx.h"
 #include "../firmware/drivers/mss_uart/mss_uart.h"
 #include "../firmware/drivers/mss_nvm/mss_nvm.h"
 
@@ -50,24 +50,183 @@
  *  Local Function Prototypes
  * =============================================================================
  */
+struct hvps_req;
+
 static void UART0_RXHandler(mss_uart_instance_t* this_uart);
-static int send_cmd_and_check_reply(char* cmd);
-static int voltage_less_than(double v);
+static int send_cmd_and_check_reply(enum hvps_cmd cmd, const uint16_t *params);
+static int voltage_less_than(uint16_t vb, double v);
+static uint8_t encode_frame(char *frame, enum hvps_cmd cmd,
+		const uint16_t *params);
+static uint16_t reply_field(const char *reply, int n);
+static void state_update(const struct hvps_req *r);
+static int state_is_fresh(void);
+static void rx_decode(void);
+static int reply_received(uint8_t len);
 
 /*
  * =============================================================================
  *  Local Variables
  * =============================================================================
  */
-static char hvps_cmd[36];
 static uint16_t cmds_sent = 0;
 static uint16_t cmds_acked = 0;
 static uint16_t cmds_failed = 0;
-static uint8_t last_cmd = 0x00;
+static uint16_t cmds_retried = 0;
+static uint16_t cmds_timed_out = 0;
+static uint16_t rx_bad_frames = 0;     // counted by rx_decode()
+static uint16_t rx_overruns = 0;       // counted by the UART RX handler
 static uint16_t last_cmd_err = 0x0000;
 
 static char hvps_reply[51];
-static volatile uint8_t hvps_reply_ready = 0;
+
+/*
+ * UART0 RX ring, filled by the UART RX handler and emptied by rx_decode() in
+ * the main loop; rx_head and rx_tail are free-running, each written on one
+ * side only.
+ */
+#define RX_RING_LEN     (128)   // power of two
+
+static uint8_t rx_ring[RX_RING_LEN];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+
+/*
+ * Reply decoder states: a frame is STX, the reply, ETX, two checksum digits
+ * and CR; it is collected into hvps_reply. dec_state is only used by
+ * rx_decode() and hvps_init().
+ */
+#define DEC_STX         (0)
+#define DEC_BODY        (1)
+#define DEC_CHK_HI      (2)
+#define DEC_CHK_LO      (3)
+#define DEC_CR          (4)
+
+static uint8_t dec_state = DEC_STX;
+
+#define STX         (0x02)
+#define ETX         (0x03)
+#define CR          ('\r')
+
+/*
+ * Command descriptors, indexed by `enum hvps_cmd`. Commands without parameters
+ * are sent from a frame prebuilt here, checksum included; the others are framed
+ * by encode_frame(). The reply to each command holds `nreply` four-digit hex
+ * fields, which are decoded in place by reply_field().
+ *
+ * `err_idx` identifies the command in hvps_get_last_cmd_err(); the numbering
+ * is that of the command list in the C11204-02 Command Reference Manual.
+ */
+#define FRAME(cmd, chk)     "\x02" cmd "\x03" chk "\r"
+
+#define FIXED(cmd, idx, nreply, chk) \
+	{ cmd, idx, 0, nreply, FRAME(cmd, chk), sizeof(FRAME(cmd, chk)) - 1 }
+#define PARAM(cmd, idx, nparams) \
+	{ cmd, idx, nparams, 0, NULL, 0 }
+
+static const struct hvps_cmd_desc {
+	char name[5];
+	uint8_t err_idx;
+	uint8_t nparams;
+	uint8_t nreply;
+	const char *frame;
+	uint8_t frame_len;
+} hvps_cmds[HVPS_CMD_COUNT] = {
+	[HVPS_CMD_HON]  = FIXED("HON",  11, 0, "EA"),
+	[HVPS_CMD_HOF]  = FIXED("HOF",  10, 0, "E2"),
+	[HVPS_CMD_HRE]  = FIXED("HRE",  12, 0, "E4"),
+	[HVPS_CMD_HCM0] = FIXED("HCM0", 13, 0, "0D"),
+	[HVPS_CMD_HCM1] = FIXED("HCM1", 13, 0, "0E"),
+	[HVPS_CMD_HGV]  = FIXED("HGV",   5, 1, "EA"),
+	[HVPS_CMD_HGC]  = FIXED("HGC",   6, 1, "D7"),
+	[HVPS_CMD_HGT]  = FIXED("HGT",   7, 1, "E8"),
+	[HVPS_CMD_HGS]  = FIXED("HGS",   4, 1, "E7"),
+	[HVPS_CMD_HRT]  = FIXED("HRT",   2, 6, "F3"),
+	[HVPS_CMD_HPO]  = FIXED("HPO",   3, 6, "EC"),
+	[HVPS_CMD_HST]  = PARAM("HST",   1, 6),
+	[HVPS_CMD_HBV]  = PARAM("HBV",  16, 1),
+};
+
+static const char hex_digit[16] = "0123456789ABCDEF";
+
+/* Value of each hex digit; other characters decode as 0 */
+static const uint8_t hex_val[128] = {
+	['0'] = 0x0, ['1'] = 0x1, ['2'] = 0x2, ['3'] = 0x3, ['4'] = 0x4,
+	['5'] = 0x5, ['6'] = 0x6, ['7'] = 0x7, ['8'] = 0x8, ['9'] = 0x9,
+	['A'] = 0xa, ['B'] = 0xb, ['C'] = 0xc, ['D'] = 0xd, ['E'] = 0xe,
+	['F'] = 0xf,
+	['a'] = 0xa, ['b'] = 0xb, ['c'] = 0xc, ['d'] = 0xd, ['e'] = 0xe,
+	['f'] = 0xf,
+};
+
+/*
+ * Command queue. Commands are sent from the entry at q_head, whose state
+ * reply_received() sets to REQ_DONE once the reply has been received; q_head
+ * and q_tail are free-running. The queue is only used from the main loop.
+ */
+#define REQ_QUEUED  (0)
+#define REQ_SENT    (1)
+#define REQ_DONE    (2)
+
+struct hvps_req {
+	char frame[36];
+	uint8_t len;
+	uint8_t cmd;
+	uint8_t tries;
+	uint8_t state;
+	int result;
+	uint32_t sent_time;
+	hvps_callback_t cb;
+	void *arg;
+};
+
+static struct hvps_req queue[HVPS_QUEUE_LEN];
+static unsigned int q_head = 0;
+static unsigned int q_tail = 0;
+
+static void send_req(struct hvps_req *r);
+
+/*
+ * Monitor readout, from the last `HPO` command; the fields of its reply are
+ * the status, two settings not used here, then the output voltage, output
+ * current and temperature monitors.
+ */
+#define HPO_FIELD_STATUS    (0)
+#define HPO_FIELD_VOLT      (3)
+#define HPO_FIELD_CURR      (4)
+#define HPO_FIELD_TEMP      (5)
+
+static struct hvps_monitor monitor = {
+	.status = 0xffff,
+	.volt = 0xffff,
+	.curr = 0xffff,
+	.temp = 0x0001,
+};
+
+/*
+ * Last known status of the HVPS, from status readouts (`HGS`, `HPO`) and
+ * commands with a known effect on it (`HON`, `HOF`). It is trusted for
+ * HVPS_STATE_MAX_AGE_MS, after which hvps_is_on() reads the status again.
+ */
+static struct {
+	uint16_t status;
+	uint8_t valid;
+	uint32_t time;
+} state = {
+	.status = 0xffff,
+	.valid = 0,
+	.time = 0,
+};
+
+/* Value commands, and the value reported if they fail */
+static const struct {
+	enum hvps_cmd cmd;
+	uint16_t invalid;
+} hvps_values[] = {
+	[HVPS_VOLTAGE] = { HVPS_CMD_HGV, 0xffff },
+	[HVPS_CURRENT] = { HVPS_CMD_HGC, 0xffff },
+	[HVPS_TEMP]    = { HVPS_CMD_HGT, 0x0001 },
+	[HVPS_STATUS]  = { HVPS_CMD_HGS, 0xffff },
+};
 
 
 /**
@@ -84,8 +243,16 @@ void hvps_init(void)
 	/* Init UART for communicating to HVPS module */
 	MSS_UART_init(&g_mss_uart0, MSS_UART_38400_BAUD, MSS_UART_DATA_8_BITS |
 			MSS_UART_EVEN_PARITY | MSS_UART_ONE_STOP_BIT);
+
+	/* Start from an empty RX ring, with the decoder waiting for a frame */
+	rx_tail = rx_head;
+	dec_state = DEC_STX;
 	MSS_UART_set_rx_handler(&g_mss_uart0, UART0_RXHandler,
 			MSS_UART_FIFO_FOUR_BYTES);
+
+	/* Command timeouts are measured with the DWT cycle counter */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 }
 
 
@@ -100,7 +267,7 @@ void hvps_init(void)
  */
 int hvps_turn_on()
 {
-	return send_cmd_and_check_reply("HON");
+	return send_cmd_and_check_reply(HVPS_CMD_HON, NULL);
 }
 
 
@@ -115,7 +282,7 @@ int hvps_turn_on()
  */
 int hvps_turn_off()
 {
-	return send_cmd_and_check_reply("HOF");
+	return send_cmd_and_check_reply(HVPS_CMD_HOF, NULL);
 }
 
 
@@ -130,7 +297,7 @@ int hvps_turn_off()
  */
 int hvps_reset()
 {
-	return send_cmd_and_check_reply("HRE");
+	return send_cmd_and_check_reply(HVPS_CMD_HRE, NULL);
 }
 
 
@@ -152,19 +319,15 @@ int hvps_reset()
  */
 int hvps_set_temp_corr_factor(struct hvps_temp_corr_factor *f)
 {
-	char cmd[28]="HST";
+	uint16_t params[6] = {
+		(uint16_t)f->dtp1, (uint16_t)f->dtp2, f->dt1, f->dt2, f->vb, f->tb
+	};
 
-	/*
-	 * Compose command string, converting int16's into ASCII; check that
-	 * the applied voltage is acceptable; then compose the command string
-	 * and send it over UART
-	 */
-	sprintf(&cmd[3], "%04X%04X%04X%04X%04X%04X", f->dtp1, f->dtp2, f->dt1,
-			f-> dt2, f->vb, f->tb);
-	if (!voltage_less_than(HVPS_MAX_VB))
+	/* Check that the applied voltage is acceptable, then send the command */
+	if (!voltage_less_than(f->vb, HVPS_MAX_VB))
 		return -1;
 
-	return send_cmd_and_check_reply(cmd);
+	return send_cmd_and_check_reply(HVPS_CMD_HST, params);
 }
 
 
@@ -179,7 +342,7 @@ int hvps_set_temp_corr_factor(struct hvps_temp_corr_factor *f)
  */
 int hvps_temp_compens_en()
 {
-	return send_cmd_and_check_reply("HCM1");
+	return send_cmd_and_check_reply(HVPS_CMD_HCM1, NULL);
 }
 
 
@@ -194,7 +357,7 @@ int hvps_temp_compens_en()
  */
 int hvps_temp_compens_dis()
 {
-	return send_cmd_and_check_reply("HCM0");
+	return send_cmd_and_check_reply(HVPS_CMD_HCM0, NULL);
 }
 
 
@@ -215,109 +378,81 @@ int hvps_temp_compens_dis()
  */
 int hvps_set_temporary_voltage(uint16_t vb)
 {
-	/* Prep command string and parameter */
-	char cmd[8] = "HBV";
-	sprintf(&cmd[3], "%04X", vb);
-
 	/* Give up early if voltage is too high */
-	if(!voltage_less_than(HVPS_MAX_VB))
+	if(!voltage_less_than(vb, HVPS_MAX_VB))
 		return -1;
 
 	/* Attempt to send command */
-	return send_cmd_and_check_reply(cmd);
+	return send_cmd_and_check_reply(HVPS_CMD_HBV, &vb);
 }
 
 
 /**
  * @brief Get temperature readout from the C11204-02
  *
- * This function will send an `HGT` command to the HVPS to retrieve the
- * temperature readout made by the HVPS.
+ * The readout is the one from the last `HPO` command, see
+ * hvps_update_monitor_async().
  *
  * @return The temperature readout from the HVPS, in the format specified by the
  *         C11204-02 Command Reference Manual.
  *
- *         If the readout was not successful (the reply was not `hgv`), the
+ *         If the readout was not successful (the reply was not `hpo`), the
  *         value `1` is returned. This converts to 188.18 deg. C, a temperature
  *         at which the HVPS can no longer operate - thus unreachable.
  */
 uint16_t hvps_get_temp(void)
 {
-	uint16_t temp = 1; // default should not be valid reading
-	char valstr[4];
-
-	if (send_cmd_and_check_reply("HGT") == 0) {
-		strncpy(valstr, hvps_reply + 4, 4);
-		temp = (uint16_t)strtoul(valstr, NULL, 16);
-	}
-
-	return temp;
+	return monitor.temp;
 }
 
 
 /**
  * @brief Get voltage readout from the C11204-02
  *
- * This function will send an `HGV` command to the HVPS to retrieve the
- * temperature readout made by the HVPS.
+ * The readout is the one from the last `HPO` command, see
+ * hvps_update_monitor_async().
  *
  * @return The voltage readout from the HVPS, in the format specified by the
  *         C11204-02 Command Reference Manual.
  *
- *         If the readout was not successful (the reply was not `hgv`), the
+ *         If the readout was not successful (the reply was not `hpo`), the
  *         value `0xffff` is returned. This converts to 118.7 V, a value that
  *         cannot be produced at the output of the HVPS, thus unreachable.
  */
 uint16_t hvps_get_voltage(void)
 {
-	uint16_t v = 0xffff; // default should not be valid reading
-	char valstr[4];
-
-	if (send_cmd_and_check_reply("HGV") == 0) {
-		strncpy(valstr, hvps_reply + 4, 4);
-		v = (uint16_t)strtoul(valstr, NULL, 16);
-	}
-
-	return v;
+	return monitor.volt;
 }
 
 
 /**
  * @brief Get current readout from the C11204-02
  *
- * This function will send an `HGC` command to the HVPS to retrieve the
- * temperature readout made by the HVPS.
+ * The readout is the one from the last `HPO` command, see
+ * hvps_update_monitor_async().
  *
  * @return The current readout from the HVPS, in the format specified by the
  *         C11204-02 Command Reference Manual.
  *
- *         If the readout was not successful (the reply was not `hgc`), the
+ *         If the readout was not successful (the reply was not `hpo`), the
  *         value `0xffff` is returned. This converts to 340.4 mA, a current that
  *         cannot be supplied by the HVPS, thus unreachable.
  */
 uint16_t hvps_get_current(void)
 {
-	uint16_t i = 0xffff; // default should not be valid reading
-	char valstr[4];
-
-	if (send_cmd_and_check_reply("HGC") == 0) {
-		strncpy(valstr, hvps_reply + 4, 4);
-		i = (uint16_t)strtoul(valstr, NULL, 16);
-	}
-
-	return i;
+	return monitor.curr;
 }
 
 /**
  * @brief Get the status of the HVPS module
  *
- * This function will send an `HGS` command to the HVPS to retrieve the status
- * of the module.
+ * The status is the one from the last `HPO` command, see
+ * hvps_update_monitor_async().
  *
  * @return The status readout from the HVPS, in the format specified by the
  *         C11204-02 Command Reference Manual.
  *
- *         If the readout was not successful (the reply was not `hgs`), the
+ *         If the readout was not successful (the reply was not `hpo`), the
  *         value `0xffff` is returned. Considering a few of the bits in the
  *         status readout are unused and those read as '0' when the status is
  *         correctly retrieved, the `0xffff` reply should not occur on a
@@ -325,15 +460,7 @@ uint16_t hvps_get_current(void)
  */
 uint16_t hvps_get_status(void)
 {
-    uint16_t s = 0xffff; // default should not be a valid reading
-	char valstr[4];
-
-    if (send_cmd_and_check_reply("HGS") == 0) {
-		strncpy(valstr, hvps_reply + 4, 4);
-		s = (uint16_t)strtoul(valstr, NULL, 16);
-    }
-
-    return s;
+	return monitor.status;
 }
 
 
@@ -342,16 +469,16 @@ uint16_t hvps_get_status(void)
  *
  * In the event of an error in the UART communication, the HVPS replies with a
  * four-byte error code in ASCII format. Of this format, only the least
- * significant byte is used. Hence, the UART0_RXhandler() function below simply
- * strips away the last byte in the four-byte ASCII code within the "hxx" and
- * applies a binary representation of the ASCII character to the least
- * significant byte.
+ * significant byte is used. Hence, reply_received(), called by hvps_poll(),
+ * simply strips away the last byte in the four-byte ASCII code within the
+ * "hxx" and applies a binary representation of the ASCII character to the
+ * least significant byte.
  *
  * For details on the possible errors, see the C11204-02 Command
  * Reference Manual.
  *
  * @return The last command that caused an error in the most significant byte,
- *         see send_cmd_and_check_reply() for details; and the cause of the
+ *         see `hvps_cmds` for details; and the cause of the
  *         error in the least significant byte, see C11204-02 Command Ref. Man.
  */
 uint16_t hvps_get_last_cmd_err(void)
@@ -374,28 +501,16 @@ uint16_t hvps_get_last_cmd_err(void)
  */
 int hvps_get_temp_corr_factor(struct hvps_temp_corr_factor *f)
 {
-	int ret = send_cmd_and_check_reply("HRT");
-	char valstr[4];
+	int ret = send_cmd_and_check_reply(HVPS_CMD_HRT, NULL);
 
 	if (ret == 0)
 	{
-		strncpy(valstr, hvps_reply + 4, 4);
-		f->dtp1 = (int16_t)strtol(valstr, NULL, 16);
-
-		strncpy(valstr, hvps_reply + 8, 4);
-		f->dtp2 = (int16_t)strtol(valstr, NULL, 16);
-
-		strncpy(valstr, hvps_reply + 12, 4);
-		f->dt1 = (uint16_t)strtoul(valstr, NULL, 16);
-
-		strncpy(valstr, hvps_reply + 16, 4);
-		f->dt2 = (uint16_t)strtoul(valstr, NULL, 16);
-
-		strncpy(valstr, hvps_reply + 20, 4);
-		f->vb = (uint16_t)strtoul(valstr, NULL, 16);
-
-		strncpy(valstr, hvps_reply+24, 4);
-		f->tb = (uint16_t)strtoul(valstr, NULL, 16);
+		f->dtp1 = (int16_t)reply_field(hvps_reply, 0);
+		f->dtp2 = (int16_t)reply_field(hvps_reply, 1);
+		f->dt1 = reply_field(hvps_reply, 2);
+		f->dt2 = reply_field(hvps_reply, 3);
+		f->vb = reply_field(hvps_reply, 4);
+		f->tb = reply_field(hvps_reply, 5);
 	}
 
 	return ret;
@@ -405,28 +520,28 @@ int hvps_get_temp_corr_factor(struct hvps_temp_corr_factor *f)
 /**
  * @brief Check whether the HVPS output is on
  *
- * This function requests the status of the MPPC bias module using the `HGS`
- * command and returns the status of the first bit in the reply, which indicates
- * the output status.
+ * This function returns the first bit of the HVPS status, which indicates the
+ * output status. The last known status is used if it is recent enough (see
+ * HVPS_STATE_MAX_AGE_MS); otherwise, the status of the MPPC bias module is
+ * requested using the `HGS` command.
  *
  * @return 1 if HVPS output is _on_
  *         0 if HVPS output is _off_
  */
 int hvps_is_on(void)
 {
-	uint16_t status = 0xffff; // default should not be valid reading
-	char valstr[4];
+	uint16_t status = state.status;
 
-	if (send_cmd_and_check_reply("HGS") == 0) {
-		strncpy(valstr, hvps_reply + 4, 4);
-		status = (uint16_t)strtoul(valstr, NULL, 16);
+	if (!state_is_fresh()) {
+		hvps_get_value_async(HVPS_STATUS, &status);
+		hvps_flush();
 	}
 
 	return (int)(status & 0x0001);
 }
 
 /**
- * @brief Get the number of sent/acked/failed commands since startup
+ * @brief Get the number of sent/acked/failed/... commands since startup
  *
  * @param c Command counter to retrieve (type `enum hvps_cmd_counter`)
  *
@@ -441,113 +556,395 @@ uint16_t hvps_get_cmd_counter(enum hvps_cmd_counter c)
 			return cmds_acked;
 		case HVPS_CMDS_FAILED:
 			return cmds_failed;
+		case HVPS_RX_ERRORS:
+			return rx_bad_frames + rx_overruns;
+		case HVPS_CMDS_RETRIED:
+			return cmds_retried;
+		case HVPS_CMDS_TIMED_OUT:
+			return cmds_timed_out;
 		default:
 			return 0;
 	}
 }
 
+/**
+ * @brief Queue a command to the HVPS
+ *
+ * The command is framed (STX, ETX, checksum and CR) and queued, to be sent by
+ * hvps_poll() once the commands before it have completed.
+ *
+ * @param cmd    Command to send
+ * @param params Parameters of the command, NULL if it takes none; see
+ *               `enum hvps_cmd` for their number
+ * @param cb     Completion callback, may be NULL
+ * @param arg    Argument passed to the completion callback
+ * @return 0 if the command was queued
+ *         1 if the queue is full
+ */
+int hvps_submit(enum hvps_cmd cmd, const uint16_t *params, hvps_callback_t cb,
+		void *arg)
+{
+	const struct hvps_cmd_desc *d = &hvps_cmds[cmd];
+	struct hvps_req *r;
+
+	if (q_tail - q_head >= HVPS_QUEUE_LEN)
+		return 1;
+
+	r = &queue[q_tail % HVPS_QUEUE_LEN];
+
+	if (d->frame) {
+		memcpy(r->frame, d->frame, d->frame_len);
+		r->len = d->frame_len;
+	} else {
+		r->len = encode_frame(r->frame, cmd, params);
+	}
+
+	r->cmd = cmd;
+	r->tries = 0;
+	r->state = REQ_QUEUED;
+	r->result = HVPS_ERR_TIMEOUT;
+	r->cb = cb;
+	r->arg = arg;
+
+	q_tail++;
+
+	/* Start right away if the HVPS is idle */
+	hvps_poll();
+
+	return 0;
+}
+
+
+static void value_done(int result, const char *reply, void *arg)
+{
+	if (result == HVPS_OK)
+		*(uint16_t *)arg = reply_field(reply, 0);
+}
+
+
+/**
+ * @brief Queue the readout of a value from the HVPS
+ *
+ * `dest` is set to the value reported when the command fails right away, and
+ * gets the value read once the HVPS replies.
+ *
+ * @param v    Value to read
+ * @param dest Where to store the value; must remain valid until the command
+ *             completes
+ * @return 0 if the command was queued
+ *         1 if the queue is full
+ */
+int hvps_get_value_async(enum hvps_value v, uint16_t *dest)
+{
+	*dest = hvps_values[v].invalid;
+
+	return hvps_submit(hvps_values[v].cmd, NULL, value_done, dest);
+}
+
+
+static void temp_corr_factor_done(int result, const char *reply, void *arg)
+{
+	struct hvps_temp_corr_factor *f = arg;
+
+	if (result == HVPS_OK) {
+		f->dtp1 = (int16_t)reply_field(reply, 0);
+		f->dtp2 = (int16_t)reply_field(reply, 1);
+		f->dt1 = reply_field(reply, 2);
+		f->dt2 = reply_field(reply, 3);
+		f->vb = reply_field(reply, 4);
+		f->tb = reply_field(reply, 5);
+	}
+}
+
+
+/**
+ * @brief Queue the readout of the temperature correction factor
+ *
+ * `f` is only updated if the HVPS acknowledges the `HRT` command.
+ *
+ * @param f Structure to save the temperature correction factors into; must
+ *          remain valid until the command completes
+ * @return 0 if the command was queued
+ *         1 if the queue is full
+ */
+int hvps_get_temp_corr_factor_async(struct hvps_temp_corr_factor *f)
+{
+	return hvps_submit(HVPS_CMD_HRT, NULL, temp_corr_factor_done, f);
+}
+
+
+static void monitor_done(int result, const char *reply, void *arg)
+{
+	if (result == HVPS_OK) {
+		monitor.status = reply_field(reply, HPO_FIELD_STATUS);
+		monitor.volt = reply_field(reply, HPO_FIELD_VOLT);
+		monitor.curr = reply_field(reply, HPO_FIELD_CURR);
+		monitor.temp = reply_field(reply, HPO_FIELD_TEMP);
+	} else {
+		monitor.status = hvps_values[HVPS_STATUS].invalid;
+		monitor.volt = hvps_values[HVPS_VOLTAGE].invalid;
+		monitor.curr = hvps_values[HVPS_CURRENT].invalid;
+		monitor.temp = hvps_values[HVPS_TEMP].invalid;
+	}
+}
+
+
+/**
+ * @brief Queue a monitor readout
+ *
+ * Sends a single `HPO` command, whose reply holds the status, voltage, current
+ * and temperature of the HVPS. Once the HVPS replies, these are returned by
+ * hvps_get_status(), hvps_get_voltage(), hvps_get_current() and
+ * hvps_get_temp(); if the readout fails, these return their invalid value.
+ *
+ * @return 0 if the command was queued
+ *         1 if the queue is full
+ */
+int hvps_update_monitor_async(void)
+{
+	return hvps_submit(HVPS_CMD_HPO, NULL, monitor_done, NULL);
+}
+
+
+/**
+ * @brief Advance the command queue
+ *
+ * To be called from the main loop. Runs the completion callbacks of the
+ * commands that have completed, sends commands again after a timeout and sends
+ * the next queued command.
+ */
+void hvps_poll(void)
+{
+	const uint32_t timeout = (SystemCoreClock / 1000) * HVPS_TIMEOUT_MS;
+	static int polling = 0;
+	struct hvps_req *r;
+
+	/* Callbacks may queue commands, which then wait for the outer call */
+	if (polling)
+		return;
+	polling = 1;
+
+	/* Drop the state before the cycle counter can wrap around its time */
+	state_is_fresh();
+
+	/* Replies first, so that one waiting in the ring is not taken for a timeout */
+	rx_decode();
+
+	while (q_head != q_tail) {
+		r = &queue[q_head % HVPS_QUEUE_LEN];
+
+		if (r->state == REQ_QUEUED) {
+			send_req(r);
+			break;
+		}
+
+		if (r->state == REQ_SENT) {
+			if ((DWT->CYCCNT - r->sent_time) < timeout)
+				break;
+			if (r->tries <= HVPS_RETRIES) {
+				cmds_retried++;
+				send_req(r);
+				break;
+			}
+			cmds_timed_out++;
+			r->state = REQ_DONE;
+		}
+
+		/* Done: the reply stays in hvps_reply until the next command */
+		state_update(r);
+		q_head++;
+		if (r->cb)
+			r->cb(r->result, hvps_reply, r->arg);
+	}
+
+	polling = 0;
+}
+
+
+/**
+ * @brief Check whether all queued commands have completed
+ *
+ * @return 1 if the command queue is empty
+ *         0 otherwise
+ */
+int hvps_is_idle(void)
+{
+	return q_head == q_tail;
+}
+
+
+/**
+ * @brief Wait until all queued commands have completed
+ */
+void hvps_flush(void)
+{
+	while (!hvps_is_idle())
+		hvps_poll();
+}
+
+
 /*
  * =============================================================================
  *  Local functions
  * =============================================================================
  */
 
+/* Completion callback of send_cmd_and_check_reply() */
+static void sync_done(int result, const char *reply, void *arg)
+{
+	*(int *)arg = result;
+}
+
 /**
- * @brief Prepare the command string to the MPPC bias module, send the command
- *        and check for correct reply
- * @param cmd Command string to send, including parameters but excluding the
- *            start, end characters and checksum
+ * @brief Send a command to the HVPS and wait for it to complete
+ *
+ * Commands queued before it are completed first. The reply is left in
+ * `hvps_reply`.
+ *
+ * @param cmd    Command to send
+ * @param params Parameters of the command, NULL if it takes none
  * @return 0 if the reply to the command _is_ correct (lower-case representation
  *           of the sent command)
- *         1 if the reply to the command _is not_ correct (`hxx` or other reply)
+ *         1 if the reply to the command _is not_ correct (`hxx` or other
+ *           reply), or if no reply came
  */
-static int send_cmd_and_check_reply(char *cmd)
+static int send_cmd_and_check_reply(enum hvps_cmd cmd, const uint16_t *params)
 {
-	/* ------------------- Step 1: Prepare command array -------------------- */
-	const uint8_t STX = 0x02;
-	const uint8_t ETX = 0x03;
-	const uint8_t CR = '\r';
+	int result = HVPS_ERR_TIMEOUT;
 
-	int cmdlen = strlen((char*)cmd);
+	if (hvps_submit(cmd, params, sync_done, &result)) {
+		hvps_flush();
+		if (hvps_submit(cmd, params, sync_done, &result))
+			return 1;
+	}
+	hvps_flush();
 
-	uint16_t chksum = 0x00;
-	char chkstr[3];
+	return result != HVPS_OK;
+}
 
-	int i = 0;
 
-	/*
-	 * Start with fresh command array. Memmove is then used with offset for the
-	 * address because strcat did not give the proper command format to send to
-	 * the HVPS.
-	 */
-	memset(hvps_cmd, '\0', sizeof(hvps_cmd));
+/**
+ * @brief Send a queued command, or send it again after a timeout
+ */
+static void send_req(struct hvps_req *r)
+{
+	r->tries++;
+	r->sent_time = DWT->CYCCNT;
+	r->state = REQ_SENT;
+	if (r->tries == 1)
+		cmds_sent++;
+	MSS_UART_irq_tx(&g_mss_uart0, (uint8_t *)r->frame, r->len);
+}
+
+
+/**
+ * @brief Frame a command with parameters
+ *
+ * @param frame  Where to write the frame
+ * @param cmd    Command to frame
+ * @param params The `nparams` parameters of the command
+ * @return The length of the frame
+ */
+static uint8_t encode_frame(char *frame, enum hvps_cmd cmd,
+		const uint16_t *params)
+{
+	const struct hvps_cmd_desc *d = &hvps_cmds[cmd];
+	uint8_t chksum = 0;
+	uint8_t n = 0;
+	int i, shift;
+
+	frame[n++] = STX;
+	for (i = 0; d->name[i]; i++)
+		frame[n++] = d->name[i];
+	for (i = 0; i < d->nparams; i++)
+		for (shift = 12; shift >= 0; shift -= 4)
+			frame[n++] = hex_digit[(params[i] >> shift) & 0xf];
+	frame[n++] = ETX;
+
+	for (i = 0; i < n; i++)
+		chksum += (uint8_t)frame[i];
+	frame[n++] = hex_digit[chksum >> 4];
+	frame[n++] = hex_digit[chksum & 0xf];
+	frame[n++] = CR;
+
+	return n;
+}
+
+
+/**
+ * @brief Get a four-digit hex field from a reply
+ *
+ * The reply must hold the field, which reply_received() checks against
+ * `nreply` before a command succeeds.
+ *
+ * @param reply Reply from the HVPS
+ * @param n     Index of the field, the first one following the command
+ */
+static uint16_t reply_field(const char *reply, int n)
+{
+	const char *p = reply + 4 + 4*n;
+	uint16_t v = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		v = (v << 4) | hex_val[p[i] & 0x7f];
+
+	return v;
+}
+
 
-	memmove(hvps_cmd, &STX, 1);
-	memmove(hvps_cmd+1, cmd, cmdlen);
-	memmove(hvps_cmd+1+cmdlen, &ETX, 1);
-	for (i = 0; hvps_cmd[i-1] != ETX; i++) {
-		chksum += hvps_cmd[i];
+/**
+ * @brief Update the last known status on completion of a command
+ *
+ * Status readouts give the status, and `HON`/`HOF` only change the output
+ * bit. Any other command leaves the status as it is, except for `HRE` and
+ * failed readouts, after which it is unknown.
+ */
+static void state_update(const struct hvps_req *r)
+{
+	switch (r->cmd) {
+	case HVPS_CMD_HGS:
+	case HVPS_CMD_HPO:
+		if (r->result == HVPS_OK) {
+			state.status = reply_field(hvps_reply, 0);
+			state.valid = 1;
+			state.time = DWT->CYCCNT;
+		} else {
+			state.valid = 0;
+		}
+		break;
+	case HVPS_CMD_HON:
+	case HVPS_CMD_HOF:
+		if ((r->result == HVPS_OK) && state.valid) {
+			if (r->cmd == HVPS_CMD_HON)
+				state.status |= 0x0001;
+			else
+				state.status &= ~0x0001;
+			state.time = DWT->CYCCNT;
+		}
+		break;
+	case HVPS_CMD_HRE:
+		state.valid = 0;
+		break;
+	default:
+		break;
 	}
-	chksum &= 0xFF; // Mask so only lower 2 bytes get sent
-	sprintf(chkstr, "%02X", chksum);
-	memmove(hvps_cmd+1+cmdlen+1, chkstr, 2);
-	memmove(hvps_cmd+1+cmdlen+3, &CR, 1);
-
-	/* Set last command index, for storage in case of "hxx" reply from HVPS */
-	if (strncmp(cmd, "HST", 3) == 0)
-		last_cmd = 1;
-	else if (strncmp(cmd, "HRT", 3) == 0)
-		last_cmd = 2;
-	else if (strncmp(cmd, "HPO", 3) == 0)
-		last_cmd = 3;
-	else if (strncmp(cmd, "HGS", 3) == 0)
-		last_cmd = 4;
-	else if (strncmp(cmd, "HGV", 3) == 0)
-		last_cmd = 5;
-	else if (strncmp(cmd, "HGC", 3) == 0)
-		last_cmd = 6;
-	else if (strncmp(cmd, "HGT", 3) == 0)
-		last_cmd = 7;
-	else if (strncmp(cmd, "HFI", 3) == 0)
-		last_cmd = 8;
-	else if (strncmp(cmd, "HGN", 3) == 0)
-		last_cmd = 9;
-	else if (strncmp(cmd, "HOF", 3) == 0)
-		last_cmd = 10;
-	else if (strncmp(cmd, "HON", 3) == 0)
-		last_cmd = 11;
-	else if (strncmp(cmd, "HRE", 3) == 0)
-		last_cmd = 12;
-	else if (strncmp(cmd, "HCM", 3) == 0)
-		last_cmd = 13;
-	else if (strncmp(cmd, "HSC", 3) == 0)
-		last_cmd = 14;
-	else if (strncmp(cmd, "HRC", 3) == 0)
-		last_cmd = 15;
-	else if (strncmp(cmd, "HBV", 3) == 0)
-		last_cmd = 16;
-	else
-		last_cmd = 0xff;
-
-
-	/* ----------------- Step 2: Send command over UART --------------------- */
-	MSS_UART_polled_tx(&g_mss_uart0, (uint8_t*)hvps_cmd, strlen(hvps_cmd));
-	cmds_sent++;
-	hvps_reply_ready = 0;
-
-
-	/* ---------------- Step 3: Wait for reply from HVPS -------------------- */
-	while (!hvps_reply_ready)
-		;
-
-
-	/* ---------------- Step 4: Check for correct reply --------------------- */
-	if ((hvps_reply[1] != hvps_cmd[1] + 0x20) ||
-			(hvps_reply[2] != hvps_cmd[2] + 0x20) ||
-			(hvps_reply[3] != hvps_cmd[3] + 0x20))
-		return 1;
+}
 
-	return 0;
+
+/**
+ * @brief Check whether the last known status can be used
+ *
+ * The status is dropped once it is older than HVPS_STATE_MAX_AGE_MS.
+ */
+static int state_is_fresh(void)
+{
+	const uint32_t max_age = (SystemCoreClock / 1000) * HVPS_STATE_MAX_AGE_MS;
+
+	if (state.valid && ((DWT->CYCCNT - state.time) >= max_age))
+		state.valid = 0;
+
+	return state.valid;
 }
 
 
@@ -557,65 +954,163 @@ static int send_cmd_and_check_reply(char *cmd)
  * This function is used to ensure that the voltage is not higher than the
  * SPM can take, preventing its destruction.
  *
- * @param v The maximum bias voltage to check against
+ * @param vb The bias voltage to be applied, in the format expected by the HVPS
+ * @param v  The maximum bias voltage to check against
  * @return 1 (true) if the voltage _is_ less than the parameter `v`
  *         0 (false) if voltage _is not_ less than the parameter `v`
  */
-static int voltage_less_than(double v)
+static int voltage_less_than(uint16_t vb, double v)
 {
-	char data[4] = "";
-	double val = 0;
+	/* Convert to volts and check value for limit */
+	double val = vb * (1.812/pow(10, 3));
 
-	/* Check for which command that came to decide on array location */
-	if((hvps_cmd[1]=='H' && hvps_cmd[2]=='S' && hvps_cmd[3]=='T')) {
-		for(int i=0; i<4; i++){
-			data[i] = hvps_cmd[i+19];
+	if(val > v)
+		return 0;
+
+	return 1;
+}
+
+
+/**
+ * @brief Decode the bytes received from the HVPS
+ *
+ * Runs through the RX ring one byte at a time, collecting frames into
+ * `hvps_reply`. STX always starts a new frame. Frames that are too long or
+ * have a wrong checksum are dropped, and counted as RX errors; the command
+ * they would have answered times out and is sent again.
+ */
+static void rx_decode(void)
+{
+	static uint8_t len;
+	static uint8_t chksum;
+	static uint8_t chk_rx;
+	uint32_t tail = rx_tail;
+	int done = 0;
+	uint8_t c;
+
+	/* Once a command has completed, the rest waits for its callback */
+	while (!done && (tail != rx_head)) {
+		c = rx_ring[tail & (RX_RING_LEN - 1)];
+		tail++;
+
+		if (c == STX) {
+			if (dec_state != DEC_STX)
+				rx_bad_frames++;
+			hvps_reply[0] = STX;
+			len = 1;
+			chksum = STX;
+			dec_state = DEC_BODY;
+			continue;
 		}
-	} else if(hvps_cmd[1]=='H' && hvps_cmd[2]=='B' && hvps_cmd[3]=='V') {
-		for(int i=0; i<4; i++){
-			data[i] = hvps_cmd[i+3];
+
+		switch (dec_state) {
+		case DEC_BODY:
+			/* Room for ETX, checksum, CR and the terminating NUL */
+			if (len >= sizeof(hvps_reply) - 4) {
+				rx_bad_frames++;
+				dec_state = DEC_STX;
+				break;
+			}
+			hvps_reply[len++] = c;
+			chksum += c;
+			if (c == ETX)
+				dec_state = DEC_CHK_HI;
+			break;
+		case DEC_CHK_HI:
+		case DEC_CHK_LO:
+			hvps_reply[len++] = c;
+			chk_rx = (chk_rx << 4) | hex_val[c & 0x7f];
+			dec_state++;
+			break;
+		case DEC_CR:
+			dec_state = DEC_STX;
+			if ((c != CR) || (chk_rx != chksum)) {
+				rx_bad_frames++;
+				break;
+			}
+			hvps_reply[len++] = CR;
+			hvps_reply[len] = '\0';
+			done = reply_received(len);
+			break;
+		default:
+			/* Line noise between frames */
+			break;
 		}
 	}
-	/* Convert to long and check value for limit of 55 */
-	val = (uint16_t)strtoul(data, NULL, 16);
-	val = val * (1.812/pow(10, 3));
-	if(val > v)
+
+	rx_tail = tail;
+}
+
+
+/**
+ * @brief Complete the command being sent with a reply
+ *
+ * @param len Length of the reply frame in `hvps_reply`, CR included
+ * @return 1 if the reply completed the command
+ *         0 if it was not expected
+ */
+static int reply_received(uint8_t len)
+{
+	struct hvps_req *r = &queue[q_head % HVPS_QUEUE_LEN];
+
+	/*
+	 * Replies are only expected to the command being sent. Besides the
+	 * fields, a reply has STX, the command, ETX, checksum and CR.
+	 */
+	if ((q_head == q_tail) || (r->state != REQ_SENT) || (len < 8))
 		return 0;
 
-	return 1;
+	/* Increment command counters based on reply */
+	if ((hvps_reply[1] == r->frame[1] + 0x20) &&
+			(hvps_reply[2] == r->frame[2] + 0x20) &&
+			(hvps_reply[3] == r->frame[3] + 0x20) &&
+			(len >= 8 + 4*hvps_cmds[r->cmd].nreply)) {
+		cmds_acked++;
+		r->result = HVPS_OK;
+		r->state = REQ_DONE;
+		return 1;
+	}
+	else if(hvps_reply[1] == 'h' && hvps_reply[2] == 'x' &&
+	        hvps_reply[3] == 'x' && (len >= 12)) {
+	    /* See the comments before hvps_get_last_cmd_err() for details. */
+		last_cmd_err = (hvps_cmds[r->cmd].err_idx << 8) |
+		               (hvps_reply[7] - 0x30);
+		cmds_failed++;
+		r->result = HVPS_ERR_REPLY;
+		r->state = REQ_DONE;
+		return 1;
+	}
+
+	/* Anything else is a late reply to a timed-out command */
+	return 0;
 }
 
 
 /**
  *  @brief UART handler for RX from HVPS
  *
+ *  Only moves the received bytes into the RX ring; they are decoded by
+ *  hvps_poll(). Bytes that do not fit are dropped, and counted as RX errors.
+ *
  *  @param this_uart Pointer to the UART instance being handled
  */
 static void UART0_RXHandler(mss_uart_instance_t* this_uart)
 {
-	static size_t rx_size = 0;
-
-	rx_size += MSS_UART_get_rx(this_uart, ((uint8_t*)hvps_reply) + rx_size,
-			sizeof(hvps_reply));
-	if(hvps_reply[rx_size-1] == '\r')
-	{
-		/* Increment command counters based on reply */
-		if ((hvps_reply[1] == hvps_cmd[1] + 0x20) &&
-				(hvps_reply[2] == hvps_cmd[2] + 0x20) &&
-				(hvps_reply[3] == hvps_cmd[3] + 0x20)) {
-			cmds_acked++;
+	uint8_t buf[16];
+	uint32_t head = rx_head;
+	size_t n, i;
+
+	do {
+		n = MSS_UART_get_rx(this_uart, buf, sizeof(buf));
+		for (i = 0; i < n; i++) {
+			if (head - rx_tail < RX_RING_LEN)
+				rx_ring[(head++) & (RX_RING_LEN - 1)] = buf[i];
+			else
+				rx_overruns++;
 		}
-		else if(hvps_reply[1] == 'h' && hvps_reply[2] == 'x' &&
-		        hvps_reply[3] == 'x') {
-		    /* See the comments before hvps_get_last_cmd_err() for details. */
-			last_cmd_err = (last_cmd << 8) | (hvps_reply[7] - 0x30);
-			cmds_failed++;
-		}
-
-		/* Inform sending command function that reply is available */
-		hvps_reply_ready = 1;
+	} while (n == sizeof(buf));
 
-		/* Prep for next round of RX... */
-		rx_size = 0;
-	}
+	/* Publish the bytes once they are in the ring */
+	__DMB();
+	rx_head = head;
 }
@@ -27,11 +27,16 @@
 #ifndef _HVPS_C11204_02_H_
 #define _HVPS_C11204_02_H_
 
+#include <stdint.h>
+
 /* Type Definitions */
 enum hvps_cmd_counter {
-	HVPS_CMDS_SENT = 1,
+	HVPS_CMDS_SENT = 1,   // Commands sent, not counting retries
 	HVPS_CMDS_ACKED,      // Received proper reply from MPPC bias module
-	HVPS_CMDS_FAILED      // Received "hxx" reply from MPPC bias module
+	HVPS_CMDS_FAILED,     // Received "hxx" reply from MPPC bias module
+	HVPS_RX_ERRORS,       // Received bytes dropped: overrun, bad frame/checksum
+	HVPS_CMDS_RETRIED,    // Commands sent again after a timeout
+	HVPS_CMDS_TIMED_OUT   // Commands without a reply, even after retries
 };
 
 struct hvps_temp_corr_factor {
@@ -43,6 +48,71 @@ struct hvps_temp_corr_factor {
 	uint16_t tb;
 };
 
+/* Monitor readout, see hvps_update_monitor_async() */
+struct hvps_monitor {
+	uint16_t status;
+	uint16_t volt;
+	uint16_t curr;
+	uint16_t temp;
+};
+
+/* Commands, see hvps_submit() */
+enum hvps_cmd {
+	HVPS_CMD_HON = 0,
+	HVPS_CMD_HOF,
+	HVPS_CMD_HRE,
+	HVPS_CMD_HCM0,
+	HVPS_CMD_HCM1,
+	HVPS_CMD_HGV,
+	HVPS_CMD_HGC,
+	HVPS_CMD_HGT,
+	HVPS_CMD_HGS,
+	HVPS_CMD_HRT,
+	HVPS_CMD_HPO,
+	HVPS_CMD_HST,         // 6 parameters
+	HVPS_CMD_HBV,         // 1 parameter
+	HVPS_CMD_COUNT
+};
+
+/* Values read by a single command, see hvps_get_value_async() */
+enum hvps_value {
+	HVPS_VOLTAGE = 0,     // HGV
+	HVPS_CURRENT,         // HGC
+	HVPS_TEMP,            // HGT
+	HVPS_STATUS           // HGS
+};
+
+/*
+ * Commands are queued and sent in order, one at a time, with interrupt-driven
+ * TX. The UART RX handler only stores the bytes received; replies are decoded
+ * and matched to the command by hvps_poll(), in the main loop. A command
+ * without a reply after HVPS_TIMEOUT_MS is sent again, up to HVPS_RETRIES
+ * times. Completion callbacks are run from hvps_poll(), in the main loop.
+ */
+#define HVPS_QUEUE_LEN       (8)
+#define HVPS_TIMEOUT_MS      (50)
+#define HVPS_RETRIES         (1)
+
+/*
+ * How long the last known HVPS status is used by hvps_is_on(), instead of
+ * reading it again. HK reads the status every second.
+ */
+#define HVPS_STATE_MAX_AGE_MS   (1500)
+
+/* Command results, as passed to completion callbacks */
+#define HVPS_OK              (0)
+#define HVPS_ERR_REPLY       (1)   // other reply than the command's, e.g. hxx
+#define HVPS_ERR_TIMEOUT     (2)   // no reply, even after retries
+
+/**
+ * @brief Command completion callback
+ *
+ * @param result One of the HVPS_OK or HVPS_ERR_ values
+ * @param reply  Reply from the HVPS, valid until the callback returns
+ * @param arg    Argument given with the command
+ */
+typedef void (*hvps_callback_t)(int result, const char *reply, void *arg);
+
 
 /* Function Definitions */
 void      hvps_init(void);
@@ -62,5 +132,15 @@ uint16_t  hvps_get_cmd_counter(enum hvps_cmd_counter);
 uint16_t  hvps_get_last_cmd_err(void);
 int       hvps_get_temp_corr_factor(struct hvps_temp_corr_factor *f);
 
+/* Asynchronous commands */
+int       hvps_submit(enum hvps_cmd cmd, const uint16_t *params,
+                      hvps_callback_t cb, void *arg);
+int       hvps_get_value_async(enum hvps_value v, uint16_t *dest);
+int       hvps_get_temp_corr_factor_async(struct hvps_temp_corr_factor *f);
+int       hvps_update_monitor_async(void);
+void      hvps_poll(void);
+int       hvps_is_idle(void);
+void      hvps_flush(void);
+
 
 #endif /* _HVPS_C11204_02_H_ */
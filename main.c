@@ -45,6 +45,11 @@
 #include "msp/msp_exp.h"
 
 #include "utils/led.h"
+#include "utils/cmd_queue.h"
+#include "utils/hk_history.h"
+#include "utils/hk_stats.h"
+#include "utils/msp_capture.h"
+#include "utils/msp_stats.h"
 #include "utils/timer_delay.h"
 
 
@@ -93,21 +98,11 @@ static mss_i2c_slave_handler_ret_t I2C1_SlaveWriteHandler(
 		uint8_t * p_rx_data,
         uint16_t rx_size);
 
-/* Op-codes from ISR callbacks */
-static unsigned int has_send;
-static unsigned int has_send_error = 0;
-static unsigned int has_send_errorcode = 0;
-static unsigned int has_recv = 0;
-static unsigned int has_recv_error = 0;
-static unsigned int has_recv_errorcode = 0;
-static unsigned int has_syscommand = 0;
-
-
 /*
  * Define the MSP send data buffer. The max number of bytes that can be sent by
  * CUBES corresponds to the histogram size in gateware.
  */
-#define HK_LEN          (46)
+#define HK_LEN          (50)
 #define CUBES_ID_LEN    (26)
 
 static struct hvps_temp_corr_factor hvps_temp_corr;
@@ -117,10 +112,272 @@ static unsigned char send_data_payload[MEM_HISTO_LEN_GW]="";
 static unsigned char send_data_hk[HK_LEN] = "";
 static unsigned char send_data_cubes_id[CUBES_ID_LEN];
 static unsigned char send_data_hvps_temp_comp[sizeof(hvps_temp_corr)];
+static unsigned char send_data_msp_stats[MSP_STATS_MAX_LEN];
+static unsigned char send_data_hk_stats[HK_STATS_LEN];
+
+/*
+ * Batched commands, sent via MSP_OP_SEND_CUBES_BATCH. The data is a list of
+ * sub-commands, each encoded as:
+ *   byte 0       : opcode (a SEND or system command opcode)
+ *   byte 1       : length N of the sub-command data
+ *   bytes 2..N+1 : sub-command data
+ *
+ * The whole list is checked before any sub-command is executed. Sub-commands
+ * are then run in order by the main loop, stopping at the first one that
+ * fails. The outcome can be read via MSP_OP_REQ_CUBES_BATCH_STATUS.
+ */
+#define BATCH_MAXLEN            (256)
+#define BATCH_MAX_CMDS          (16)
+
+/*
+ * Batch status: batch state, number of sub-commands, then an (opcode, result)
+ * pair for each sub-command, where the result is one of the CMD_ values below.
+ */
+#define BATCH_STATUS_HDR_LEN    (2)
+#define BATCH_STATE_NONE        (0)
+#define BATCH_STATE_PENDING     (1)
+#define BATCH_STATE_DONE        (2)
+#define BATCH_STATE_REJECTED    (3)
+
+static unsigned char send_data_batch_status[BATCH_STATUS_HDR_LEN +
+                                            2*BATCH_MAX_CMDS];
+static unsigned long batch_status_len = BATCH_STATUS_HDR_LEN;
+
+/*
+ * Time-tagged commands, sent via MSP_OP_SEND_CUBES_TIMED_CMD:
+ *   bytes 0..3 : execution time (big-endian), in CUBES time
+ *   byte 4     : opcode (a SEND or system command opcode)
+ *   bytes 5..  : command data, at most TIMED_CMD_MAXLEN bytes
+ *
+ * Sending the opcode without data clears the queue, results included.
+ * Commands are run by the main loop as soon as the CUBES time reaches their
+ * execution time; commands with an execution time in the past are run right
+ * away. A slot keeps the result of its command until it is reused, pending
+ * commands being put in free slots first.
+ *
+ * The queue can be read via MSP_OP_REQ_CUBES_TIMED_STATUS, as one entry per
+ * slot: state, opcode, execution time (big-endian) and result, one of the
+ * CMD_ values below (CMD_NOT_RUN while pending).
+ */
+#define TIMED_CMD_MAX           (8)
+#define TIMED_CMD_HDR_LEN       (5)
+#define TIMED_CMD_MAXLEN        (16)
+#define TIMED_STATUS_ENTRY_LEN  (7)
+#define TIMED_STATE_FREE        (0)
+#define TIMED_STATE_PENDING     (1)
+#define TIMED_STATE_DONE        (2)
+
+struct timed_cmd {
+	uint32_t time;
+	uint8_t opcode;
+	uint8_t len;
+	uint8_t state;
+	uint8_t result;
+	uint8_t data[TIMED_CMD_MAXLEN];
+};
+
+static struct timed_cmd timed_cmds[TIMED_CMD_MAX];
+static unsigned char send_data_timed_status[TIMED_CMD_MAX *
+                                            TIMED_STATUS_ENTRY_LEN];
+
+/* Max. data length of a batched or time-tagged command */
+#define DEFERRED_CMD_MAXLEN     (MEM_CITIROC_CONF_LEN)
+
+/* Command results */
+#define CMD_OK                  (0)
+#define CMD_ERR_OPCODE          (1)   // unknown opcode, or not allowed here
+#define CMD_ERR_LENGTH          (2)   // wrong data length
+#define CMD_ERR_FAILED          (3)   // command executed, but failed
+#define CMD_NOT_RUN             (0xff)
+
+/*
+ * Receive data, batched commands are the largest. Data is received straight
+ * into the command queue entry it will be handled from; recv_overflow only
+ * takes it when the queue is full, for the commands applied on reception.
+ */
+#define RECV_MAXLEN    (BATCH_MAXLEN)
+
+#if CMD_QUEUE_DATA_LEN < RECV_MAXLEN
+#error "Command queue entries must hold the largest receive data"
+#endif
+
+static unsigned char recv_overflow[RECV_MAXLEN];
+static unsigned char *recv_data = recv_overflow;
+static unsigned long recv_len;
+
+/*
+ * Receive sink: Citiroc slow control and probe configurations announced with
+ * their exact length are streamed into a CFG_RAM shadow as MSP frames arrive,
+ * instead of being staged in the command queue. The main loop copies the
+ * shadow to CFG_RAM when it runs the command, so the ASIC is never loaded
+ * from a half-written CFG_RAM.
+ *
+ * The shadow is held from the start of the transfer until the main loop has
+ * run the command, or until the command is dropped. A configuration arriving
+ * in the meantime is received into the command queue instead.
+ */
+#if MEM_CITIROC_PROBE_LEN > MEM_CITIROC_CONF_LEN
+#error "The receive sink must hold the largest Citiroc configuration"
+#endif
+
+static uint32_t recv_shadow[MEM_CITIROC_CONF_LEN / 4];
+static unsigned long recv_shadow_len;
+static volatile uint8_t recv_shadow_busy = 0;
+static unsigned int recv_to_sink = 0;
+
+/* Length of MSP_OP_SEND_CUBES_MSP_MTU data: big-endian, 16-bit MTU */
+#define MSP_MTU_CONF_LEN  (2)
+
+/*
+ * Read window for the next REQ_PAYLOAD, set via
+ * MSP_OP_SEND_CUBES_PAYLOAD_WINDOW. The OBC sends either:
+ *  - one byte, a Histo-RAM section index: 0 for the header, 1 to 6 for the
+ *    histograms, in the order they are laid out in the Histo-RAM; or
+ *  - eight bytes, a big-endian 32-bit offset and 32-bit length; a length of 0
+ *    means "up to the end of the payload".
+ *
+ * The window applies to the next REQ_PAYLOAD only, so that an interrupted
+ * transfer can be resumed from where it was aborted. An invalid window is
+ * rejected, and the next REQ_PAYLOAD then returns no data rather than the
+ * full payload.
+ */
+#define PAYLOAD_WINDOW_SECTION_LEN  (1)
+#define PAYLOAD_WINDOW_RANGE_LEN    (8)
+#define PAYLOAD_WINDOW_SECTIONS     (7)
+#define PAYLOAD_WINDOW_INVALID      (0xfe)
+#define PAYLOAD_WINDOW_NO_SECTION   (0xff)
+
+static uint8_t payload_win_section = PAYLOAD_WINDOW_NO_SECTION;
+static unsigned long payload_win_offset = 0;
+static unsigned long payload_win_len = 0;
+static unsigned long payload_send_start = 0;
+static unsigned long payload_send_end = 0;
+
+/*
+ * Parts of the payload sent so far by completed REQ_PAYLOADs, as disjoint
+ * byte ranges; the payload is only cleared once they cover all of it. Should
+ * the OBC read it in more scattered pieces than there are ranges, the extra
+ * pieces are not recorded and the payload is kept until the next DAQ.
+ */
+#define PAYLOAD_SENT_RANGES         (8)
+
+static struct {
+	unsigned long start;
+	unsigned long end;
+} payload_sent[PAYLOAD_SENT_RANGES];
+static int payload_sent_n = 0;
+
+
+/*
+ * Command table: what to do for each opcode, indexed by opcode. Any of the
+ * three actions may be left out:
+ *  - respond: for REQ commands, called from msp_expsend_start() (I2C ISR) to
+ *    point send_data to the data to send; returns its length;
+ *  - apply: for SEND commands that must take effect right away, called from
+ *    msp_exprecv_complete() (I2C ISR) with the received data; returns CMD_OK,
+ *    or one of the CMD_ERR_ values if the data was rejected, which the OBC
+ *    sees as a failed transaction in the MSP statistics;
+ *  - run: called from the main loop, after the transaction has completed.
+ *
+ * SEND data is checked against [min_len, max_len] before apply or run are
+ * called; REQ and system commands carry no data. The time spent in each run is
+ * accounted for per opcode in the MSP statistics.
+ */
+#define CMD_TABLE_LEN           (128)
+
+/* Command flags */
+#define CMD_NO_DEFER            (0x01)   // can not be batched or time-tagged
+
+struct cmd_desc {
+	int (*run)(uint8_t *data, unsigned long len);
+	unsigned long (*respond)(void);
+	int (*apply)(const uint8_t *data, unsigned long len);
+	uint16_t min_len;
+	uint16_t max_len;
+	uint8_t flags;
+};
+
+/**
+ * @brief Get the command table entry of an opcode
+ *
+ * @param opcode Opcode of the command
+ * @return Pointer to the entry; all fields are zero for unknown opcodes
+ */
+static const struct cmd_desc *cmd_lookup(unsigned char opcode);
+
+/**
+ * @brief Check a command against the command table
+ *
+ * @param opcode Opcode of the command
+ * @param len    Length of the command data
+ * @return CMD_OK if the command is valid, CMD_ERR_OPCODE if the opcode is
+ *         unknown, CMD_ERR_LENGTH if the data length is out of range
+ */
+static int cmd_check(unsigned char opcode, unsigned long len);
+
+/**
+ * @brief Act upon an MSP command from the OBC, in the main loop
+ *
+ * @param opcode Opcode of the command
+ * @param data   Data received with the command
+ * @param len    Number of bytes received with the command
+ * @return CMD_OK on success, or one of the CMD_ERR_ values otherwise
+ */
+static int cmd_run(unsigned char opcode, uint8_t *data, unsigned long len);
+
+/**
+ * @brief Run the sub-commands in an MSP_OP_SEND_CUBES_BATCH command
+ *
+ * Also prepares the MSP_OP_REQ_CUBES_BATCH_STATUS data.
+ *
+ * @param data Sub-command list, see BATCH_MAXLEN for the format
+ * @param len  Length of the sub-command list
+ * @return CMD_OK if all sub-commands succeeded, or one of the CMD_ERR_ values
+ *         otherwise
+ */
+static int run_batch(uint8_t *data, unsigned long len);
+
+/**
+ * @brief Check whether a command can be batched or time-tagged
+ *
+ * @param opcode Opcode of the command
+ * @return 1 if the command can be deferred, 0 otherwise
+ */
+static int cmd_can_be_deferred(unsigned char opcode);
+
+/**
+ * @brief Run a batched or time-tagged command
+ *
+ * @param opcode Opcode of the command
+ * @param data   Command data, at most DEFERRED_CMD_MAXLEN bytes
+ * @param len    Length of the command data
+ * @return CMD_OK on success, or one of the CMD_ERR_ values otherwise
+ */
+static int run_deferred_cmd(unsigned char opcode, const uint8_t *data,
+                            unsigned long len);
+
+/**
+ * @brief Add a command to the time-tagged command queue
+ *
+ * @param data MSP_OP_SEND_CUBES_TIMED_CMD data, see TIMED_CMD_MAX for the
+ *             format
+ * @param len  Length of the data; zero clears the queue
+ * @return CMD_OK if the command was queued, CMD_ERR_FAILED if the queue is
+ *         full, or one of the other CMD_ERR_ values if the command is invalid
+ */
+static int timed_cmd_add(uint8_t *data, unsigned long len);
+
+/**
+ * @brief Run all time-tagged commands whose execution time has been reached
+ *
+ * @param now Current CUBES time
+ */
+static void timed_cmd_run_due(uint32_t now);
 
-/* Receive data, Citiroc configuration is the largest */
-#define RECV_MAXLEN    (MEM_CITIROC_CONF_LEN)
-static unsigned char recv_data[RECV_MAXLEN];
+/**
+ * @brief Prepare the MSP_OP_REQ_CUBES_TIMED_STATUS data from the queue
+ */
+static void timed_cmd_update_status(void);
 
 
 /*
@@ -136,6 +393,21 @@ static unsigned char recv_data[RECV_MAXLEN];
  */
 static uint16_t get_num_bins(uint8_t bin_cfg);
 
+/**
+ * @brief Get the length of the REQ_PAYLOAD data, based on the bin_cfg array
+ * @return Header length plus the length of the six (re-binned) histograms
+ */
+static unsigned long get_payload_len(void);
+
+/**
+ * @brief Mark a part of the payload as sent
+ *
+ * @param start Offset of the first byte sent
+ * @param end   Offset past the last byte sent
+ * @return 1 if the whole payload has now been sent, 0 otherwise
+ */
+static int payload_mark_sent(unsigned long start, unsigned long end);
+
 /**
  * @brief Prepare data for REQ_PAYLOAD command
  *
@@ -168,6 +440,7 @@ static uint8_t hk_timer_trig = 0;
 static uint8_t end_daq_hk_ready = 0;
 
 static uint32_t cubes_time;
+static uint32_t reset_count;
 static uint32_t trig_count_ch0, trig_count_ch16, trig_count_ch31,
                 trig_count_or32;
 static uint16_t hvps_volt;
@@ -177,9 +450,226 @@ static uint16_t hvps_status;
 static uint16_t hvps_cmds_sent;
 static uint16_t hvps_cmds_acked;
 static uint16_t hvps_cmds_failed;
+static uint16_t hvps_cmds_retried;
+static uint16_t hvps_cmds_timed_out;
 static uint16_t hvps_last_cmd_err;
 static uint16_t batt_volt, batt_curr, citi_temp;
 
+/*
+ * HK acquisition schedule, for the sources that take bus time to read. On
+ * each HK timer tick, a source is read if (tick % period) == phase; otherwise,
+ * its last value is kept. A period of 0 stops reading the source. Hit counters
+ * and HVPS command counters take no bus time and are read on every tick. The
+ * HVPS voltage, current, temperature and status come from a single monitor
+ * command, sent if any of them is due; the others keep their last value.
+ *
+ * The HK ADC sources only copy the average kept by the background sampler,
+ * which takes no bus time on the HK tick: the ADC conversion rate is set by
+ * HK_CONF_ADC, and their schedule only sets how often the HK value follows
+ * the average.
+ *
+ * All sources are read on the first tick, and the HVPS temperature correction
+ * factor also after it has been set by command.
+ */
+#define HK_SRC_HVPS_VOLT            (0)
+#define HK_SRC_HVPS_CURR            (1)
+#define HK_SRC_HVPS_TEMP            (2)
+#define HK_SRC_HVPS_STATUS          (3)
+#define HK_SRC_HVPS_TEMP_CORR       (4)
+#define HK_SRC_BATT_VOLT            (5)
+#define HK_SRC_BATT_CURR            (6)
+#define HK_SRC_CITI_TEMP            (7)
+#define HK_SRC_COUNT                (8)
+
+struct hk_sched {
+	uint16_t period;   // in HK timer ticks
+	uint16_t phase;
+};
+
+static struct hk_sched hk_sched[HK_SRC_COUNT] = {
+	[HK_SRC_HVPS_VOLT]      = { .period =  1, .phase =  0 },
+	[HK_SRC_HVPS_CURR]      = { .period =  1, .phase =  0 },
+	[HK_SRC_HVPS_TEMP]      = { .period =  1, .phase =  0 },
+	[HK_SRC_HVPS_STATUS]    = { .period =  1, .phase =  0 },
+	[HK_SRC_HVPS_TEMP_CORR] = { .period = 60, .phase = 30 },
+	[HK_SRC_BATT_VOLT]      = { .period =  1, .phase =  0 },
+	[HK_SRC_BATT_CURR]      = { .period =  1, .phase =  0 },
+	[HK_SRC_CITI_TEMP]      = { .period =  1, .phase =  0 },
+};
+
+static uint32_t hk_tick = 0;
+static uint8_t hk_pending = 0;
+static uint32_t hk_hvps_due = 0;
+static uint32_t hk_src_forced = (1ul << HK_SRC_COUNT) - 1;
+
+/**
+ * @brief Check whether an HK source is to be read on the current HK tick
+ *
+ * @param src One of the HK_SRC_ values
+ */
+static int hk_src_due(unsigned int src);
+
+/*
+ * HK fields, indexed by field ID. REQ_HK sends the selected fields in field ID
+ * order, each as a big-endian value of the width of its source variable. All
+ * fields are selected by default, which gives the full HK_LEN-byte packet.
+ */
+#define HK_FIELD_CUBES_TIME         (0)
+#define HK_FIELD_RESET_COUNT        (1)
+#define HK_FIELD_TRIG_COUNT_CH0     (2)
+#define HK_FIELD_TRIG_COUNT_CH16    (3)
+#define HK_FIELD_TRIG_COUNT_CH31    (4)
+#define HK_FIELD_TRIG_COUNT_OR32    (5)
+#define HK_FIELD_HVPS_VOLT          (6)
+#define HK_FIELD_HVPS_CURR          (7)
+#define HK_FIELD_HVPS_TEMP          (8)
+#define HK_FIELD_HVPS_STATUS        (9)
+#define HK_FIELD_HVPS_CMDS_SENT     (10)
+#define HK_FIELD_HVPS_CMDS_ACKED    (11)
+#define HK_FIELD_HVPS_CMDS_FAILED   (12)
+#define HK_FIELD_HVPS_LAST_CMD_ERR  (13)
+#define HK_FIELD_BATT_VOLT          (14)
+#define HK_FIELD_BATT_CURR          (15)
+#define HK_FIELD_CITI_TEMP          (16)
+#define HK_FIELD_HVPS_CMDS_RETRIED  (17)
+#define HK_FIELD_HVPS_CMDS_TIMEOUT  (18)
+#define HK_FIELD_COUNT              (19)
+
+#define HK_FIELDS_ALL               ((1ul << HK_FIELD_COUNT) - 1)
+
+struct hk_field {
+	const void *src;
+	uint8_t width;     // 2 or 4 bytes
+};
+
+#define HK_FIELD(var)  { .src = &(var), .width = sizeof(var) }
+
+static const struct hk_field hk_fields[HK_FIELD_COUNT] = {
+	[HK_FIELD_CUBES_TIME]        = HK_FIELD(cubes_time),
+	[HK_FIELD_RESET_COUNT]       = HK_FIELD(reset_count),
+	[HK_FIELD_TRIG_COUNT_CH0]    = HK_FIELD(trig_count_ch0),
+	[HK_FIELD_TRIG_COUNT_CH16]   = HK_FIELD(trig_count_ch16),
+	[HK_FIELD_TRIG_COUNT_CH31]   = HK_FIELD(trig_count_ch31),
+	[HK_FIELD_TRIG_COUNT_OR32]   = HK_FIELD(trig_count_or32),
+	[HK_FIELD_HVPS_VOLT]         = HK_FIELD(hvps_volt),
+	[HK_FIELD_HVPS_CURR]         = HK_FIELD(hvps_curr),
+	[HK_FIELD_HVPS_TEMP]         = HK_FIELD(hvps_temp),
+	[HK_FIELD_HVPS_STATUS]       = HK_FIELD(hvps_status),
+	[HK_FIELD_HVPS_CMDS_SENT]    = HK_FIELD(hvps_cmds_sent),
+	[HK_FIELD_HVPS_CMDS_ACKED]   = HK_FIELD(hvps_cmds_acked),
+	[HK_FIELD_HVPS_CMDS_FAILED]  = HK_FIELD(hvps_cmds_failed),
+	[HK_FIELD_HVPS_LAST_CMD_ERR] = HK_FIELD(hvps_last_cmd_err),
+	[HK_FIELD_BATT_VOLT]         = HK_FIELD(batt_volt),
+	[HK_FIELD_BATT_CURR]         = HK_FIELD(batt_curr),
+	[HK_FIELD_CITI_TEMP]         = HK_FIELD(citi_temp),
+	[HK_FIELD_HVPS_CMDS_RETRIED] = HK_FIELD(hvps_cmds_retried),
+	[HK_FIELD_HVPS_CMDS_TIMEOUT] = HK_FIELD(hvps_cmds_timed_out),
+};
+
+/* Selected fields, one bit per field ID */
+static uint32_t hk_field_set = HK_FIELDS_ALL;
+
+#if HK_LEN != HK_HISTORY_REC_LEN
+#error "HK history records must hold a full HK packet"
+#endif
+
+/*
+ * HK configuration, sent via MSP_OP_SEND_CUBES_HK_CONF. The first byte selects
+ * what is configured:
+ *   HK_CONF_FIELDS        : bytes 1..4 are the big-endian field set, one bit
+ *                           per field ID; 0 selects all fields.
+ *   HK_CONF_HISTORY       : bytes 1..2 are the big-endian HK history depth,
+ *                           byte 3 its decimation; this clears the history.
+ *   HK_CONF_HISTORY_SINCE : bytes 1..4 are the big-endian CUBES time from
+ *                           which the next HK history download starts.
+ *   HK_CONF_STATS_WINDOW  : bytes 1..2 are the big-endian number of HK
+ *                           samples per HK statistics window.
+ *   HK_CONF_STATS_LIMITS  : byte 1 is an HK statistics channel, bytes 2..5
+ *                           and 6..9 its big-endian low and high limits.
+ *   HK_CONF_SCHED         : byte 1 is an HK source (HK_SRC_), bytes 2..3 and
+ *                           4..5 its big-endian period and phase, in HK
+ *                           timer ticks; the phase must be less than the
+ *                           period.
+ *   HK_CONF_ADC           : bytes 1 and 2 are the HK ADC data rate and PGA
+ *                           settings (the DR and PGA fields of its CONFIG
+ *                           register), bytes 3..4 the big-endian time
+ *                           between conversions in ms.
+ *   HK_CONF_ADC_FILTER    : byte 1 is an HK ADC channel (HK_ADC_CH_), byte 2
+ *                           its filter (HK_ADC_FILTER_) and byte 3 the
+ *                           boxcar length or IIR shift.
+ */
+#define HK_CONF_FIELDS              (0)
+#define HK_CONF_FIELDS_LEN          (5)
+#define HK_CONF_HISTORY             (1)
+#define HK_CONF_HISTORY_LEN         (4)
+#define HK_CONF_HISTORY_SINCE       (2)
+#define HK_CONF_HISTORY_SINCE_LEN   (5)
+#define HK_CONF_STATS_WINDOW        (3)
+#define HK_CONF_STATS_WINDOW_LEN    (3)
+#define HK_CONF_STATS_LIMITS        (4)
+#define HK_CONF_STATS_LIMITS_LEN    (10)
+#define HK_CONF_SCHED               (5)
+#define HK_CONF_SCHED_LEN           (6)
+#define HK_CONF_ADC                 (6)
+#define HK_CONF_ADC_LEN             (5)
+#define HK_CONF_ADC_FILTER          (7)
+#define HK_CONF_ADC_FILTER_LEN      (4)
+#define HK_CONF_MAXLEN              (10)
+
+/*
+ * HK packet, as sent for REQ_HK. It is serialized by the main loop each time
+ * HK is read, so that the I2C ISR can answer REQ_HK right away from the last
+ * complete packet, without waiting on the main loop.
+ *
+ * The main loop writes the buffer not being served and then increments the
+ * sequence counter, whose lowest bit thus selects the latest complete packet.
+ */
+static uint8_t hk_packet[2][HK_LEN];
+static uint8_t hk_packet_len[2];
+static volatile uint32_t hk_packet_seq = 0;
+
+/**
+ * @brief Publish the HK values read on the last HK tick
+ *
+ * Serializes the HK packet, adds it to the HK history and statistics, and
+ * passes the end-of-DAQ HK to the gateware.
+ */
+static void hk_complete(void);
+
+/**
+ * @brief Serialize the HK values
+ *
+ * @param pkt       Destination buffer, at least HK_LEN bytes long
+ * @param field_set Fields to serialize, one bit per field ID
+ *
+ * @return The packet length
+ */
+static unsigned long hk_serialize(uint8_t *pkt, uint32_t field_set);
+
+/**
+ * @brief Serialize the HK values into a new HK packet and publish it
+ *
+ * To be called from the main loop only.
+ */
+static void hk_packet_update(void);
+
+/**
+ * @brief Add the HK values to the HK statistics
+ *
+ * Trigger rates are computed from the hit counter deltas since the previous
+ * call. To be called from the main loop, each time HK is read.
+ */
+static void hk_stats_sample(void);
+
+/**
+ * @brief Copy the latest complete HK packet
+ *
+ * @param dest Destination buffer, at least HK_LEN bytes long
+ *
+ * @return The packet length
+ */
+static unsigned long hk_packet_read(uint8_t *dest);
+
 
 /*
  *==============================================================================
@@ -199,6 +689,14 @@ int main(void)
 
 	hk_adc_init();
 
+	msp_stats_init();
+
+	cmd_queue_init();
+
+	/* REQ_HK is answered with the full layout until HK is first read */
+	reset_count = mem_reset_counter_read();
+	hk_packet_update();
+
 	/*
 	 * Initialize I2C1 peripheral, used to communicate to OBC via MSP
 	 */
@@ -301,414 +799,1062 @@ int main(void)
 	/*
 	 * Infinite loop
 	 */
+	struct cmd_queue_entry *cmd;
+	unsigned int src;
+
 	while(1) {
 		/* Read and prepare HK data once a second (outside ISRs) */
 		if (hk_timer_trig) {
+			/* HK still waiting on the HVPS is published as it is */
+			if (hk_pending)
+				hk_complete();
+
 			cubes_time = cubes_get_time();
+			reset_count = mem_reset_counter_read();
 			trig_count_ch0 = citiroc_hcr_get(0);
 			trig_count_ch16 = citiroc_hcr_get(16);
 			trig_count_ch31 = citiroc_hcr_get(31);
 			trig_count_or32 = citiroc_hcr_get(32);
-			hvps_volt = hvps_get_voltage();
-			hvps_curr = hvps_get_current();
-			hvps_temp = hvps_get_temp();
-			hvps_status = hvps_get_status();
-			hvps_cmds_sent = hvps_get_cmd_counter(HVPS_CMDS_SENT);
-			hvps_cmds_acked = hvps_get_cmd_counter(HVPS_CMDS_ACKED);
-			hvps_cmds_failed = hvps_get_cmd_counter(HVPS_CMDS_FAILED);
-			hvps_last_cmd_err = hvps_get_last_cmd_err();
-			batt_volt = hk_adc_calc_avg_voltage();
-			batt_curr = hk_adc_calc_avg_current();
-			citi_temp = hk_adc_calc_avg_citi_temp();
-
-			/* Prep end-of-DAQ HK for histogram header (only once per DAQ) */
-			if ((!citiroc_daq_is_rdy()) && (!end_daq_hk_ready) &&
-					(end_daq_hk_time == 0)) {
-				citiroc_daq_set_citi_temp(citi_temp);
-				citiroc_daq_set_hvps_temp(hvps_temp);
-				citiroc_daq_set_hvps_volt(hvps_volt);
-				citiroc_daq_set_hvps_curr(hvps_curr);
-				end_daq_hk_ready = 1;  // DAQ almost ready!
-			}
+
+			/*
+			 * HVPS readouts are queued, and HK is complete once all replies
+			 * are in. The HK ADC values are the averages kept by the
+			 * background sampler, see hk_adc_poll().
+			 */
+			hk_hvps_due = 0;
+			for (src = HK_SRC_HVPS_VOLT; src <= HK_SRC_HVPS_STATUS; src++)
+				if (hk_src_due(src))
+					hk_hvps_due |= (1ul << src);
+			if (hk_hvps_due)
+				hvps_update_monitor_async();
 
 			/*
 			 * Also read temp. compensation factor from HVPS -- but this is for
 			 * readout by command, not through HK.
 			 */
-			hvps_get_temp_corr_factor(&hvps_temp_corr);
-
+			if (hk_src_due(HK_SRC_HVPS_TEMP_CORR))
+				hvps_get_temp_corr_factor_async(&hvps_temp_corr);
+
+			if (hk_src_due(HK_SRC_BATT_VOLT))
+				batt_volt = hk_adc_calc_avg_voltage();
+			if (hk_src_due(HK_SRC_BATT_CURR))
+				batt_curr = hk_adc_calc_avg_current();
+			if (hk_src_due(HK_SRC_CITI_TEMP))
+				citi_temp = hk_adc_calc_avg_citi_temp();
+
+			hk_tick++;
+			hk_pending = 1;
 			hk_timer_trig = 0;
 		}
 
+		/* HK ADC conversions, in the background */
+		hk_adc_poll();
+
+		/* HVPS command replies, timeouts and retries */
+		hvps_poll();
+		if (hk_pending && hvps_is_idle())
+			hk_complete();
+
 		/* Prepare payload data if DAQ just finished */
 		if (citiroc_daq_is_rdy() && end_daq_hk_ready) {
 			prep_payload_data();
 			end_daq_hk_ready = 0;
 		}
 
-		/* MSP commands */
-		if (has_send != 0) {
-			uint32_t u32val = 0;
-			uint16_t u16val = 0;
-
-			/* Handle OBC request commands */
-			switch (has_send) {
-
-				case MSP_OP_REQ_CUBES_ID:
-					/* CUBES_ID data prepared once on init. */
-					break;
-
-				case MSP_OP_REQ_HK:
-					/* Reset counter and hit counter register readouts */
-					u32val = cubes_time;
-					msp_to_bigendian32(send_data_hk, u32val);
-
-					u32val = mem_reset_counter_read();;
-					msp_to_bigendian32(send_data_hk+4, u32val);
-
-					u32val = trig_count_ch0;
-					msp_to_bigendian32(send_data_hk+8, u32val);
-					u32val = trig_count_ch16;
-					msp_to_bigendian32(send_data_hk+12, u32val);
-					u32val = trig_count_ch31;
-					msp_to_bigendian32(send_data_hk+16, u32val);
-					u32val = trig_count_or32;
-					msp_to_bigendian32(send_data_hk+20, u32val);
-
-					/* HVPS HK */
-					u16val = hvps_volt;
-					send_data_hk[24] = (u16val >> 8) & 0xff;
-					send_data_hk[25] = u16val & 0xff;
-
-					u16val = hvps_curr;
-					send_data_hk[26] = (u16val >> 8) & 0xff;
-					send_data_hk[27] = u16val & 0xff;
-
-					u16val = hvps_temp;
-					send_data_hk[28] = (u16val >> 8) & 0xff;
-					send_data_hk[29] = u16val & 0xff;
-
-					u16val = hvps_status;
-					send_data_hk[30] = (u16val >> 8) & 0xff;
-					send_data_hk[31] = u16val & 0xff;
-
-					u16val = hvps_cmds_sent;
-					send_data_hk[32] = (u16val >> 8)  & 0xff;
-					send_data_hk[33] = u16val  & 0xff;
-
-					u16val = hvps_cmds_acked;
-					send_data_hk[34] = (u16val >> 8)  & 0xff;
-					send_data_hk[35] = u16val  & 0xff;
-
-					u16val = hvps_cmds_failed;
-					send_data_hk[36] = (u16val >> 8)  & 0xff;
-					send_data_hk[37] = u16val  & 0xff;
-
-					u16val = hvps_last_cmd_err;
-					send_data_hk[38] = (u16val >> 8) & 0xff;
-					send_data_hk[39] = u16val & 0xff;
-
-					/* On-board ADC HK */
-					u16val = batt_volt;
-					send_data_hk[40] = (u16val >> 8) & 0xff;
-					send_data_hk[41] = u16val & 0xff;
-
-					u16val = batt_curr;
-					send_data_hk[42] = (u16val >> 8) & 0xff;
-					send_data_hk[43] = u16val & 0xff;
-
-					u16val = citi_temp;
-					send_data_hk[44] = (u16val >> 8) & 0xff;
-					send_data_hk[45] = u16val & 0xff;
-
-					break;
-
-				case MSP_OP_REQ_PAYLOAD:
-					/* Payload data prepared when DAQ is ready (see above) */
-					break;
-
-				case MSP_OP_REQ_CUBES_HVPS_TEMP_COMP:
-					send_data_hvps_temp_comp[0] =
-							(uint8_t)(hvps_temp_corr.dtp1 >> 8);
-					send_data_hvps_temp_comp[1] =
-							(uint8_t)(hvps_temp_corr.dtp1);
-					send_data_hvps_temp_comp[2] =
-							(uint8_t)(hvps_temp_corr.dtp2 >> 8);
-					send_data_hvps_temp_comp[3] =
-							(uint8_t)(hvps_temp_corr.dtp2);
-					send_data_hvps_temp_comp[4] =
-							(uint8_t)(hvps_temp_corr.dt1 >> 8);
-					send_data_hvps_temp_comp[5] =
-							(uint8_t)(hvps_temp_corr.dt1);
-					send_data_hvps_temp_comp[6] =
-							(uint8_t)(hvps_temp_corr.dt2 >> 8);
-					send_data_hvps_temp_comp[7] =
-							(uint8_t)(hvps_temp_corr.dt2);
-					send_data_hvps_temp_comp[8] =
-							(uint8_t)(hvps_temp_corr.vb >> 8);
-					send_data_hvps_temp_comp[9] =
-							(uint8_t)(hvps_temp_corr.vb);
-					send_data_hvps_temp_comp[10] =
-							(uint8_t)(hvps_temp_corr.tb >> 8);
-					send_data_hvps_temp_comp[11] =
-							(uint8_t)(hvps_temp_corr.tb);
-					break;
+		/* Time-tagged commands, checked every loop to keep to the second */
+		timed_cmd_run_due(cubes_get_time());
+
+		/* MSP commands, one per loop, in the order they were received */
+		cmd = cmd_queue_peek();
+		if (cmd) {
+			if (cmd->flags & CMD_QUEUE_STREAMED) {
+				cmd_run(cmd->opcode, (uint8_t *)recv_shadow, cmd->len);
+				/* Done with the shadow before the ISR may reuse it */
+				__DMB();
+				recv_shadow_busy = 0;
+			} else {
+				cmd_run(cmd->opcode, cmd->data, cmd->len);
 			}
+			cmd_queue_pop(msp_stats_time());
+		}
+	}
+
+	// This point should not be reached
+	return -1;
+}
 
-			has_send = 0;
 
-		} else if (has_recv != 0) {
+/*
+ *==============================================================================
+ * HK Packet
+ *==============================================================================
+ */
+static void hk_complete(void)
+{
+	uint8_t hk_rec[HK_LEN];
+
+	hvps_cmds_sent = hvps_get_cmd_counter(HVPS_CMDS_SENT);
+	hvps_cmds_acked = hvps_get_cmd_counter(HVPS_CMDS_ACKED);
+	hvps_cmds_failed = hvps_get_cmd_counter(HVPS_CMDS_FAILED);
+	hvps_cmds_retried = hvps_get_cmd_counter(HVPS_CMDS_RETRIED);
+	hvps_cmds_timed_out = hvps_get_cmd_counter(HVPS_CMDS_TIMED_OUT);
+	hvps_last_cmd_err = hvps_get_last_cmd_err();
+
+	if (hk_hvps_due & (1ul << HK_SRC_HVPS_VOLT))
+		hvps_volt = hvps_get_voltage();
+	if (hk_hvps_due & (1ul << HK_SRC_HVPS_CURR))
+		hvps_curr = hvps_get_current();
+	if (hk_hvps_due & (1ul << HK_SRC_HVPS_TEMP))
+		hvps_temp = hvps_get_temp();
+	if (hk_hvps_due & (1ul << HK_SRC_HVPS_STATUS))
+		hvps_status = hvps_get_status();
+
+	hk_packet_update();
+
+	/* The history holds full packets, whatever the field set */
+	hk_serialize(hk_rec, HK_FIELDS_ALL);
+	hk_history_add(hk_rec);
+
+	hk_stats_sample();
+
+	/* Prep end-of-DAQ HK for histogram header (only once per DAQ) */
+	if ((!citiroc_daq_is_rdy()) && (!end_daq_hk_ready) &&
+			(end_daq_hk_time == 0)) {
+		citiroc_daq_set_citi_temp(citi_temp);
+		citiroc_daq_set_hvps_temp(hvps_temp);
+		citiroc_daq_set_hvps_volt(hvps_volt);
+		citiroc_daq_set_hvps_curr(hvps_curr);
+		end_daq_hk_ready = 1;  // DAQ almost ready!
+	}
 
-			/* Handle OBC receive commands */
-			switch (has_recv) {
+	hk_pending = 0;
+}
 
-				case MSP_OP_SEND_TIME:
-					cubes_set_time((recv_data[0] << 24) |
-					               (recv_data[1] << 16) |
-					               (recv_data[2] <<  8) |
-					               (recv_data[3]));
-					break;
 
-				case MSP_OP_SEND_CUBES_HVPS_CONF:
-				{
-					uint8_t turn_on = recv_data[0] & 0x01;
-					uint8_t reset = (uint8_t)recv_data[0] & 0x02;
+static int hk_src_due(unsigned int src)
+{
+	if (hk_src_forced & (1ul << src)) {
+		hk_src_forced &= ~(1ul << src);
+		return 1;
+	}
 
-					if (turn_on && !hvps_is_on())
-						hvps_turn_on();
-					else if (!turn_on && hvps_is_on())
-						hvps_turn_off();
+	return hk_sched[src].period &&
+	       ((hk_tick % hk_sched[src].period) == hk_sched[src].phase);
+}
 
-					if (reset && hvps_is_on())
-						hvps_reset();
 
-					/*
-					 * Apply temperature correction factor if the command was
-					 * not a "turn off" or a "reset"...
-					 */
-					if (turn_on && !reset) {
-						struct hvps_temp_corr_factor f;
-
-						f.dtp1 = (((uint16_t)recv_data[1]) << 8) |
-						          ((uint16_t)recv_data[2]);
-						f.dtp2 = (((uint16_t)recv_data[3]) << 8) |
-						          ((uint16_t)recv_data[4]);
-						f.dt1 = (((uint16_t)recv_data[5]) << 8) |
-						         ((uint16_t)recv_data[6]);
-						f.dt2 = (((uint16_t)recv_data[7]) << 8) |
-						         ((uint16_t)recv_data[8]);
-						f.vb = (((uint16_t)recv_data[ 9]) << 8) |
-						        ((uint16_t)recv_data[10]);
-						f.tb = (((uint16_t)recv_data[11]) << 8) |
-						        ((uint16_t)recv_data[12]);
-
-						hvps_set_temp_corr_factor(&f);
-						hvps_temp_compens_en();
-					}
-					break;
-				}
+static unsigned long hk_serialize(uint8_t *pkt, uint32_t field_set)
+{
+	unsigned long len = 0;
+	unsigned int i;
+
+	for (i = 0; i < HK_FIELD_COUNT; i++) {
+		if (!(field_set & (1ul << i)))
+			continue;
+		if (hk_fields[i].width == 4) {
+			msp_to_bigendian32(pkt+len, *(const uint32_t *)hk_fields[i].src);
+		} else {
+			pkt[len]   = *(const uint16_t *)hk_fields[i].src >> 8;
+			pkt[len+1] = *(const uint16_t *)hk_fields[i].src & 0xff;
+		}
+		len += hk_fields[i].width;
+	}
 
-				case MSP_OP_SEND_CUBES_HVPS_TMP_VOLT:
-				{
-					uint8_t turn_on = recv_data[0] & 0x01;
-					uint8_t reset = recv_data[0] & 0x02;
+	return len;
+}
 
-					if (turn_on && !hvps_is_on())
-						hvps_turn_on();
-					else if (!turn_on && hvps_is_on())
-						hvps_turn_off();
-					if(reset && hvps_is_on())
-						hvps_reset();
 
-					if (turn_on && !reset)
-						hvps_set_temporary_voltage((((uint16_t)recv_data[1]) << 8) |
-						                            ((uint16_t)recv_data[2]));
+static void hk_packet_update(void)
+{
+	unsigned int idx = (hk_packet_seq + 1) & 1;
 
-					break;
-				}
+	hk_packet_len[idx] = hk_serialize(hk_packet[idx], hk_field_set);
 
-				case MSP_OP_SEND_CUBES_CITI_CONF:
-					// TODO: Check that we got all of `MEM_CITIROC_CONF_LEN-1`?
-					mem_write(MEM_CITIROC_CONF_ADDR, MEM_CITIROC_CONF_LEN,
-					          recv_data);
-					citiroc_send_slow_control();
-					conf_id = 255; // temporary SC config.
-					break;
-
-				case MSP_OP_SEND_CUBES_PROB_CONF:
-					// TODO: Check that we got all of `MEM_CITIROC_PROBE_LEN`?
-					mem_write(MEM_CITIROC_PROBE_ADDR, MEM_CITIROC_PROBE_LEN,
-					          recv_data);
-					citiroc_send_probes();
-					break;
-
-				case MSP_OP_SEND_NVM_CITI_CONF:
-					/*
-					 * Write at NVM conf addr offset w/o changing operating
-					 * conf_id and w/o applying to ASIC; for these to happen,
-					 * a separate MSP_OP_SELECT_NVM_CITI_CONF is needed.
-					 */
-					tmp_conf_id = recv_data[MEM_CITIROC_CONF_LEN-1];
-					// TODO: Check that we got all of `MEM_CITIROC_CONF_LEN`?
-					if ((tmp_conf_id >= 1) && (tmp_conf_id <= 254)) {
-						uint32_t nvm_addr = MEM_CITIROC_CONF_ADDR_NVM +
-								((tmp_conf_id - 1) * MEM_CITIROC_CONF_LEN);
-						mem_write_nvm(nvm_addr, MEM_CITIROC_CONF_LEN, recv_data);
-					}
-					break;
-
-				case MSP_OP_SELECT_NVM_CITI_CONF:
-					tmp_conf_id = recv_data[0];
-					/* Get conf_id from MSP frame and apply it if valid */
-					if ((tmp_conf_id >= CONF_ID_NVM_MIN) &&
-							(tmp_conf_id <= CONF_ID_NVM_MAX)) {
-						nvm_conf_addr = (uint8_t*)(MEM_CITIROC_CONF_ADDR_NVM +
-								((tmp_conf_id - 1) * MEM_CITIROC_CONF_LEN));
-
-						if (nvm_conf_addr[MEM_CITIROC_CONF_LEN-1] ==
-								tmp_conf_id) {
-							mem_write(MEM_CITIROC_CONF_ADDR,
-									MEM_CITIROC_CONF_LEN, nvm_conf_addr);
-							citiroc_send_slow_control();
-							conf_id = tmp_conf_id;
-							mem_write_nvm(MEM_CITIROC_CONF_ID_ADDR,
-									MEM_CITIROC_CONF_ID_LEN, &conf_id);
-						}
-					} else if (tmp_conf_id == 0) {
-						mem_write(MEM_CITIROC_CONF_ADDR, MEM_CITIROC_CONF_LEN,
-								CITIROC_DEFCONFIG);
-						citiroc_send_slow_control();
-						conf_id = CITIROC_DEFCONFIG[MEM_CITIROC_CONF_LEN-1];
-						mem_write_nvm(MEM_CITIROC_CONF_ID_ADDR,
-								MEM_CITIROC_CONF_ID_LEN, &conf_id);
-					}
-					break;
-
-				case MSP_OP_SEND_READ_REG_DEBUG:
-					citiroc_rrd(recv_data[0] & 0x01, (recv_data[0] & 0x3e)>>1);
-					break;
-
-				case MSP_OP_SEND_CUBES_DAQ_CONF:
-					/* Set DAQ duration */
-					daq_dur = recv_data[0];
-					citiroc_daq_set_dur(daq_dur);
-
-					/* Set bin_cfg, with any adjustment if out of range */
-					memcpy(bin_cfg, recv_data+1, 6);
-					for (int i = 0; i < 6; i++) {
-						if ((bin_cfg[i] > 6) && (bin_cfg[i] <= 9))
-							bin_cfg[i] = 6;
-						else if ((bin_cfg[i] == 10))
-							bin_cfg[i] = 11;
-						else if (bin_cfg[i] > 12)
-							bin_cfg[i] = 12;
-					}
-					break;
-
-				case MSP_OP_SEND_CUBES_GATEWARE_CONF:
-				{
-					uint8_t resetvalue = recv_data[0];
-					if (resetvalue & 0b00000001)
-						mem_reset_counter_clear();
-					if (resetvalue & 0b00000010)
-						citiroc_hcr_reset();
-					if (resetvalue & 0b00000100)
-						citiroc_histo_reset();
-					if (resetvalue & 0b00001000)
-						citiroc_psc_reset();
-					if (resetvalue & 0b00010000)
-						citiroc_sr_reset();
-					if (resetvalue & 0b00100000)
-						citiroc_pa_reset();
-					if (resetvalue & 0b01000000)
-						citiroc_trigs_reset();
-					if (resetvalue & 0b10000000)
-						citiroc_read_reg_reset();
-					break;
-				}
+	/* The packet must be complete before it is published */
+	__DMB();
+	hk_packet_seq++;
+}
 
-				case MSP_OP_SEND_CUBES_CALIB_PULSE_CONF:
-					citiroc_calib_set((recv_data[0] << 24) |
-					                  (recv_data[1] << 16) |
-					                  (recv_data[2] << 8) |
-					                  (recv_data[3]));
-					break;
-			}
 
-			has_recv = 0;
+static uint32_t hcr_delta(uint32_t count, uint32_t *prev)
+{
+	/* Hit counters restart from zero when reset, e.g. at DAQ start */
+	uint32_t delta = (count >= *prev) ? count - *prev : count;
 
-		} else if (has_syscommand != 0) {
+	*prev = count;
+	return delta;
+}
 
-			/* Handle system commands */
-			switch (has_syscommand) {
 
-				case MSP_OP_ACTIVE:
-					hvps_turn_on();
-					break;
+static void hk_stats_sample(void)
+{
+	static uint32_t prev_ch0, prev_ch16, prev_ch31, prev_or32;
+	static int seeded = 0;
+	uint32_t vals[HK_STATS_CHANNELS];
+	unsigned int skip = 0;
+
+	vals[HK_STATS_CH_HVPS_VOLT] = hvps_volt;
+	vals[HK_STATS_CH_HVPS_CURR] = hvps_curr;
+	vals[HK_STATS_CH_HVPS_TEMP] = hvps_temp;
+	vals[HK_STATS_CH_BATT_VOLT] = batt_volt;
+	vals[HK_STATS_CH_BATT_CURR] = batt_curr;
+	vals[HK_STATS_CH_CITI_TEMP] = citi_temp;
+	vals[HK_STATS_CH_RATE_CH0] = hcr_delta(trig_count_ch0, &prev_ch0);
+	vals[HK_STATS_CH_RATE_CH16] = hcr_delta(trig_count_ch16, &prev_ch16);
+	vals[HK_STATS_CH_RATE_CH31] = hcr_delta(trig_count_ch31, &prev_ch31);
+	vals[HK_STATS_CH_RATE_OR32] = hcr_delta(trig_count_or32, &prev_or32);
+
+	/*
+	 * The first deltas are the counts accumulated since the counters were
+	 * last reset, not a rate: they only seed the previous counts.
+	 */
+	if (!seeded) {
+		skip = (1 << HK_STATS_CH_RATE_CH0) | (1 << HK_STATS_CH_RATE_CH16) |
+				(1 << HK_STATS_CH_RATE_CH31) |
+				(1 << HK_STATS_CH_RATE_OR32);
+		seeded = 1;
+	}
+
+	hk_stats_add(cubes_time, vals, skip);
+}
+
+
+static unsigned long hk_packet_read(uint8_t *dest)
+{
+	uint32_t seq;
+	unsigned long len;
+
+	/*
+	 * The I2C ISR can not be interrupted by the main loop, so this only loops
+	 * if called from the main loop and the ISR publishes a packet meanwhile.
+	 */
+	do {
+		seq = hk_packet_seq;
+		__DMB();
+		len = hk_packet_len[seq & 1];
+		memcpy(dest, hk_packet[seq & 1], len);
+		__DMB();
+	} while (seq != hk_packet_seq);
+
+	return len;
+}
+
+
+/*
+ *==============================================================================
+ * Command Handlers
+ *==============================================================================
+ */
+/*
+ * ----------------------------------------
+ * Request commands, acted upon in the main
+ * loop after the request has been answered
+ * ----------------------------------------
+ */
+static int cmd_req_hvps_temp_comp(uint8_t *data, unsigned long len)
+{
+	send_data_hvps_temp_comp[0] = (uint8_t)(hvps_temp_corr.dtp1 >> 8);
+	send_data_hvps_temp_comp[1] = (uint8_t)(hvps_temp_corr.dtp1);
+	send_data_hvps_temp_comp[2] = (uint8_t)(hvps_temp_corr.dtp2 >> 8);
+	send_data_hvps_temp_comp[3] = (uint8_t)(hvps_temp_corr.dtp2);
+	send_data_hvps_temp_comp[4] = (uint8_t)(hvps_temp_corr.dt1 >> 8);
+	send_data_hvps_temp_comp[5] = (uint8_t)(hvps_temp_corr.dt1);
+	send_data_hvps_temp_comp[6] = (uint8_t)(hvps_temp_corr.dt2 >> 8);
+	send_data_hvps_temp_comp[7] = (uint8_t)(hvps_temp_corr.dt2);
+	send_data_hvps_temp_comp[8] = (uint8_t)(hvps_temp_corr.vb >> 8);
+	send_data_hvps_temp_comp[9] = (uint8_t)(hvps_temp_corr.vb);
+	send_data_hvps_temp_comp[10] = (uint8_t)(hvps_temp_corr.tb >> 8);
+	send_data_hvps_temp_comp[11] = (uint8_t)(hvps_temp_corr.tb);
+
+	return CMD_OK;
+}
+
+
+/*
+ * -------------
+ * Send commands
+ * -------------
+ */
+static int cmd_send_time(uint8_t *data, unsigned long len)
+{
+	cubes_set_time((data[0] << 24) |
+	               (data[1] << 16) |
+	               (data[2] <<  8) |
+	               (data[3]));
+	return CMD_OK;
+}
+
+
+static int cmd_hvps_conf(uint8_t *data, unsigned long len)
+{
+	uint8_t turn_on = data[0] & 0x01;
+	uint8_t reset = (uint8_t)data[0] & 0x02;
+	int hvps_err = 0;
+
+	if (turn_on && !hvps_is_on())
+		hvps_err |= hvps_turn_on();
+	else if (!turn_on && hvps_is_on())
+		hvps_err |= hvps_turn_off();
+
+	if (reset && hvps_is_on())
+		hvps_err |= hvps_reset();
+
+	/*
+	 * Apply temperature correction factor if the command was
+	 * not a "turn off" or a "reset"...
+	 */
+	if (turn_on && !reset) {
+		struct hvps_temp_corr_factor f;
+
+		f.dtp1 = (((uint16_t)data[1]) << 8) |
+		          ((uint16_t)data[2]);
+		f.dtp2 = (((uint16_t)data[3]) << 8) |
+		          ((uint16_t)data[4]);
+		f.dt1 = (((uint16_t)data[5]) << 8) |
+		         ((uint16_t)data[6]);
+		f.dt2 = (((uint16_t)data[7]) << 8) |
+		         ((uint16_t)data[8]);
+		f.vb = (((uint16_t)data[ 9]) << 8) |
+		        ((uint16_t)data[10]);
+		f.tb = (((uint16_t)data[11]) << 8) |
+		        ((uint16_t)data[12]);
+
+		hvps_err |= hvps_set_temp_corr_factor(&f);
+		hvps_err |= hvps_temp_compens_en();
+
+		/* Read back the new factor on the next HK tick */
+		hk_src_forced |= (1ul << HK_SRC_HVPS_TEMP_CORR);
+	}
+
+	return hvps_err ? CMD_ERR_FAILED : CMD_OK;
+}
+
+
+static int cmd_hvps_tmp_volt(uint8_t *data, unsigned long len)
+{
+	uint8_t turn_on = data[0] & 0x01;
+	uint8_t reset = data[0] & 0x02;
+	int hvps_err = 0;
+
+	if (turn_on && !hvps_is_on())
+		hvps_err |= hvps_turn_on();
+	else if (!turn_on && hvps_is_on())
+		hvps_err |= hvps_turn_off();
+	if(reset && hvps_is_on())
+		hvps_err |= hvps_reset();
+
+	if (turn_on && !reset)
+		hvps_err |= hvps_set_temporary_voltage(
+				(((uint16_t)data[1]) << 8) | ((uint16_t)data[2]));
+
+	return hvps_err ? CMD_ERR_FAILED : CMD_OK;
+}
+
+
+static int cmd_citi_conf(uint8_t *data, unsigned long len)
+{
+	mem_write(MEM_CITIROC_CONF_ADDR, MEM_CITIROC_CONF_LEN, data);
+	citiroc_send_slow_control();
+	conf_id = 255; // temporary SC config.
+	return CMD_OK;
+}
+
+
+static int cmd_prob_conf(uint8_t *data, unsigned long len)
+{
+	mem_write(MEM_CITIROC_PROBE_ADDR, MEM_CITIROC_PROBE_LEN, data);
+	citiroc_send_probes();
+	return CMD_OK;
+}
+
+
+static int cmd_nvm_citi_conf(uint8_t *data, unsigned long len)
+{
+	uint8_t tmp_conf_id = data[MEM_CITIROC_CONF_LEN-1];
+
+	/*
+	 * Write at NVM conf addr offset w/o changing operating
+	 * conf_id and w/o applying to ASIC; for these to happen,
+	 * a separate MSP_OP_SELECT_NVM_CITI_CONF is needed.
+	 */
+	if ((tmp_conf_id >= 1) && (tmp_conf_id <= 254)) {
+		uint32_t nvm_addr = MEM_CITIROC_CONF_ADDR_NVM +
+				((tmp_conf_id - 1) * MEM_CITIROC_CONF_LEN);
+		mem_write_nvm(nvm_addr, MEM_CITIROC_CONF_LEN, data);
+	}
+	return CMD_OK;
+}
+
+
+static int cmd_select_nvm_citi_conf(uint8_t *data, unsigned long len)
+{
+	uint8_t tmp_conf_id = data[0];
+	uint8_t *nvm_conf_addr;
+
+	/* Get conf_id from MSP frame and apply it if valid */
+	if ((tmp_conf_id >= CONF_ID_NVM_MIN) &&
+			(tmp_conf_id <= CONF_ID_NVM_MAX)) {
+		nvm_conf_addr = (uint8_t*)(MEM_CITIROC_CONF_ADDR_NVM +
+				((tmp_conf_id - 1) * MEM_CITIROC_CONF_LEN));
+
+		if (nvm_conf_addr[MEM_CITIROC_CONF_LEN-1] != tmp_conf_id)
+			return CMD_ERR_FAILED;
+
+		mem_write(MEM_CITIROC_CONF_ADDR, MEM_CITIROC_CONF_LEN,
+		          nvm_conf_addr);
+		citiroc_send_slow_control();
+		conf_id = tmp_conf_id;
+		mem_write_nvm(MEM_CITIROC_CONF_ID_ADDR, MEM_CITIROC_CONF_ID_LEN,
+		              &conf_id);
+	} else if (tmp_conf_id == 0) {
+		mem_write(MEM_CITIROC_CONF_ADDR, MEM_CITIROC_CONF_LEN,
+		          CITIROC_DEFCONFIG);
+		citiroc_send_slow_control();
+		conf_id = CITIROC_DEFCONFIG[MEM_CITIROC_CONF_LEN-1];
+		mem_write_nvm(MEM_CITIROC_CONF_ID_ADDR, MEM_CITIROC_CONF_ID_LEN,
+		              &conf_id);
+	} else {
+		return CMD_ERR_FAILED;
+	}
+
+	return CMD_OK;
+}
+
+
+static int cmd_read_reg_debug(uint8_t *data, unsigned long len)
+{
+	citiroc_rrd(data[0] & 0x01, (data[0] & 0x3e)>>1);
+	return CMD_OK;
+}
+
+
+static int cmd_daq_conf(uint8_t *data, unsigned long len)
+{
+	/* Set DAQ duration */
+	daq_dur = data[0];
+	citiroc_daq_set_dur(daq_dur);
+
+	/* Set bin_cfg, with any adjustment if out of range */
+	memcpy(bin_cfg, data+1, 6);
+	for (int i = 0; i < 6; i++) {
+		if ((bin_cfg[i] > 6) && (bin_cfg[i] <= 9))
+			bin_cfg[i] = 6;
+		else if ((bin_cfg[i] == 10))
+			bin_cfg[i] = 11;
+		else if (bin_cfg[i] > 12)
+			bin_cfg[i] = 12;
+	}
+	return CMD_OK;
+}
+
+
+static int cmd_gateware_conf(uint8_t *data, unsigned long len)
+{
+	uint8_t resetvalue = data[0];
+
+	if (resetvalue & 0b00000001)
+		mem_reset_counter_clear();
+	if (resetvalue & 0b00000010)
+		citiroc_hcr_reset();
+	if (resetvalue & 0b00000100)
+		citiroc_histo_reset();
+	if (resetvalue & 0b00001000)
+		citiroc_psc_reset();
+	if (resetvalue & 0b00010000)
+		citiroc_sr_reset();
+	if (resetvalue & 0b00100000)
+		citiroc_pa_reset();
+	if (resetvalue & 0b01000000)
+		citiroc_trigs_reset();
+	if (resetvalue & 0b10000000)
+		citiroc_read_reg_reset();
+	return CMD_OK;
+}
+
+
+static int cmd_calib_pulse_conf(uint8_t *data, unsigned long len)
+{
+	citiroc_calib_set((data[0] << 24) |
+	                  (data[1] << 16) |
+	                  (data[2] << 8) |
+	                  (data[3]));
+	return CMD_OK;
+}
+
+
+static int cmd_hk_conf(uint8_t *data, unsigned long len)
+{
+	uint32_t set;
+	uint16_t period, phase;
+
+	switch (data[0]) {
+	case HK_CONF_FIELDS:
+		if (len != HK_CONF_FIELDS_LEN)
+			return CMD_ERR_LENGTH;
+		set = msp_from_bigendian32(data+1) & HK_FIELDS_ALL;
+		hk_field_set = set ? set : HK_FIELDS_ALL;
+		/* Publish a packet in the new layout right away */
+		hk_packet_update();
+		return CMD_OK;
+	case HK_CONF_HISTORY:
+		if (len != HK_CONF_HISTORY_LEN)
+			return CMD_ERR_LENGTH;
+		return hk_history_configure((data[1] << 8) | data[2], data[3]) ?
+				CMD_ERR_FAILED : CMD_OK;
+	case HK_CONF_HISTORY_SINCE:
+		if (len != HK_CONF_HISTORY_SINCE_LEN)
+			return CMD_ERR_LENGTH;
+		hk_history_set_since(msp_from_bigendian32(data+1));
+		return CMD_OK;
+	case HK_CONF_STATS_WINDOW:
+		if (len != HK_CONF_STATS_WINDOW_LEN)
+			return CMD_ERR_LENGTH;
+		return hk_stats_set_window((data[1] << 8) | data[2]) ?
+				CMD_ERR_FAILED : CMD_OK;
+	case HK_CONF_STATS_LIMITS:
+		if (len != HK_CONF_STATS_LIMITS_LEN)
+			return CMD_ERR_LENGTH;
+		return hk_stats_set_limits(data[1], msp_from_bigendian32(data+2),
+		                           msp_from_bigendian32(data+6)) ?
+				CMD_ERR_FAILED : CMD_OK;
+	case HK_CONF_SCHED:
+		if (len != HK_CONF_SCHED_LEN)
+			return CMD_ERR_LENGTH;
+		period = (data[2] << 8) | data[3];
+		phase = (data[4] << 8) | data[5];
+		if ((data[1] >= HK_SRC_COUNT) || (period && (phase >= period)))
+			return CMD_ERR_FAILED;
+		hk_sched[data[1]].period = period;
+		hk_sched[data[1]].phase = phase;
+		return CMD_OK;
+	case HK_CONF_ADC:
+		if (len != HK_CONF_ADC_LEN)
+			return CMD_ERR_LENGTH;
+		return hk_adc_set_sampling(data[1], data[2], (data[3] << 8) | data[4]) ?
+				CMD_ERR_FAILED : CMD_OK;
+	case HK_CONF_ADC_FILTER:
+		if (len != HK_CONF_ADC_FILTER_LEN)
+			return CMD_ERR_LENGTH;
+		return hk_adc_set_filter(data[1], data[2], data[3]) ?
+				CMD_ERR_FAILED : CMD_OK;
+	default:
+		return CMD_ERR_FAILED;
+	}
+}
+
+
+/*
+ * ---------------
+ * System commands
+ * ---------------
+ */
+static int cmd_active(uint8_t *data, unsigned long len)
+{
+	return hvps_turn_on() ? CMD_ERR_FAILED : CMD_OK;
+}
+
+
+static int cmd_sleep(uint8_t *data, unsigned long len)
+{
+	if (!citiroc_daq_is_rdy()) {
+		citiroc_daq_set_citi_temp(citi_temp);
+		citiroc_daq_set_hvps_temp(hvps_temp);
+		citiroc_daq_set_hvps_volt(hvps_volt);
+		citiroc_daq_set_hvps_curr(hvps_curr);
+		end_daq_hk_ready = 1;
+		citiroc_daq_stop();
+	}
+	hvps_turn_off();
+	return CMD_OK;
+}
+
+
+static int cmd_power_off(uint8_t *data, unsigned long len)
+{
+	if (!citiroc_daq_is_rdy()) {
+		citiroc_daq_set_citi_temp(citi_temp);
+		citiroc_daq_set_hvps_temp(hvps_temp);
+		citiroc_daq_set_hvps_volt(hvps_volt);
+		citiroc_daq_set_hvps_curr(hvps_curr);
+		end_daq_hk_ready = 1;
+		citiroc_daq_stop();
+	}
+	hvps_turn_off();
+	if (mem_save_msp_seqflags() == NVM_SUCCESS) {
+		clean_poweroff = 1;
+		mem_write_nvm(MEM_CLEAN_POWEROFF_ADDR, 1, &clean_poweroff);
+	}
+	return CMD_OK;
+}
+
+
+static int cmd_daq_start(uint8_t *data, unsigned long len)
+{
+	/* Prep. gateware for DAQ */
+	citiroc_hcr_reset();
+	citiroc_histo_reset();
+	citiroc_daq_set_citi_temp(citi_temp);
+	citiroc_daq_set_hvps_temp(hvps_temp);
+	citiroc_daq_set_hvps_volt(hvps_volt);
+	citiroc_daq_set_hvps_curr(hvps_curr);
+
+	/* Start DAQ and prep pre-end-DAQ timer value, which is used
+	 * to prep the end-of-DAQ HK data to be stored to the
+	 * histogram headers
+	 */
+	end_daq_hk_time = daq_dur - 1;
+	citiroc_daq_start();
+	return CMD_OK;
+}
 
-				case MSP_OP_SLEEP:
-					if (!citiroc_daq_is_rdy()) {
-						citiroc_daq_set_citi_temp(citi_temp);
-						citiroc_daq_set_hvps_temp(hvps_temp);
-						citiroc_daq_set_hvps_volt(hvps_volt);
-						citiroc_daq_set_hvps_curr(hvps_curr);
-						end_daq_hk_ready = 1;
-						citiroc_daq_stop();
-					}
-					hvps_turn_off();
-					break;
-
-				case MSP_OP_POWER_OFF:
-					if (!citiroc_daq_is_rdy()) {
-						citiroc_daq_set_citi_temp(citi_temp);
-						citiroc_daq_set_hvps_temp(hvps_temp);
-						citiroc_daq_set_hvps_volt(hvps_volt);
-						citiroc_daq_set_hvps_curr(hvps_curr);
-						end_daq_hk_ready = 1;
-						citiroc_daq_stop();
-					}
-					hvps_turn_off();
-					if (mem_save_msp_seqflags() == NVM_SUCCESS) {
-						clean_poweroff = 1;
-						mem_write_nvm(MEM_CLEAN_POWEROFF_ADDR, 1,
-						              &clean_poweroff);
-					}
-					break;
-
-				case MSP_OP_CUBES_DAQ_START:
-					/* Prep. gateware for DAQ */
-					citiroc_hcr_reset();
-					citiroc_histo_reset();
-					citiroc_daq_set_citi_temp(citi_temp);
-					citiroc_daq_set_hvps_temp(hvps_temp);
-					citiroc_daq_set_hvps_volt(hvps_volt);
-					citiroc_daq_set_hvps_curr(hvps_curr);
-
-					/* Start DAQ and prep pre-end-DAQ timer value, which is used
-					 * to prep the end-of-DAQ HK data to be stored to the
-					 * histogram headers
-					 */
-					end_daq_hk_time = daq_dur - 1;
-					citiroc_daq_start();
-					break;
-
-				case MSP_OP_CUBES_DAQ_STOP:
-					citiroc_daq_set_citi_temp(citi_temp);
-					citiroc_daq_set_hvps_temp(hvps_temp);
-					citiroc_daq_set_hvps_volt(hvps_volt);
-					citiroc_daq_set_hvps_curr(hvps_curr);
-					end_daq_hk_ready = 1;
-					citiroc_daq_stop();
-					break;
-			}
 
-			has_syscommand = 0;
+static int cmd_daq_stop(uint8_t *data, unsigned long len)
+{
+	citiroc_daq_set_citi_temp(citi_temp);
+	citiroc_daq_set_hvps_temp(hvps_temp);
+	citiroc_daq_set_hvps_volt(hvps_volt);
+	citiroc_daq_set_hvps_curr(hvps_curr);
+	end_daq_hk_ready = 1;
+	citiroc_daq_stop();
+	return CMD_OK;
+}
+
+
+/*
+ * -----------------------------------------
+ * Request responses, prepared in the MSP
+ * callbacks when the request header arrives
+ * -----------------------------------------
+ */
+static unsigned long respond_payload(void)
+{
+	unsigned long total, offset, l;
+
+	payload_send_start = 0;
+	payload_send_end = 0;
+	if (!citiroc_daq_is_rdy())
+		return 0;
+
+	total = get_payload_len();
+
+	/* Resolve the read window, if one was set, then consume it */
+	if (payload_win_section == PAYLOAD_WINDOW_INVALID) {
+		offset = total;
+		l = 0;
+	} else if (payload_win_section == 0) {
+		offset = 0;
+		l = MEM_HISTO_HDR_LEN;
+	} else if (payload_win_section != PAYLOAD_WINDOW_NO_SECTION) {
+		offset = MEM_HISTO_HDR_LEN;
+		for (int i = 0; i < payload_win_section - 1; ++i)
+			offset += 2 * get_num_bins(bin_cfg[i]);
+		l = 2 * get_num_bins(bin_cfg[payload_win_section - 1]);
+	} else {
+		offset = payload_win_offset;
+		l = payload_win_len;
+	}
+
+	if (offset > total)
+		offset = total;
+	if (((l == 0) && (payload_win_section != PAYLOAD_WINDOW_INVALID)) ||
+			(l > total - offset))
+		l = total - offset;
+
+	payload_win_section = PAYLOAD_WINDOW_NO_SECTION;
+	payload_win_offset = 0;
+	payload_win_len = 0;
+
+	payload_send_start = offset;
+	payload_send_end = offset + l;
+	send_data = send_data_payload + offset;
+	return l;
+}
+
+
+static unsigned long respond_hk(void)
+{
+	/* Snapshot of the latest packet, in case a new one is published */
+	send_data = send_data_hk;
+	return hk_packet_read(send_data_hk);
+}
+
+
+static unsigned long respond_cubes_id(void)
+{
+	/* CUBES_ID data prepared once on init. */
+	send_data = send_data_cubes_id;
+	return CUBES_ID_LEN;
+}
+
+
+static unsigned long respond_hvps_temp_comp(void)
+{
+	send_data = send_data_hvps_temp_comp;
+	return sizeof(struct hvps_temp_corr_factor);
+}
+
+
+static unsigned long respond_batch_status(void)
+{
+	send_data = send_data_batch_status;
+	return batch_status_len;
+}
+
+
+static unsigned long respond_timed_status(void)
+{
+	send_data = send_data_timed_status;
+	return sizeof(send_data_timed_status);
+}
+
+
+static unsigned long respond_msp_stats(void)
+{
+	/* Serialized here, so that it is a snapshot at the time of the REQ */
+	send_data = send_data_msp_stats;
+	return msp_stats_serialize(send_data_msp_stats);
+}
+
+
+static unsigned long respond_msp_capture(void)
+{
+	/* Read straight from the capture, which is frozen until the end */
+	send_data = NULL;
+	return msp_capture_freeze();
+}
+
+
+static unsigned long respond_hk_stats(void)
+{
+	send_data = send_data_hk_stats;
+	return hk_stats_read(send_data_hk_stats);
+}
+
+
+static unsigned long respond_hk_history(void)
+{
+	/* Same for the HK history */
+	send_data = NULL;
+	return hk_history_freeze();
+}
+
+
+/*
+ * ----------------------------------------
+ * Send commands applied in the MSP callbacks
+ * ----------------------------------------
+ */
+static int apply_msp_mtu(const uint8_t *data, unsigned long len)
+{
+	/*
+	 * The new MTU is applied on reception rather than in the main loop, so
+	 * that it takes effect in between transactions and never in the middle of
+	 * one. An MTU larger than MSP_EXP_MAX_MTU is rejected and the MTU in use
+	 * is kept; zero restores the default.
+	 */
+	if (msp_exp_state_set_mtu((data[0] << 8) | data[1]))
+		return CMD_ERR_FAILED;
 
+	return CMD_OK;
+}
+
+
+static int apply_payload_window(const uint8_t *data, unsigned long len)
+{
+	/* Same for the payload window, which must be set before the next REQ */
+	if ((len == PAYLOAD_WINDOW_SECTION_LEN) &&
+			(data[0] < PAYLOAD_WINDOW_SECTIONS)) {
+		payload_win_section = data[0];
+	} else if (len == PAYLOAD_WINDOW_RANGE_LEN) {
+		payload_win_section = PAYLOAD_WINDOW_NO_SECTION;
+		payload_win_offset = msp_from_bigendian32(data);
+		payload_win_len = msp_from_bigendian32(data+4);
+	} else {
+		payload_win_section = PAYLOAD_WINDOW_INVALID;
+		return (len == PAYLOAD_WINDOW_SECTION_LEN) ? CMD_ERR_FAILED :
+		                                             CMD_ERR_LENGTH;
+	}
+
+	return CMD_OK;
+}
+
+
+/*
+ * -------------
+ * Command table
+ * -------------
+ */
+#define SEND_LEN(min, max)  .min_len = (min), .max_len = (max)
+
+static const struct cmd_desc cmd_table[CMD_TABLE_LEN] = {
+	/* System commands */
+	[MSP_OP_ACTIVE]          = { .run = cmd_active },
+	[MSP_OP_SLEEP]           = { .run = cmd_sleep },
+	[MSP_OP_POWER_OFF]       = { .run = cmd_power_off },
+	[MSP_OP_CUBES_DAQ_START] = { .run = cmd_daq_start },
+	[MSP_OP_CUBES_DAQ_STOP]  = { .run = cmd_daq_stop },
+
+	/* Requests */
+	[MSP_OP_REQ_PAYLOAD] = { .respond = respond_payload },
+	[MSP_OP_REQ_HK] = { .respond = respond_hk },
+	[MSP_OP_REQ_CUBES_ID] = { .respond = respond_cubes_id },
+	[MSP_OP_REQ_CUBES_HVPS_TEMP_COMP] = { .respond = respond_hvps_temp_comp,
+	                                      .run = cmd_req_hvps_temp_comp },
+	[MSP_OP_REQ_CUBES_BATCH_STATUS] = { .respond = respond_batch_status },
+	[MSP_OP_REQ_CUBES_TIMED_STATUS] = { .respond = respond_timed_status },
+	[MSP_OP_REQ_CUBES_MSP_STATS] = { .respond = respond_msp_stats },
+	[MSP_OP_REQ_CUBES_MSP_CAPTURE] = { .respond = respond_msp_capture },
+	[MSP_OP_REQ_CUBES_HK_HISTORY] = { .respond = respond_hk_history },
+	[MSP_OP_REQ_CUBES_HK_STATS] = { .respond = respond_hk_stats },
+
+	/* Send commands; data shorter than max_len is zero-padded */
+	[MSP_OP_SEND_TIME] = { .run = cmd_send_time, SEND_LEN(4, 4) },
+	[MSP_OP_SEND_CUBES_HVPS_CONF] = { .run = cmd_hvps_conf,
+	                                  SEND_LEN(1, 13) },
+	[MSP_OP_SEND_CUBES_CITI_CONF] = { .run = cmd_citi_conf,
+	                                  SEND_LEN(MEM_CITIROC_CONF_LEN,
+	                                           MEM_CITIROC_CONF_LEN) },
+	[MSP_OP_SEND_CUBES_PROB_CONF] = { .run = cmd_prob_conf,
+	                                  SEND_LEN(MEM_CITIROC_PROBE_LEN,
+	                                           MEM_CITIROC_PROBE_LEN) },
+	[MSP_OP_SEND_CUBES_DAQ_CONF] = { .run = cmd_daq_conf, SEND_LEN(7, 7) },
+	[MSP_OP_SEND_CUBES_HVPS_TMP_VOLT] = { .run = cmd_hvps_tmp_volt,
+	                                      SEND_LEN(1, 3) },
+	[MSP_OP_SEND_READ_REG_DEBUG] = { .run = cmd_read_reg_debug,
+	                                 SEND_LEN(1, 1) },
+	[MSP_OP_SEND_CUBES_GATEWARE_CONF] = { .run = cmd_gateware_conf,
+	                                      SEND_LEN(1, 1) },
+	[MSP_OP_SEND_CUBES_CALIB_PULSE_CONF] = { .run = cmd_calib_pulse_conf,
+	                                         SEND_LEN(4, 4) },
+	[MSP_OP_SEND_CUBES_HK_CONF] = { .run = cmd_hk_conf,
+	                                SEND_LEN(1, HK_CONF_MAXLEN) },
+	[MSP_OP_SEND_NVM_CITI_CONF] = { .run = cmd_nvm_citi_conf,
+	                                SEND_LEN(MEM_CITIROC_CONF_LEN,
+	                                         MEM_CITIROC_CONF_LEN) },
+	[MSP_OP_SELECT_NVM_CITI_CONF] = { .run = cmd_select_nvm_citi_conf,
+	                                  SEND_LEN(1, 1) },
+	[MSP_OP_SEND_CUBES_MSP_MTU] = { .apply = apply_msp_mtu,
+	                                SEND_LEN(MSP_MTU_CONF_LEN,
+	                                         MSP_MTU_CONF_LEN) },
+	[MSP_OP_SEND_CUBES_PAYLOAD_WINDOW] = { .apply = apply_payload_window,
+	                                       SEND_LEN(PAYLOAD_WINDOW_SECTION_LEN,
+	                                                PAYLOAD_WINDOW_RANGE_LEN) },
+	[MSP_OP_SEND_CUBES_BATCH] = { .run = run_batch, .flags = CMD_NO_DEFER,
+	                              SEND_LEN(0, BATCH_MAXLEN) },
+	[MSP_OP_SEND_CUBES_TIMED_CMD] = { .run = timed_cmd_add,
+	                                  .flags = CMD_NO_DEFER,
+	                                  SEND_LEN(0, TIMED_CMD_HDR_LEN +
+	                                              TIMED_CMD_MAXLEN) },
+};
+
+
+static const struct cmd_desc *cmd_lookup(unsigned char opcode)
+{
+	return &cmd_table[opcode % CMD_TABLE_LEN];
+}
+
+
+static int cmd_check(unsigned char opcode, unsigned long len)
+{
+	const struct cmd_desc *d = cmd_lookup(opcode);
+
+	if (!d->run && !d->respond && !d->apply)
+		return CMD_ERR_OPCODE;
+	if ((len < d->min_len) || (len > d->max_len))
+		return CMD_ERR_LENGTH;
+
+	return CMD_OK;
+}
+
+
+static int cmd_run(unsigned char opcode, uint8_t *data, unsigned long len)
+{
+	const struct cmd_desc *d = cmd_lookup(opcode);
+	uint32_t t;
+	int ret;
+
+	ret = cmd_check(opcode, len);
+	if ((ret != CMD_OK) || (d->run == NULL))
+		return ret;
+
+	t = msp_stats_time();
+	ret = d->run(data, len);
+	msp_stats_handler(opcode, msp_stats_time() - t);
+
+	return ret;
+}
+
+
+static int cmd_can_be_deferred(unsigned char opcode)
+{
+	const struct cmd_desc *d = cmd_lookup(opcode);
+
+	/*
+	 * Only SEND and system commands acted upon in the main loop; commands that
+	 * themselves carry commands can not be nested.
+	 */
+	if ((MSP_OP_TYPE(opcode) != MSP_OP_TYPE_SYS) &&
+			(MSP_OP_TYPE(opcode) != MSP_OP_TYPE_SEND))
+		return 0;
+
+	return (d->run != NULL) && !(d->flags & CMD_NO_DEFER);
+}
+
+
+static int run_deferred_cmd(unsigned char opcode, const uint8_t *data,
+                            unsigned long len)
+{
+	/* Command data, zero-padded as queued data is for single commands */
+	static uint8_t cmd_data[DEFERRED_CMD_MAXLEN];
+
+	memset(cmd_data, '\0', sizeof(cmd_data));
+	memcpy(cmd_data, data, len);
+
+	return cmd_run(opcode, cmd_data, len);
+}
+
+
+static int run_batch(uint8_t *data, unsigned long len)
+{
+	unsigned char *status = send_data_batch_status;
+	unsigned long i, l;
+	unsigned char op;
+	int n, k;
+	int ret = CMD_OK;
+
+	/* Check the whole list before running anything */
+	n = 0;
+	if (len > BATCH_MAXLEN)
+		ret = CMD_ERR_LENGTH;
+	for (i = 0; (ret == CMD_OK) && (i < len); i += 2 + l) {
+		if ((i + 2 > len) || (n == BATCH_MAX_CMDS)) {
+			ret = CMD_ERR_LENGTH;
+			break;
 		}
+
+		op = data[i];
+		l = data[i+1];
+		if ((i + 2 + l > len) || (l > DEFERRED_CMD_MAXLEN))
+			ret = CMD_ERR_LENGTH;
+		if (!cmd_can_be_deferred(op))
+			ret = CMD_ERR_OPCODE;
+		else if (cmd_check(op, l) != CMD_OK)
+			ret = CMD_ERR_LENGTH;
+
+		status[BATCH_STATUS_HDR_LEN + 2*n] = op;
+		status[BATCH_STATUS_HDR_LEN + 2*n + 1] = CMD_NOT_RUN;
+		n++;
 	}
 
-	// This point should not be reached
-	return -1;
+	if (ret != CMD_OK) {
+		status[0] = BATCH_STATE_REJECTED;
+		status[1] = 0;
+		batch_status_len = BATCH_STATUS_HDR_LEN;
+		return ret;
+	}
+
+	/* All good, run the sub-commands in order */
+	for (i = 0, k = 0; (ret == CMD_OK) && (k < n); i += 2 + l, k++) {
+		op = data[i];
+		l = data[i+1];
+
+		ret = run_deferred_cmd(op, data+i+2, l);
+		status[BATCH_STATUS_HDR_LEN + 2*k + 1] = ret;
+	}
+
+	status[0] = BATCH_STATE_DONE;
+	status[1] = n;
+	batch_status_len = BATCH_STATUS_HDR_LEN + 2*n;
+
+	return ret;
+}
+
+
+static int timed_cmd_add(uint8_t *data, unsigned long len)
+{
+	unsigned long l;
+	int i, j;
+
+	/* No data: clear the queue */
+	if (len == 0) {
+		for (i = 0; i < TIMED_CMD_MAX; i++)
+			timed_cmds[i].state = TIMED_STATE_FREE;
+		timed_cmd_update_status();
+		return CMD_OK;
+	}
+
+	if (len < TIMED_CMD_HDR_LEN)
+		return CMD_ERR_LENGTH;
+
+	l = len - TIMED_CMD_HDR_LEN;
+	if (l > TIMED_CMD_MAXLEN)
+		return CMD_ERR_LENGTH;
+	if (!cmd_can_be_deferred(data[4]))
+		return CMD_ERR_OPCODE;
+	if (cmd_check(data[4], l) != CMD_OK)
+		return CMD_ERR_LENGTH;
+
+	/* A free slot, or else one holding a result */
+	for (i = 0; i < TIMED_CMD_MAX; i++)
+		if (timed_cmds[i].state == TIMED_STATE_FREE)
+			break;
+	for (j = 0; (i == TIMED_CMD_MAX) && (j < TIMED_CMD_MAX); j++)
+		if (timed_cmds[j].state == TIMED_STATE_DONE)
+			i = j;
+
+	/* Queue full */
+	if (i == TIMED_CMD_MAX)
+		return CMD_ERR_FAILED;
+
+	timed_cmds[i].time = msp_from_bigendian32(data);
+	timed_cmds[i].opcode = data[4];
+	timed_cmds[i].len = l;
+	memcpy(timed_cmds[i].data, data + TIMED_CMD_HDR_LEN, l);
+	timed_cmds[i].result = CMD_NOT_RUN;
+	timed_cmds[i].state = TIMED_STATE_PENDING;
+	timed_cmd_update_status();
+
+	return CMD_OK;
+}
+
+
+static void timed_cmd_run_due(uint32_t now)
+{
+	int i, next;
+
+	/* Run due commands one at a time, earliest first */
+	do {
+		next = -1;
+		for (i = 0; i < TIMED_CMD_MAX; i++) {
+			if ((timed_cmds[i].state == TIMED_STATE_PENDING) &&
+					(timed_cmds[i].time <= now) &&
+					((next < 0) ||
+					 (timed_cmds[i].time < timed_cmds[next].time)))
+				next = i;
+		}
+
+		if (next >= 0) {
+			timed_cmds[next].state = TIMED_STATE_DONE;
+			timed_cmds[next].result =
+				run_deferred_cmd(timed_cmds[next].opcode,
+				                 timed_cmds[next].data, timed_cmds[next].len);
+			timed_cmd_update_status();
+		}
+	} while (next >= 0);
+}
+
+
+static void timed_cmd_update_status(void)
+{
+	unsigned char *status = send_data_timed_status;
+
+	for (int i = 0; i < TIMED_CMD_MAX; i++) {
+		status[0] = timed_cmds[i].state;
+		status[1] = timed_cmds[i].opcode;
+		msp_to_bigendian32(status + 2, timed_cmds[i].time);
+		status[6] = timed_cmds[i].result;
+		status += TIMED_STATUS_ENTRY_LEN;
+	}
 }
 
 
@@ -846,6 +1992,48 @@ static uint16_t get_num_bins(uint8_t bin_config)
 }
 
 
+static unsigned long get_payload_len(void)
+{
+	unsigned long l = MEM_HISTO_HDR_LEN;
+
+	for (int i = 0; i < 6; ++i)
+		l += 2 * get_num_bins(bin_cfg[i]);
+
+	return l;
+}
+
+
+static int payload_mark_sent(unsigned long start, unsigned long end)
+{
+	int i = 0;
+
+	if (start < end) {
+		/* Merge the new range with the ones it overlaps or adjoins */
+		while (i < payload_sent_n) {
+			if ((payload_sent[i].start <= end) &&
+					(payload_sent[i].end >= start)) {
+				if (payload_sent[i].start < start)
+					start = payload_sent[i].start;
+				if (payload_sent[i].end > end)
+					end = payload_sent[i].end;
+				payload_sent[i] = payload_sent[--payload_sent_n];
+			} else {
+				i++;
+			}
+		}
+
+		if (payload_sent_n < PAYLOAD_SENT_RANGES) {
+			payload_sent[payload_sent_n].start = start;
+			payload_sent[payload_sent_n].end = end;
+			payload_sent_n++;
+		}
+	}
+
+	return (payload_sent_n == 1) && (payload_sent[0].start == 0) &&
+	       (payload_sent[0].end >= get_payload_len());
+}
+
+
 static inline void prep_payload_data()
 {
 	unsigned long i, j, k;
@@ -859,6 +2047,9 @@ static inline void prep_payload_data()
 
 	uint32_t *histo_data = (uint32_t *)HISTO_RAM;
 
+	/* None of the new payload has been sent yet */
+	payload_sent_n = 0;
+
 	send_idx = 0;
 
 	/* histogram header into send_data_payload */
@@ -1024,9 +2215,19 @@ static mss_i2c_slave_handler_ret_t I2C1_SlaveWriteHandler(
 		uint8_t * p_rx_data,
         uint16_t rx_size)
 {
-	msp_recv_callback(p_rx_data, rx_size);
-	msp_send_callback((unsigned char *)i2c_tx_buffer,
-	                  (unsigned long *)&slave_buffer_size);
+	uint32_t t = msp_stats_time();
+	uint32_t isr_time;
+	int rx_ret, tx_ret;
+
+	rx_ret = msp_recv_callback(p_rx_data, rx_size);
+	tx_ret = msp_send_callback((unsigned char *)i2c_tx_buffer,
+	                           (unsigned long *)&slave_buffer_size);
+
+	isr_time = msp_stats_time() - t;
+	msp_stats_frame(rx_size, rx_ret, slave_buffer_size, tx_ret, isr_time);
+	msp_capture_frame(t, isr_time, p_rx_data, rx_size, rx_ret,
+	                  i2c_tx_buffer, slave_buffer_size, tx_ret);
+
 	return MSS_I2C_REENABLE_SLAVE_RX;
 }
 
@@ -1038,26 +2239,15 @@ static mss_i2c_slave_handler_ret_t I2C1_SlaveWriteHandler(
  */
 void msp_expsend_start(unsigned char opcode, unsigned long *len)
 {
-	unsigned long l = 0;
-	if (opcode == MSP_OP_REQ_PAYLOAD && citiroc_daq_is_rdy()) {
-		l = MEM_HISTO_HDR_LEN;
-		for (int i = 0; i < 6; ++i)
-			l += 2 * get_num_bins(bin_cfg[i]);
-		send_data = send_data_payload;
-	} else if (opcode == MSP_OP_REQ_HK) {
-		l = HK_LEN;
-		send_data = send_data_hk;
-	} else if (opcode == MSP_OP_REQ_CUBES_ID) {
-		l = CUBES_ID_LEN;
-		send_data = send_data_cubes_id;
-	} else if (opcode == MSP_OP_REQ_CUBES_HVPS_TEMP_COMP) {
-		l = sizeof(struct hvps_temp_corr_factor);
-		send_data = send_data_hvps_temp_comp;
-	} else {
-		l = 0;
-	}
-	*len = l;
-	has_send = opcode;
+	const struct cmd_desc *d = cmd_lookup(opcode);
+
+	msp_stats_trans_start(opcode);
+
+	*len = d->respond ? d->respond() : 0;
+
+	/* Let the main loop act upon the request, e.g., refresh the HK data */
+	if (d->run)
+		cmd_queue_push(opcode, 0, 0, msp_stats_time());
 }
 
 
@@ -1066,6 +2256,15 @@ void msp_expsend_data(unsigned char opcode,
                       unsigned long len,
                       unsigned long offset)
 {
+	if (opcode == MSP_OP_REQ_CUBES_MSP_CAPTURE) {
+		msp_capture_read(buf, offset, len);
+		return;
+	}
+	if (opcode == MSP_OP_REQ_CUBES_HK_HISTORY) {
+		hk_history_read(buf, offset, len);
+		return;
+	}
+
 	for(unsigned long i = 0; i<len; i++) {
 		buf[i] = send_data[offset+i];
 	}
@@ -1074,15 +2273,32 @@ void msp_expsend_data(unsigned char opcode,
 
 void msp_expsend_complete(unsigned char opcode)
 {
-	if(opcode == MSP_OP_REQ_PAYLOAD)
+	msp_stats_trans_end(opcode, 0);
+
+	if (opcode == MSP_OP_REQ_CUBES_MSP_CAPTURE)
+		msp_capture_release(1);
+	if (opcode == MSP_OP_REQ_CUBES_HK_HISTORY)
+		hk_history_release(1);
+
+	/*
+	 * Only clear the payload once all of it has been sent, so that the rest
+	 * of it can still be read via payload windows.
+	 */
+	if ((opcode == MSP_OP_REQ_PAYLOAD) &&
+			payload_mark_sent(payload_send_start, payload_send_end))
 		memset(send_data_payload, '\0', sizeof(send_data_payload));
 }
 
 
 void msp_expsend_error(unsigned char opcode, int error)
 {
-	has_send_error = opcode;
-	has_send_errorcode = error;
+	msp_stats_trans_end(opcode, error);
+
+	/* Keep the records, so that the OBC can try again */
+	if (opcode == MSP_OP_REQ_CUBES_MSP_CAPTURE)
+		msp_capture_release(0);
+	if (opcode == MSP_OP_REQ_CUBES_HK_HISTORY)
+		hk_history_release(0);
 }
 
 
@@ -1093,7 +2309,26 @@ void msp_expsend_error(unsigned char opcode, int error)
  */
 void msp_exprecv_start(unsigned char opcode, unsigned long len)
 {
-	memset(recv_data, '\0', sizeof(recv_data));
+	msp_stats_trans_start(opcode);
+
+	recv_len = len;
+
+	recv_data = cmd_queue_tail_data();
+	if (recv_data == NULL)
+		recv_data = recv_overflow;
+
+	recv_to_sink = !recv_shadow_busy &&
+		(((opcode == MSP_OP_SEND_CUBES_CITI_CONF) &&
+		  (len == MEM_CITIROC_CONF_LEN)) ||
+		 ((opcode == MSP_OP_SEND_CUBES_PROB_CONF) &&
+		  (len == MEM_CITIROC_PROBE_LEN)));
+	if (recv_to_sink) {
+		recv_shadow_busy = 1;
+		recv_shadow_len = 0;
+	}
+
+	if (!recv_to_sink)
+		memset(recv_data, '\0', RECV_MAXLEN);
 }
 
 
@@ -1102,6 +2337,13 @@ void msp_exprecv_data(unsigned char opcode,
                       unsigned long len,
                       unsigned long offset)
 {
+	if (recv_to_sink) {
+		for (unsigned long i = 0; (i < len) && (i + offset < recv_len); i++)
+			((uint8_t *)recv_shadow)[i+offset] = buf[i];
+		recv_shadow_len += len;
+		return;
+	}
+
 	for (unsigned long i=0; i<len; i++) {
 		if((i+offset) < RECV_MAXLEN)
 			recv_data[i+offset] = buf[i];
@@ -1113,14 +2355,56 @@ void msp_exprecv_data(unsigned char opcode,
 
 void msp_exprecv_complete(unsigned char opcode)
 {
-	has_recv = opcode;
+	const struct cmd_desc *d = cmd_lookup(opcode);
+	int queued = 0;
+	int ret = CMD_OK;
+
+	/* Let the length check in the main loop catch a short receive sink */
+	if (recv_to_sink && (recv_shadow_len < recv_len))
+		recv_len = recv_shadow_len;
+
+	if (d->apply) {
+		ret = cmd_check(opcode, recv_len);
+		if (ret == CMD_OK)
+			ret = d->apply(recv_data, recv_len);
+	}
+
+	/*
+	 * Only push the entry the data was received into: if the queue was full
+	 * at the start, the tail entry freed up since then still holds the data
+	 * of an older command.
+	 */
+	if (d->run) {
+		if (recv_data != recv_overflow)
+			queued = !cmd_queue_push(opcode, recv_len,
+			                         recv_to_sink ? CMD_QUEUE_STREAMED : 0,
+			                         msp_stats_time());
+		else
+			cmd_queue_drop();
+	}
+
+	/* The shadow is only held for a command the main loop will run */
+	if (recv_to_sink && !queued)
+		recv_shadow_busy = 0;
+
+	/* Let the OBC know a batch is waiting to be run by the main loop */
+	if (opcode == MSP_OP_SEND_CUBES_BATCH) {
+		send_data_batch_status[0] = queued ? BATCH_STATE_PENDING :
+		                                     BATCH_STATE_REJECTED;
+		send_data_batch_status[1] = 0;
+		batch_status_len = BATCH_STATUS_HDR_LEN;
+	}
+
+	msp_stats_trans_end(opcode, (ret == CMD_OK) ? 0 : MSP_STATS_REJECTED);
 }
 
 
 void msp_exprecv_error(unsigned char opcode, int error)
 {
-	has_recv_error = opcode;
-	has_recv_errorcode = error;
+	msp_stats_trans_end(opcode, error);
+
+	if (recv_to_sink)
+		recv_shadow_busy = 0;
 }
 
 
@@ -1136,7 +2420,9 @@ void msp_exprecv_error(unsigned char opcode, int error)
  */
 void msp_exprecv_syscommand(unsigned char opcode)
 {
-	has_syscommand = opcode;
+	msp_stats_trans_end(opcode, 0);
+	if (cmd_lookup(opcode)->run)
+		cmd_queue_push(opcode, 0, 0, msp_stats_time());
 }
 
 
@@ -9,4 +9,11 @@
 
 #define MSP_EXP_MTU 507
 
+/*
+ * Upper bound for an MTU negotiated at runtime by the OBC, via the
+ * MSP_OP_SEND_CUBES_MSP_MTU custom opcode. The I2C frame buffers are sized
+ * after this value, not after MSP_EXP_MTU.
+ */
+#define MSP_EXP_MAX_MTU 2043
+
 #endif
@@ -81,8 +81,8 @@ int msp_recv_callback(const unsigned char *data, unsigned long len)
  *
  * Arguments
  *  data: Pointer to a buffer where the data to be sent will be stored. The
- *        buffer must be at least MSP_MTU+5 in size. (Make sure to set MSP_MTU
- *        in msp_exp_definitions.h)
+ *        buffer must be at least MSP_EXP_MAX_FRAME_SIZE in size. (Make sure to
+ *        set MSP_EXP_MTU and MSP_EXP_MAX_MTU in msp_configuration.h)
  *  len: A pointer to a 32-bit unsigned int that represents the number of bytes
  *       to be sent.
  */
@@ -139,7 +139,7 @@ static int handle_incoming_frame(const unsigned char *frame, unsigned long len)
 
 	if (opcode == MSP_OP_DATA_FRAME) {
 		/* Check that the data frame has a correct length */
-		if (len < 6 || len > MSP_EXP_MAX_FRAME_SIZE)
+		if (len < 6 || len > msp_exp_state.mtu + 5)
 			return MSP_EXP_ERR_INVALID_DATA_FRAME;
 		else
 			return handle_incoming_data_frame(frame + 1, frame_id, len - 5);
@@ -483,9 +483,9 @@ static int handle_outgoing_data_frame(unsigned char *buf, unsigned long *len)
 	}
 
 	/* Calculate how many bytes that are to be sent. */
-	send_len = MSP_EXP_MTU;
+	send_len = msp_exp_state.mtu;
 	remaining_len = msp_exp_state.total_length - msp_exp_state.processed_length;
-	if (remaining_len < MSP_EXP_MTU) {
+	if (remaining_len < msp_exp_state.mtu) {
 		send_len = remaining_len;
 	}
 
@@ -13,7 +13,8 @@
 #ifndef MSP_EXP_DEFINITIONS_H
 #define MSP_EXP_DEFINITIONS_H
 
-/* Import MSP_EXP_ADDR and MSP_EXP_MTU from the configuration file */
+/* Import MSP_EXP_ADDR, MSP_EXP_MTU and MSP_EXP_MAX_MTU from the configuration
+ * file */
 #include "msp_configuration.h"
 
 #ifndef MSP_EXP_ADDR
@@ -22,15 +23,28 @@
 
 #ifndef MSP_EXP_MTU
 #error MSP_EXP_MTU not set
-#else
+#endif
+
+/*
+ * If no runtime MTU negotiation is configured, the MTU used at startup is also
+ * the largest one.
+ */
+#ifndef MSP_EXP_MAX_MTU
+#define MSP_EXP_MAX_MTU MSP_EXP_MTU
+#endif
+
+#if (MSP_EXP_MAX_MTU) < (MSP_EXP_MTU)
+#error MSP_EXP_MAX_MTU must not be smaller than MSP_EXP_MTU
+#endif
+
 /**
  * @brief The maximum size an MSP frame can have.
  *
  * This definition should be used to determine minimum size of the buffers used
- * to send or receive MSP frames.
+ * to send or receive MSP frames. It is based on MSP_EXP_MAX_MTU, so that the
+ * buffers can hold frames of any MTU that can be set at runtime.
  */
-#define MSP_EXP_MAX_FRAME_SIZE (((MSP_EXP_MTU) + 5) > 9 ? ((MSP_EXP_MTU) + 5) : 9)
-#endif
+#define MSP_EXP_MAX_FRAME_SIZE (((MSP_EXP_MAX_MTU) + 5) > 9 ? ((MSP_EXP_MAX_MTU) + 5) : 9)
 
 
 #endif /* MSP_EXP_DEFINITIONS_H */
@@ -11,6 +11,7 @@
 
 #include "msp_seqflags.h"
 
+#include "msp_exp_definitions.h"
 #include "msp_exp_state.h"
 
 /* The MSP state */
@@ -34,6 +35,7 @@ void msp_exp_state_initialize(msp_seqflags_t seqflags)
 	msp_exp_state.type = MSP_EXP_STATE_READY;
 
 	msp_exp_state.seqflags = seqflags;
+	msp_exp_state.mtu = MSP_EXP_MTU;
 
 	msp_exp_state.busy = 0;
 	msp_exp_state.initialized = 1;
@@ -54,3 +56,36 @@ msp_seqflags_t msp_exp_state_get_seqflags(void)
 {
 	return msp_exp_state.seqflags;
 }
+
+/**
+ * @brief Sets the MTU used for subsequent transactions.
+ * @param mtu The new MTU. A value of 0 restores the default MSP_EXP_MTU.
+ * @return 0 if the MTU was applied, -1 if it is larger than MSP_EXP_MAX_MTU
+ *         (in which case the current MTU is kept).
+ *
+ * The MTU bounds both the size of the data frames sent to the OBC and the
+ * size of the data frames accepted from it. Both sides must use the same
+ * value, so this function should only be called in between transactions,
+ * e.g., from msp_exprecv_complete() when the OBC has requested a new MTU.
+ */
+int msp_exp_state_set_mtu(unsigned long mtu)
+{
+	if (mtu > MSP_EXP_MAX_MTU)
+		return -1;
+
+	if (mtu == 0)
+		mtu = MSP_EXP_MTU;
+
+	msp_exp_state.mtu = mtu;
+
+	return 0;
+}
+
+/**
+ * @brief Returns the MTU currently in use.
+ * @return The maximum number of bytes in the data field of a data frame.
+ */
+unsigned long msp_exp_state_get_mtu(void)
+{
+	return msp_exp_state.mtu;
+}
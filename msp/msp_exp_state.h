@@ -100,6 +100,15 @@ struct msp_exp_state_information {
 	 *        in an OBC Request transaction.
 	 */
 	unsigned long prev_data_length;
+
+	/**
+	 * @brief The MTU currently in use, i.e., the maximum number of bytes in
+	 *        the data field of a data frame.
+	 *
+	 * Set to MSP_EXP_MTU on initialization; can be changed in between
+	 * transactions using msp_exp_state_set_mtu(), up to MSP_EXP_MAX_MTU.
+	 */
+	unsigned long mtu;
 };
 
 
@@ -110,5 +119,7 @@ extern volatile struct msp_exp_state_information msp_exp_state;
 
 void msp_exp_state_initialize(msp_seqflags_t seqflags);
 msp_seqflags_t msp_exp_state_get_seqflags(void);
+int msp_exp_state_set_mtu(unsigned long mtu);
+unsigned long msp_exp_state_get_mtu(void);
 
 #endif /* MSP_EXP_STATE_H */
@@ -40,6 +40,12 @@
 
 #define MSP_OP_REQ_CUBES_ID                     0x61
 #define MSP_OP_REQ_CUBES_HVPS_TEMP_COMP         0x62
+#define MSP_OP_REQ_CUBES_BATCH_STATUS           0x63
+#define MSP_OP_REQ_CUBES_MSP_STATS              0x64
+#define MSP_OP_REQ_CUBES_MSP_CAPTURE            0x65
+#define MSP_OP_REQ_CUBES_HK_HISTORY             0x66
+#define MSP_OP_REQ_CUBES_HK_STATS               0x67
+#define MSP_OP_REQ_CUBES_TIMED_STATUS           0x68
 
 #define MSP_OP_SEND_CUBES_HVPS_CONF             0x71
 #define MSP_OP_SEND_CUBES_CITI_CONF             0x72
@@ -51,6 +57,11 @@
 #define MSP_OP_SEND_CUBES_CALIB_PULSE_CONF      0x78
 #define MSP_OP_SEND_NVM_CITI_CONF               0x79
 #define MSP_OP_SELECT_NVM_CITI_CONF             0x7A
+#define MSP_OP_SEND_CUBES_MSP_MTU               0x7B
+#define MSP_OP_SEND_CUBES_PAYLOAD_WINDOW        0x7C
+#define MSP_OP_SEND_CUBES_BATCH                 0x7D
+#define MSP_OP_SEND_CUBES_TIMED_CMD             0x7E
+#define MSP_OP_SEND_CUBES_HK_CONF               0x7F
 
 /* Values for determining opcode type */
 #define MSP_OP_TYPE_CTRL 0x00
@@ -0,0 +1,109 @@
+/*
+ * Host stand-in for the CMSIS Cortex-M3 core header, used by the CUBES
+ * host simulator (see sim/README.md)
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Only what the CUBES firmware uses is provided. Core peripherals are plain
+ * host structures, the NVIC is a no-op and masking interrupts takes the
+ * simulator's interrupt lock, see sim_hw.c.
+ */
+
+#ifndef SIM_CORE_CM3_H_
+#define SIM_CORE_CM3_H_
+
+#include <stdint.h>
+
+#define __I     volatile const
+#define __O     volatile
+#define __IO    volatile
+
+#define __ASM            __asm__
+
+/*
+ * The Libero drivers use `__ASM volatile ("dsb")` after clearing interrupts;
+ * make it an empty instruction for the host assembler.
+ */
+__asm__(".macro dsb\n.endm");
+
+#define __INLINE         inline
+#define __STATIC_INLINE  static inline
+
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__I  uint32_t CALIB;
+} SysTick_Type;
+
+#define SysTick_CTRL_ENABLE_Msk     (1ul << 0)
+#define SysTick_CTRL_TICKINT_Msk    (1ul << 1)
+#define SysTick_CTRL_CLKSOURCE_Msk  (1ul << 2)
+
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t CYCCNT;
+} DWT_Type;
+
+#define DWT_CTRL_CYCCNTENA_Msk      (1ul << 0)
+
+typedef struct {
+	__IO uint32_t DHCSR;
+	__IO uint32_t DCRSR;
+	__IO uint32_t DCRDR;
+	__IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+#define CoreDebug_DEMCR_TRCENA_Msk  (1ul << 24)
+
+extern SysTick_Type sim_systick;
+extern CoreDebug_Type sim_coredebug;
+DWT_Type *sim_dwt(void);
+
+#define SysTick    (&sim_systick)
+#define CoreDebug  (&sim_coredebug)
+/* The cycle counter follows host time, at SystemCoreClock */
+#define DWT        (sim_dwt())
+
+void sim_irq_lock(void);
+void sim_irq_unlock(void);
+
+static inline void __disable_irq(void) { sim_irq_lock(); }
+static inline void __enable_irq(void)  { sim_irq_unlock(); }
+static inline void __DMB(void) { __sync_synchronize(); }
+static inline void __DSB(void) { __sync_synchronize(); }
+static inline void __ISB(void) { __sync_synchronize(); }
+static inline void __NOP(void) { }
+static inline void __WFI(void) { }
+static inline uint32_t __CLZ(uint32_t x) { return x ? __builtin_clz(x) : 32; }
+
+static inline void NVIC_EnableIRQ(IRQn_Type irqn) { (void)irqn; }
+static inline void NVIC_DisableIRQ(IRQn_Type irqn) { (void)irqn; }
+static inline void NVIC_ClearPendingIRQ(IRQn_Type irqn) { (void)irqn; }
+static inline void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority)
+{
+	(void)irqn;
+	(void)priority;
+}
+
+#endif /* SIM_CORE_CM3_H_ */
@@ -0,0 +1,460 @@
+/*
+ * CUBES host simulator: replay of an MSP traffic capture
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays a capture downloaded via MSP_OP_REQ_CUBES_MSP_CAPTURE (see
+ * utils/msp_capture.h) against the host build of the MSP library, and
+ * reports:
+ *  - the latency distributions seen on target, from the capture time stamps;
+ *  - the time the MSP callbacks take on the host, for the same frames;
+ *  - every record where the host MSP state machine answers differently than
+ *    the target did (state divergence).
+ *
+ * Only the MSP library is replayed, not the rest of the firmware: the data
+ * CUBES sends is zeros of the length announced on target, and data received
+ * is dropped, except for the MTU setting which changes the protocol itself.
+ *
+ * The capture does not hold the MSP state at its start, so:
+ *  - records before the first valid header frame are skipped;
+ *  - the sequence flag of each opcode is set on its first transaction, so that
+ *    it is a new transaction or a duplicate like on target;
+ *  - the MTU at the start must be given with -m if it was not the default.
+ *
+ * Frames longer than the captured part are rebuilt with zero data and a valid
+ * FCS, or a broken one if the target reported an FCS mismatch.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msp_exp.h"
+#include "msp_exp_frame.h"
+#include "msp_exp_state.h"
+
+#include "../utils/msp_capture.h"
+
+#define REPLAY_MAX_SHOWN  (10)
+
+struct record {
+	uint32_t time;
+	unsigned long rx_len;
+	unsigned long tx_len;
+	uint32_t isr_time;
+	int rx_ret;
+	int tx_ret;
+	const uint8_t *rx;
+	const uint8_t *tx;
+};
+
+static unsigned long send_len;
+static uint8_t mtu_conf[2];
+
+
+/*
+ *==============================================================================
+ * MSP callbacks
+ *==============================================================================
+ */
+void msp_expsend_start(unsigned char opcode, unsigned long *len)
+{
+	*len = send_len;
+}
+
+
+void msp_expsend_data(unsigned char opcode, unsigned char *buf,
+                      unsigned long len, unsigned long offset)
+{
+	memset(buf, 0, len);
+}
+
+
+void msp_expsend_complete(unsigned char opcode)
+{
+}
+
+
+void msp_expsend_error(unsigned char opcode, int error)
+{
+}
+
+
+void msp_exprecv_start(unsigned char opcode, unsigned long len)
+{
+}
+
+
+void msp_exprecv_data(unsigned char opcode, const unsigned char *buf,
+                      unsigned long len, unsigned long offset)
+{
+	if (opcode != MSP_OP_SEND_CUBES_MSP_MTU)
+		return;
+	for (unsigned long i = 0; i < len; i++)
+		if (offset + i < sizeof(mtu_conf))
+			mtu_conf[offset + i] = buf[i];
+}
+
+
+void msp_exprecv_complete(unsigned char opcode)
+{
+	/* As in main.c */
+	if (opcode == MSP_OP_SEND_CUBES_MSP_MTU)
+		msp_exp_state_set_mtu((mtu_conf[0] << 8) | mtu_conf[1]);
+}
+
+
+void msp_exprecv_error(unsigned char opcode, int error)
+{
+}
+
+
+void msp_exprecv_syscommand(unsigned char opcode)
+{
+}
+
+
+/*
+ *==============================================================================
+ * Capture
+ *==============================================================================
+ */
+static void parse_record(const uint8_t *buf, struct record *r)
+{
+	r->time = msp_from_bigendian32(buf);
+	r->rx_len = (buf[4] << 8) | buf[5];
+	r->tx_len = (buf[6] << 8) | buf[7];
+	r->isr_time = (buf[8] << 8) | buf[9];
+	r->rx_ret = (int8_t)buf[10];
+	r->tx_ret = (int8_t)buf[11];
+	r->rx = buf + 12;
+	r->tx = buf + 12 + MSP_CAPTURE_FRAME_LEN;
+}
+
+
+static uint8_t frame_opcode(const uint8_t *frame)
+{
+	return frame[0] & 0x7f;
+}
+
+
+static uint8_t frame_id(const uint8_t *frame)
+{
+	return frame[0] >> 7;
+}
+
+
+/* Header frame of a transaction, as opposed to a control or data frame */
+static int is_trans_header(const struct record *r)
+{
+	return (r->rx_ret == 0) && (r->rx_len >= 9) &&
+	       (MSP_OP_TYPE(frame_opcode(r->rx)) != MSP_OP_TYPE_CTRL);
+}
+
+
+/* Rebuild the frame the target received, see the top of this file */
+static unsigned long rebuild_rx(const struct record *r, uint8_t *frame)
+{
+	unsigned long len = r->rx_len;
+
+	if (len <= MSP_CAPTURE_FRAME_LEN) {
+		memcpy(frame, r->rx, len);
+		return len;
+	}
+
+	memcpy(frame, r->rx, MSP_CAPTURE_FRAME_LEN);
+	memset(frame + MSP_CAPTURE_FRAME_LEN, 0, len - MSP_CAPTURE_FRAME_LEN);
+	msp_to_bigendian32(frame + len - 4,
+	                   msp_exp_frame_generate_fcs(frame, 1, len - 4));
+	if (r->rx_ret == MSP_EXP_ERR_FCS_MISMATCH)
+		frame[len - 1] ^= 0xff;
+
+	return len;
+}
+
+
+/*
+ * Set the sequence flag of an opcode the first time it is seen, so that the
+ * transaction is new or a duplicate as it was on target
+ */
+static void infer_seqflag(const struct record *r, unsigned char *seen)
+{
+	uint8_t opcode = frame_opcode(r->rx);
+	uint8_t tid = frame_id(r->rx);
+	volatile msp_seqflags_t *flags = &msp_exp_state.seqflags;
+
+	if (seen[opcode])
+		return;
+	seen[opcode] = 1;
+
+	if (MSP_OP_TYPE(opcode) == MSP_OP_TYPE_REQ) {
+		/* CUBES picks the next transaction ID */
+		if (frame_opcode(r->tx) == MSP_OP_EXP_SEND)
+			msp_seqflags_set(flags, opcode, !frame_id(r->tx));
+	} else if (frame_opcode(r->tx) == MSP_OP_F_ACK) {
+		msp_seqflags_set(flags, opcode, !tid);
+	} else if ((frame_opcode(r->tx) == MSP_OP_T_ACK) &&
+			msp_from_bigendian32(r->rx + 1)) {
+		/* Data announced, but T_ACKed right away: a duplicate */
+		msp_seqflags_set(flags, opcode, tid);
+	}
+}
+
+
+/*
+ *==============================================================================
+ * Statistics
+ *==============================================================================
+ */
+struct dist {
+	double *v;
+	unsigned long n;
+};
+
+
+static void dist_add(struct dist *d, double v)
+{
+	d->v[d->n++] = v;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void dist_print(const char *name, struct dist *d)
+{
+	if (d->n == 0) {
+		printf("  %-24s %6lu\n", name, d->n);
+		return;
+	}
+
+	qsort(d->v, d->n, sizeof(double), cmp_double);
+	printf("  %-24s %6lu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, d->n,
+	       d->v[0], d->v[d->n / 2], d->v[d->n * 9 / 10], d->v[d->n * 99 / 100],
+	       d->v[d->n - 1]);
+}
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+ *==============================================================================
+ * Replay
+ *==============================================================================
+ */
+static int compare(unsigned long idx, const struct record *r, int rx_ret,
+                   int tx_ret, const uint8_t *tx, unsigned long tx_len,
+                   int verbose, unsigned long shown)
+{
+	unsigned long n = tx_len < MSP_CAPTURE_FRAME_LEN ?
+	                  tx_len : MSP_CAPTURE_FRAME_LEN;
+	int same;
+
+	/* Data frame contents are not replayed, only their opcode and frame ID */
+	if (tx_len && (frame_opcode(tx) == MSP_OP_DATA_FRAME))
+		n = 1;
+
+	same = (rx_ret == r->rx_ret) && (tx_ret == r->tx_ret) &&
+	       (tx_len == r->tx_len) && !memcmp(tx, r->tx, n);
+	if (same)
+		return 0;
+
+	if (verbose || (shown < REPLAY_MAX_SHOWN))
+		printf("record %lu: rx op 0x%02x fid %d len %lu: target rx %d tx %d "
+		       "op 0x%02x fid %d len %lu, host rx %d tx %d op 0x%02x fid %d "
+		       "len %lu\n", idx, frame_opcode(r->rx), frame_id(r->rx),
+		       r->rx_len, r->rx_ret, r->tx_ret, frame_opcode(r->tx),
+		       frame_id(r->tx), r->tx_len, rx_ret, tx_ret,
+		       frame_opcode(tx), frame_id(tx), tx_len);
+
+	return 1;
+}
+
+
+static int replay(const uint8_t *cap, unsigned long len, unsigned long mtu,
+                  int verbose)
+{
+	static uint8_t rx[MSP_EXP_MAX_FRAME_SIZE];
+	static uint8_t tx[MSP_EXP_MAX_FRAME_SIZE];
+	unsigned char seen[128] = {0};
+	unsigned long nrecs, i, first, diverged = 0;
+	uint32_t clk, trans_start = 0;
+	int in_trans = 0;
+	struct dist isr, gap, trans, host;
+	struct record r, prev;
+
+	if ((len < MSP_CAPTURE_HDR_LEN) || (cap[0] != MSP_CAPTURE_VERSION) ||
+			(cap[1] != MSP_CAPTURE_REC_LEN)) {
+		fprintf(stderr, "replay: not a version %d capture\n",
+		        MSP_CAPTURE_VERSION);
+		return 2;
+	}
+
+	nrecs = (cap[2] << 8) | cap[3];
+	clk = msp_from_bigendian32(cap + 12);
+	if ((len < MSP_CAPTURE_HDR_LEN + nrecs * MSP_CAPTURE_REC_LEN) || !clk) {
+		fprintf(stderr, "replay: truncated capture\n");
+		return 2;
+	}
+	cap += MSP_CAPTURE_HDR_LEN;
+
+	printf("records      : %lu (%lu overwritten, %lu not recorded)\n", nrecs,
+	       msp_from_bigendian32(cap - 12), msp_from_bigendian32(cap - 8));
+
+	isr.v = calloc(nrecs + 1, sizeof(double));
+	gap.v = calloc(nrecs + 1, sizeof(double));
+	trans.v = calloc(nrecs + 1, sizeof(double));
+	host.v = calloc(nrecs + 1, sizeof(double));
+	isr.n = gap.n = trans.n = host.n = 0;
+
+	/* Latencies on target */
+	for (i = 0; i < nrecs; i++) {
+		parse_record(cap + i * MSP_CAPTURE_REC_LEN, &r);
+		dist_add(&isr, r.isr_time * 1e6 / clk);
+		if (i > 0)
+			dist_add(&gap, (uint32_t)(r.time - prev.time) * 1e6 / clk);
+
+		if (is_trans_header(&r)) {
+			trans_start = r.time;
+			in_trans = 1;
+		}
+		if (in_trans && ((frame_opcode(r.tx) == MSP_OP_T_ACK) ||
+				((r.rx_ret == 0) && (frame_opcode(r.rx) == MSP_OP_T_ACK)))) {
+			dist_add(&trans, (uint32_t)(r.time - trans_start) * 1e6 / clk);
+			in_trans = 0;
+		}
+		prev = r;
+	}
+
+	/* Replay, from the first transaction header on */
+	msp_exp_state_initialize(msp_seqflags_init());
+	msp_exp_state_set_mtu(mtu);
+	for (first = 0; first < nrecs; first++) {
+		parse_record(cap + first * MSP_CAPTURE_REC_LEN, &r);
+		if (is_trans_header(&r))
+			break;
+	}
+
+	for (i = first; i < nrecs; i++) {
+		unsigned long rx_len, tx_len = 0;
+		int rx_ret, tx_ret;
+		uint64_t t0;
+
+		parse_record(cap + i * MSP_CAPTURE_REC_LEN, &r);
+		rx_len = rebuild_rx(&r, rx);
+
+		if (is_trans_header(&r))
+			infer_seqflag(&r, seen);
+		if (frame_opcode(r.tx) == MSP_OP_EXP_SEND)
+			send_len = msp_from_bigendian32(r.tx + 1);
+
+		t0 = now_ns();
+		rx_ret = msp_recv_callback(rx, rx_len);
+		tx_ret = msp_send_callback(tx, &tx_len);
+		dist_add(&host, (now_ns() - t0) / 1e3);
+
+		diverged += compare(i, &r, rx_ret, tx_ret, tx, tx_len, verbose,
+		                    diverged);
+	}
+
+	printf("replayed     : %lu (%lu skipped before the first header)\n",
+	       nrecs - first, first);
+	printf("diverged     : %lu\n", diverged);
+
+	printf("\nlatency, us                 n       min       p50       p90"
+	       "       p99       max\n");
+	dist_print("handler (target)", &isr);
+	dist_print("frame to frame (target)", &gap);
+	dist_print("transaction (target)", &trans);
+	dist_print("handler (host)", &host);
+
+	free(isr.v);
+	free(gap.v);
+	free(trans.v);
+	free(host.v);
+
+	return diverged ? 1 : 0;
+}
+
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-v] [-m mtu] capture\n"
+	        "  -v      print every diverging record, not only the first %d\n"
+	        "  -m mtu  MSP MTU at the start of the capture; default %d\n",
+	        prog, REPLAY_MAX_SHOWN, MSP_EXP_MTU);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static uint8_t cap[MSP_CAPTURE_MAX_LEN];
+	unsigned long mtu = MSP_EXP_MTU;
+	int opt, verbose = 0;
+	size_t len;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "vm:h")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'm':
+			mtu = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 2;
+	}
+	len = fread(cap, 1, sizeof(cap), f);
+	fclose(f);
+
+	return replay(cap, len, mtu, verbose);
+}
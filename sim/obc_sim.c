@@ -0,0 +1,806 @@
+/*
+ * CUBES host simulator: scripted OBC master and MSP throughput benchmark
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The OBC master drives MSP transactions on the simulated I2C1 bus, following
+ * a script (see sim/README.md for the syntax), and reports throughput figures
+ * at the end. The exit status is non-zero if any transaction failed, so that
+ * the simulator can be used as a regression test.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hk_adc/hk_adc.h"
+#include "msp_exp.h"
+#include "msp_crc.h"
+#include "msp_exp_frame.h"
+
+#include "sim_hw.h"
+
+/* Firmware main(), renamed when building main.c for the host */
+int cubes_main(void);
+
+#define OBC_MAX_RETRIES  (8)
+#define OBC_MAX_DATA     (24832)   /* largest REQ, i.e. MEM_HISTO_LEN_GW */
+#define OBC_FRAME_LEN    (MSP_EXP_MAX_FRAME_SIZE)
+#define SCRIPT_MAX_LINES (1024)
+
+struct opcode_stats {
+	unsigned long count;
+	unsigned long failed;
+	uint64_t wall_ns;
+	uint64_t isr_ns;
+};
+
+static struct {
+	msp_seqflags_t seqflags;
+	unsigned long mtu;
+	unsigned int corrupt_every;
+	unsigned long frames_written;
+
+	/* Last SEND or SYS transaction, for `dup` */
+	int last_valid;
+	uint8_t last_opcode;
+	uint8_t last_tid;
+	unsigned long last_len;
+
+	unsigned long transactions;
+	unsigned long failed;
+	unsigned long retries;
+	unsigned long frames_tx;
+	unsigned long frames_rx;
+	unsigned long bytes_tx;
+	unsigned long bytes_rx;
+	uint64_t wait_ns;            /* time spent in `wait` lines */
+	struct opcode_stats op[128];
+} obc;
+
+static int verbose = 0;
+
+static uint8_t req_data[OBC_MAX_DATA];
+
+#define OP(name) { #name, MSP_OP_##name }
+static const struct {
+	const char *name;
+	uint8_t opcode;
+} opcode_names[] = {
+	OP(ACTIVE), OP(SLEEP), OP(POWER_OFF),
+	OP(REQ_PAYLOAD), OP(REQ_HK), OP(SEND_TIME),
+	OP(CUBES_DAQ_START), OP(CUBES_DAQ_STOP),
+	OP(REQ_CUBES_ID), OP(REQ_CUBES_HVPS_TEMP_COMP),
+	OP(REQ_CUBES_BATCH_STATUS), OP(REQ_CUBES_MSP_STATS),
+	OP(REQ_CUBES_MSP_CAPTURE), OP(REQ_CUBES_HK_HISTORY),
+	OP(REQ_CUBES_HK_STATS), OP(REQ_CUBES_TIMED_STATUS),
+	OP(SEND_CUBES_HVPS_CONF), OP(SEND_CUBES_CITI_CONF),
+	OP(SEND_CUBES_PROB_CONF), OP(SEND_CUBES_DAQ_CONF),
+	OP(SEND_CUBES_HVPS_TMP_VOLT), OP(SEND_READ_REG_DEBUG),
+	OP(SEND_CUBES_GATEWARE_CONF), OP(SEND_CUBES_CALIB_PULSE_CONF),
+	OP(SEND_NVM_CITI_CONF), OP(SELECT_NVM_CITI_CONF),
+	OP(SEND_CUBES_MSP_MTU), OP(SEND_CUBES_PAYLOAD_WINDOW),
+	OP(SEND_CUBES_BATCH), OP(SEND_CUBES_TIMED_CMD),
+	OP(SEND_CUBES_HK_CONF),
+};
+
+static const char *default_script =
+	"# Default benchmark: HK polling, configuration and robustness\n"
+	"repeat 200\n"
+	"  req REQ_HK\n"
+	"  req REQ_CUBES_ID\n"
+	"  send SEND_TIME 00 00 10 00\n"
+	"  send SEND_CUBES_DAQ_CONF 0a 00 01 02 03 04 05\n"
+	"  send SEND_CUBES_CITI_CONF fill 144\n"
+	"  dup\n"
+	"  sys CUBES_DAQ_STOP\n"
+	"end\n"
+	"corrupt 7\n"
+	"repeat 50\n"
+	"  req REQ_HK\n"
+	"  send SEND_CUBES_PROB_CONF fill 32\n"
+	"end\n"
+	"corrupt 0\n"
+	"repeat 20\n"
+	"  abort SEND_CUBES_BATCH 1200 1\n"
+	"  req REQ_CUBES_ID\n"
+	"end\n"
+	"mtu 2043\n"
+	"repeat 50\n"
+	"  send SEND_CUBES_CITI_CONF fill 144\n"
+	"  req REQ_CUBES_MSP_STATS\n"
+	"end\n"
+	"mtu 0\n"
+	"# HK cycles, with HVPS and HK ADC traffic; run with a short -t\n"
+	"hvps corrupt 5\n"
+	"repeat 10\n"
+	"  wait 100\n"
+	"  req REQ_HK\n"
+	"  req REQ_CUBES_HK_STATS\n"
+	"end\n"
+	"hvps corrupt 0\n";
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+ *==============================================================================
+ * MSP frames, OBC side
+ *==============================================================================
+ */
+static unsigned long format_header(uint8_t *buf, uint8_t opcode, uint8_t fid,
+                                   unsigned long dl)
+{
+	buf[0] = (opcode & 0x7f) | ((fid & 1) << 7);
+	msp_to_bigendian32(buf + 1, dl);
+	msp_to_bigendian32(buf + 5, msp_exp_frame_generate_fcs(buf, 1, 5));
+	return 9;
+}
+
+
+static unsigned long format_data(uint8_t *buf, uint8_t fid,
+                                 const uint8_t *data, unsigned long len)
+{
+	buf[0] = MSP_OP_DATA_FRAME | ((fid & 1) << 7);
+	memcpy(buf + 1, data, len);
+	msp_to_bigendian32(buf + 1 + len,
+	                   msp_exp_frame_generate_fcs(buf, 1, len + 1));
+	return len + 5;
+}
+
+
+struct reply {
+	uint8_t opcode;
+	uint8_t fid;
+	unsigned long dl;            /* header frames */
+	const uint8_t *data;         /* data frames */
+	unsigned long len;
+	uint8_t buf[OBC_FRAME_LEN];
+};
+
+/*
+ * Write a frame to CUBES and read back its reply. `data_len` is the length of
+ * the data field if a data frame is expected. Every `corrupt_every`-th frame
+ * is sent with a broken FCS, to exercise retries.
+ *
+ * Returns 0 if a valid reply was read, -1 otherwise.
+ */
+static int xfer(const uint8_t *frame, unsigned long len, unsigned long data_len,
+                struct reply *r)
+{
+	uint8_t out[OBC_FRAME_LEN];
+	unsigned long rlen = data_len ? data_len + 5 : 9;
+
+	memcpy(out, frame, len);
+	obc.frames_written++;
+	if (obc.corrupt_every && (obc.frames_written % obc.corrupt_every == 0))
+		out[len - 1] ^= 0xff;
+
+	if (sim_i2c1_master_write(out, len))
+		return -1;
+	obc.frames_tx++;
+	obc.bytes_tx += len;
+
+	/* Read enough for a header frame, in case that is what we get */
+	sim_i2c1_master_read(r->buf, rlen < 9 ? 9 : rlen);
+
+	r->opcode = r->buf[0] & 0x7f;
+	r->fid = r->buf[0] >> 7;
+	if (r->opcode != MSP_OP_DATA_FRAME)
+		rlen = 9;
+	if (!msp_exp_frame_fcs_valid(r->buf, 0, rlen))
+		return -1;
+
+	obc.frames_rx++;
+	obc.bytes_rx += rlen;
+	if (r->opcode == MSP_OP_DATA_FRAME) {
+		r->data = r->buf + 1;
+		r->len = rlen - 5;
+	} else {
+		r->dl = msp_from_bigendian32(r->buf + 1);
+	}
+
+	return 0;
+}
+
+
+/* Expect a header reply with the given opcode and frame ID */
+static int is_header(const struct reply *r, uint8_t opcode, uint8_t fid)
+{
+	return (r->opcode == opcode) && (r->fid == fid);
+}
+
+
+/*
+ *==============================================================================
+ * MSP transactions, OBC side
+ *==============================================================================
+ */
+static int obc_send(uint8_t opcode, const uint8_t *data, unsigned long len,
+                    int tid)
+{
+	uint8_t frame[OBC_FRAME_LEN];
+	unsigned long flen, sent = 0;
+	struct reply r;
+	uint8_t fid;
+	int tries;
+
+	/* Header: F_ACK if data follows, T_ACK otherwise */
+	flen = format_header(frame, opcode, tid, len);
+	for (tries = 0; tries < OBC_MAX_RETRIES; tries++) {
+		if ((xfer(frame, flen, 0, &r) == 0) &&
+				is_header(&r, len ? MSP_OP_F_ACK : MSP_OP_T_ACK, tid))
+			break;
+		obc.retries++;
+	}
+	if (tries == OBC_MAX_RETRIES)
+		return -1;
+
+	/* Data frames, with alternating frame IDs; the last one gets a T_ACK */
+	fid = tid;
+	while (sent < len) {
+		unsigned long n = len - sent;
+		if (n > obc.mtu)
+			n = obc.mtu;
+		fid ^= 1;
+		flen = format_data(frame, fid, data + sent, n);
+		for (tries = 0; tries < OBC_MAX_RETRIES; tries++) {
+			if ((xfer(frame, flen, 0, &r) == 0) &&
+					(((sent + n < len) && is_header(&r, MSP_OP_F_ACK, fid)) ||
+					 ((sent + n == len) && is_header(&r, MSP_OP_T_ACK, tid))))
+				break;
+			obc.retries++;
+		}
+		if (tries == OBC_MAX_RETRIES)
+			return -1;
+		sent += n;
+	}
+
+	return 0;
+}
+
+
+static int obc_req(uint8_t opcode, uint8_t *data, unsigned long *len)
+{
+	uint8_t frame[OBC_FRAME_LEN];
+	unsigned long flen, dl, got = 0;
+	struct reply r;
+	uint8_t tid, last_fid;
+	int tries, errors = 0;
+
+	/* Header, answered by EXP_SEND with the length CUBES will send */
+	flen = format_header(frame, opcode, 0, 0);
+	for (tries = 0; tries < OBC_MAX_RETRIES; tries++) {
+		if ((xfer(frame, flen, 0, &r) == 0) &&
+				(r.opcode == MSP_OP_EXP_SEND))
+			break;
+		obc.retries++;
+	}
+	if (tries == OBC_MAX_RETRIES)
+		return -1;
+
+	tid = r.fid;
+	dl = r.dl;
+	last_fid = tid;
+	if (dl > OBC_MAX_DATA)
+		return -1;
+
+	/*
+	 * Acknowledge the header, then each data frame; CUBES answers the final
+	 * T_ACK with a NULL frame. Any other reply means that our last frame was
+	 * lost, so it is sent again.
+	 */
+	flen = format_header(frame, dl ? MSP_OP_F_ACK : MSP_OP_T_ACK, tid, 0);
+	while (errors < OBC_MAX_RETRIES) {
+		unsigned long expect = dl - got;
+		if (expect > obc.mtu)
+			expect = obc.mtu;
+
+		if (xfer(frame, flen, expect, &r) ||
+				((r.opcode != MSP_OP_DATA_FRAME) &&
+				 !((got == dl) && (r.opcode == MSP_OP_NULL))) ||
+				((r.opcode == MSP_OP_DATA_FRAME) && (r.fid == last_fid))) {
+			obc.retries++;
+			errors++;
+			continue;
+		}
+
+		if (r.opcode == MSP_OP_NULL) {
+			*len = got;
+			return 0;
+		}
+
+		memcpy(data + got, r.data, r.len);
+		got += r.len;
+		last_fid = r.fid;
+
+		if (got >= dl)
+			flen = format_header(frame, MSP_OP_T_ACK, tid, 0);
+		else
+			flen = format_header(frame, MSP_OP_F_ACK, r.fid, 0);
+	}
+
+	return -1;
+}
+
+
+static int obc_abort(uint8_t opcode, unsigned long len, unsigned long frames)
+{
+	uint8_t frame[OBC_FRAME_LEN];
+	uint8_t data[OBC_FRAME_LEN];
+	unsigned long flen;
+	struct reply r;
+	uint8_t tid = msp_seqflags_get_next(&obc.seqflags, opcode);
+	uint8_t fid = tid;
+
+	memset(data, 0x5a, sizeof(data));
+
+	/* The last data frame would complete the transaction, never send it */
+	if (frames > (len + obc.mtu - 1) / obc.mtu - 1)
+		frames = len ? (len + obc.mtu - 1) / obc.mtu - 1 : 0;
+
+	flen = format_header(frame, opcode, tid, len);
+	if (xfer(frame, flen, 0, &r))
+		return -1;
+
+	for (unsigned long i = 0; i < frames; i++) {
+		unsigned long n = (len < obc.mtu) ? len : obc.mtu;
+		fid ^= 1;
+		flen = format_data(frame, fid, data, n);
+		if (xfer(frame, flen, 0, &r))
+			return -1;
+	}
+
+	/* A NULL frame aborts the transaction; CUBES is ready again */
+	flen = format_header(frame, MSP_OP_NULL, 0, 0);
+	if (xfer(frame, flen, 0, &r) || !is_header(&r, MSP_OP_NULL, 0))
+		return -1;
+
+	return 0;
+}
+
+
+/*
+ *==============================================================================
+ * Script
+ *==============================================================================
+ */
+static int parse_opcode(const char *s, uint8_t *opcode)
+{
+	char *end;
+	unsigned long v;
+
+	for (size_t i = 0; i < sizeof(opcode_names)/sizeof(opcode_names[0]); i++) {
+		if (strcmp(s, opcode_names[i].name) == 0) {
+			*opcode = opcode_names[i].opcode;
+			return 0;
+		}
+	}
+
+	v = strtoul(s, &end, 0);
+	if ((*end != '\0') || (v > 0x7f))
+		return -1;
+	*opcode = v;
+	return 0;
+}
+
+
+/* Data is either a list of hex bytes, or `fill N` for N pattern bytes */
+static long parse_data(char **tok, int ntok, uint8_t *data)
+{
+	long len = 0;
+
+	if ((ntok == 2) && (strcmp(tok[0], "fill") == 0)) {
+		len = strtol(tok[1], NULL, 0);
+		if ((len < 0) || (len > OBC_MAX_DATA))
+			return -1;
+		for (long i = 0; i < len; i++)
+			data[i] = i & 0xff;
+		return len;
+	}
+
+	for (int i = 0; i < ntok; i++) {
+		if (len >= OBC_MAX_DATA)
+			return -1;
+		data[len++] = strtoul(tok[i], NULL, 16);
+	}
+	return len;
+}
+
+
+static void account(uint8_t opcode, int ret, uint64_t t0, uint64_t isr0)
+{
+	struct opcode_stats *s = &obc.op[opcode & 0x7f];
+
+	obc.transactions++;
+	s->count++;
+	s->wall_ns += now_ns() - t0;
+	s->isr_ns += sim_i2c1_isr_time_ns() - isr0;
+	if (ret) {
+		obc.failed++;
+		s->failed++;
+	}
+}
+
+
+static int run_line(char *line, int lineno)
+{
+	static uint8_t data[OBC_MAX_DATA];
+	char *tok[OBC_MAX_DATA / 2 + 4];
+	int ntok = 0;
+	uint8_t opcode = 0;
+	uint64_t t0 = now_ns();
+	uint64_t isr0 = sim_i2c1_isr_time_ns();
+	int ret;
+
+	for (char *p = strtok(line, " \t\r\n"); p && (ntok < (int)(sizeof(tok)/sizeof(tok[0])));
+			p = strtok(NULL, " \t\r\n"))
+		tok[ntok++] = p;
+	if ((ntok == 0) || (tok[0][0] == '#'))
+		return 0;
+
+	if ((strcmp(tok[0], "req") == 0) && (ntok == 2) &&
+			!parse_opcode(tok[1], &opcode)) {
+		unsigned long len = 0;
+		ret = obc_req(opcode, req_data, &len);
+		account(opcode, ret, t0, isr0);
+		if (verbose)
+			printf("req 0x%02x: %s, %lu bytes\n", opcode, ret ? "FAIL" : "ok",
+			       len);
+	} else if ((strcmp(tok[0], "save") == 0) && (ntok == 3) &&
+			!parse_opcode(tok[1], &opcode)) {
+		unsigned long len = 0;
+		FILE *f;
+		ret = obc_req(opcode, req_data, &len);
+		account(opcode, ret, t0, isr0);
+		if (verbose)
+			printf("save 0x%02x: %s, %lu bytes to %s\n", opcode,
+			       ret ? "FAIL" : "ok", len, tok[2]);
+		if (ret == 0) {
+			f = fopen(tok[2], "wb");
+			if (!f || (fwrite(req_data, 1, len, f) != len)) {
+				perror(tok[2]);
+				if (f)
+					fclose(f);
+				return -1;
+			}
+			fclose(f);
+		}
+	} else if (((strcmp(tok[0], "send") == 0) || (strcmp(tok[0], "sys") == 0))
+			&& (ntok >= 2) && !parse_opcode(tok[1], &opcode)) {
+		long len = parse_data(tok + 2, ntok - 2, data);
+		uint8_t tid = msp_seqflags_get_next(&obc.seqflags, opcode);
+		if (len < 0)
+			goto syntax;
+		ret = obc_send(opcode, data, len, tid);
+		if (ret == 0) {
+			msp_seqflags_set(&obc.seqflags, opcode, tid);
+			obc.last_valid = 1;
+			obc.last_opcode = opcode;
+			obc.last_tid = tid;
+			obc.last_len = len;
+		}
+		account(opcode, ret, t0, isr0);
+		if (verbose)
+			printf("%s 0x%02x: %s\n", tok[0], opcode, ret ? "FAIL" : "ok");
+	} else if ((strcmp(tok[0], "dup") == 0) && (ntok == 1)) {
+		/*
+		 * Resend the header of the last transaction, as after a lost T_ACK:
+		 * CUBES must T_ACK it right away, without acting on it again.
+		 */
+		uint8_t frame[9];
+		struct reply r;
+		if (!obc.last_valid)
+			goto syntax;
+		opcode = obc.last_opcode;
+		format_header(frame, opcode, obc.last_tid, obc.last_len);
+		ret = (xfer(frame, sizeof(frame), 0, &r) == 0) &&
+		      is_header(&r, MSP_OP_T_ACK, obc.last_tid) ? 0 : -1;
+		account(opcode, ret, t0, isr0);
+		if (verbose)
+			printf("dup 0x%02x: %s\n", opcode, ret ? "FAIL" : "ok");
+	} else if ((strcmp(tok[0], "abort") == 0) && (ntok == 4) &&
+			!parse_opcode(tok[1], &opcode)) {
+		ret = obc_abort(opcode, strtoul(tok[2], NULL, 0),
+		                strtoul(tok[3], NULL, 0));
+		account(opcode, ret, t0, isr0);
+		if (verbose)
+			printf("abort 0x%02x: %s\n", opcode, ret ? "FAIL" : "ok");
+	} else if ((strcmp(tok[0], "mtu") == 0) && (ntok == 2)) {
+		unsigned long mtu = strtoul(tok[1], NULL, 0);
+		data[0] = (mtu >> 8) & 0xff;
+		data[1] = mtu & 0xff;
+		opcode = MSP_OP_SEND_CUBES_MSP_MTU;
+		{
+			uint8_t tid = msp_seqflags_get_next(&obc.seqflags, opcode);
+			ret = obc_send(opcode, data, 2, tid);
+			if (ret == 0)
+				msp_seqflags_set(&obc.seqflags, opcode, tid);
+		}
+		account(opcode, ret, t0, isr0);
+		/* CUBES keeps its MTU if the new one is too large */
+		if ((ret == 0) && (mtu <= MSP_EXP_MAX_MTU))
+			obc.mtu = mtu ? mtu : MSP_EXP_MTU;
+	} else if ((strcmp(tok[0], "corrupt") == 0) && (ntok == 2)) {
+		obc.corrupt_every = strtoul(tok[1], NULL, 0);
+	} else if ((strcmp(tok[0], "hvps") == 0) && (ntok == 3)) {
+		unsigned long n = strtoul(tok[2], NULL, 0);
+		if (strcmp(tok[1], "delay") == 0)
+			sim_hvps_set_delay(n);
+		else if (strcmp(tok[1], "silent") == 0)
+			sim_hvps_drop_replies(n);
+		else if (strcmp(tok[1], "corrupt") == 0)
+			sim_hvps_corrupt_every(n);
+		else if (strcmp(tok[1], "error") == 0)
+			sim_hvps_inject_error(n);
+		else
+			goto syntax;
+	} else if ((strcmp(tok[0], "adc") == 0) && (ntok == 4) &&
+			(strcmp(tok[1], "input") == 0)) {
+		sim_adc_set_input(strtoul(tok[2], NULL, 0),
+		                  strtol(tok[3], NULL, 0));
+	} else if ((strcmp(tok[0], "adc") == 0) && (ntok == 3) &&
+			(strcmp(tok[1], "nack") == 0)) {
+		sim_adc_nack(strtoul(tok[2], NULL, 0));
+	} else if ((strcmp(tok[0], "wait") == 0) && (ntok == 2)) {
+		usleep(strtoul(tok[1], NULL, 0) * 1000);
+		obc.wait_ns += now_ns() - t0;
+	} else {
+		goto syntax;
+	}
+	return 0;
+
+syntax:
+	fprintf(stderr, "script line %d: syntax error\n", lineno);
+	return -1;
+}
+
+
+/*
+ * Run lines [first, last) of the script, expanding `repeat N` ... `end`
+ * blocks. Returns the index of the line after the block, or -1 on errors.
+ */
+static int run_block(char **lines, int first, int last, int top)
+{
+	int i = first;
+
+	while (i < last) {
+		char buf[4096];
+		char word[16] = "";
+		long count;
+
+		sscanf(lines[i], "%15s %ld", word, &count);
+
+		if (strcmp(word, "repeat") == 0) {
+			int end = -1;
+			for (long n = 0; n < count; n++) {
+				end = run_block(lines, i + 1, last, 0);
+				if (end < 0)
+					return -1;
+			}
+			if (end < 0)
+				end = run_block(lines, i + 1, last, 0);   /* count == 0 */
+			i = end;
+			continue;
+		}
+		if (strcmp(word, "end") == 0)
+			return top ? -1 : i + 1;
+
+		strncpy(buf, lines[i], sizeof(buf) - 1);
+		buf[sizeof(buf) - 1] = '\0';
+		if (run_line(buf, i + 1))
+			return -1;
+		i++;
+	}
+
+	return top ? i : -1;
+}
+
+
+static int run_script(char *text)
+{
+	char *lines[SCRIPT_MAX_LINES];
+	int n = 0;
+
+	for (char *p = strtok(text, "\n"); p && (n < SCRIPT_MAX_LINES);
+			p = strtok(NULL, "\n")) {
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p)
+			lines[n++] = p;
+	}
+
+	return (run_block(lines, 0, n, 1) < 0) ? -1 : 0;
+}
+
+
+static char *read_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *text;
+	long size;
+
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	text = calloc(1, size + 1);
+	if (text && (fread(text, 1, size, f) != (size_t)size)) {
+		free(text);
+		text = NULL;
+	}
+	fclose(f);
+	return text;
+}
+
+
+/*
+ *==============================================================================
+ * main()
+ *==============================================================================
+ */
+static void *firmware_thread(void *arg)
+{
+	cubes_main();
+	return NULL;
+}
+
+
+static void report(uint64_t wall_ns)
+{
+	double s = wall_ns / 1e9;
+	/* Throughput is over the time spent on transactions, waits excluded */
+	double busy = (wall_ns - obc.wait_ns) / 1e9;
+	unsigned long frames = obc.frames_tx + obc.frames_rx;
+	unsigned long bytes = obc.bytes_tx + obc.bytes_rx;
+	struct sim_hvps_stats hvps;
+	struct sim_i2c0_stats i2c0;
+	unsigned long conversions;
+	uint32_t adc_xfers, adc_xfers_saved;
+
+	printf("transactions : %lu (%lu failed, %lu retries)\n",
+	       obc.transactions, obc.failed, obc.retries);
+	printf("frames       : %lu to CUBES, %lu from CUBES\n",
+	       obc.frames_tx, obc.frames_rx);
+	printf("bytes        : %lu to CUBES, %lu from CUBES\n",
+	       obc.bytes_tx, obc.bytes_rx);
+	printf("elapsed      : %.3f s (%.3f s in waits)\n", s,
+	       obc.wait_ns / 1e9);
+	printf("throughput   : %.0f frames/s, %.0f bytes/s\n",
+	       frames / busy, bytes / busy);
+	printf("ISR CPU time : %.3f ms total, %.2f us per transaction\n",
+	       sim_i2c1_isr_time_ns() / 1e6,
+	       obc.transactions ?
+	           sim_i2c1_isr_time_ns() / 1e3 / obc.transactions : 0.0);
+
+	sim_hvps_get_stats(&hvps);
+	printf("HVPS         : %lu commands, %lu hxx, %lu dropped, %lu corrupted\n",
+	       hvps.cmds, hvps.errors, hvps.dropped, hvps.corrupted);
+	printf("HVPS latency : %.2f ms mean, %.2f ms max\n",
+	       hvps.replies ? hvps.latency_ns / 1e6 / hvps.replies : 0.0,
+	       hvps.latency_max_ns / 1e6);
+	sim_i2c0_get_stats(&i2c0);
+	conversions = sim_adc_conversions();
+	printf("HK ADC       : %lu conversions, %lu I2C0 transfers (%lu NACKed)\n",
+	       conversions, i2c0.transfers, i2c0.nacks);
+	printf("I2C0 bus     : %.3f ms total, %.1f us per conversion\n",
+	       i2c0.bus_ns / 1e6,
+	       conversions ? i2c0.bus_ns / 1e3 / conversions : 0.0);
+	/* As counted by the driver, against a pointer write before each read */
+	hk_adc_get_xfer_counts(&adc_xfers, &adc_xfers_saved);
+	printf("HK ADC xfers : %lu by the driver, %lu saved by register shadows\n",
+	       (unsigned long)adc_xfers, (unsigned long)adc_xfers_saved);
+
+	printf("\nopcode  count  failed  wall us/tr  ISR us/tr\n");
+	for (int i = 0; i < 128; i++) {
+		struct opcode_stats *op = &obc.op[i];
+		if (!op->count)
+			continue;
+		printf("  0x%02x %6lu  %6lu  %10.2f  %9.2f\n", i, op->count,
+		       op->failed, op->wall_ns / 1e3 / op->count,
+		       op->isr_ns / 1e3 / op->count);
+	}
+}
+
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [-v] [-t timer_ms] [script]\n"
+	        "  -v           print the outcome of each transaction\n"
+	        "  -t timer_ms  Timer1 (HK) period, 0 to disable; default 1000\n",
+	        prog);
+}
+
+
+int main(int argc, char *argv[])
+{
+	pthread_t fw;
+	unsigned long timer_ms = 1000;
+	char *script;
+	uint64_t t0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "vt:h")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 't':
+			timer_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind < argc) {
+		script = read_file(argv[optind]);
+		if (!script) {
+			perror(argv[optind]);
+			return 2;
+		}
+	} else {
+		script = strdup(default_script);
+	}
+
+	if (sim_hw_init() || sim_irq_start(timer_ms))
+		return 2;
+
+	/* Start the firmware and wait for it to get through its init */
+	pthread_create(&fw, NULL, firmware_thread, NULL);
+	for (int i = 0; (i < 1000) && !sim_i2c1_slave_enabled(); i++)
+		usleep(1000);
+	if (!sim_i2c1_slave_enabled()) {
+		fprintf(stderr, "sim: firmware did not enable the MSP I2C slave\n");
+		return 2;
+	}
+	usleep(50000);
+
+	obc.seqflags = msp_seqflags_init();
+	obc.mtu = MSP_EXP_MTU;
+
+	t0 = now_ns();
+	ret = run_script(script);
+	report(now_ns() - t0);
+
+	sim_irq_stop();
+	free(script);
+
+	return (ret || obc.failed) ? 1 : 0;
+}
@@ -0,0 +1,588 @@
+/*
+ * CUBES host simulator: models of the devices around the SmartFusion2
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Models of the devices around the SmartFusion2:
+ *  - the C11204-02 HVPS emulates the command set used by the firmware, with
+ *    the line and response timing of the real device and fault injection;
+ *  - the ADS1015 HK ADC converts set input voltages, with the conversion
+ *    time of its data rate and injected NACKs.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim_hw.h"
+
+#define STX  (0x02)
+#define ETX  (0x03)
+#define CR   ('\r')
+
+#define ADS1015_ADDR  (0x48)
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * C11204-02 HVPS, on UART0
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * The emulator decodes the frames sent by the firmware, keeps the state the
+ * C11204-02 command set acts on and answers on the timeline of the real
+ * device: the command takes its time on the 38400-baud line, the device takes
+ * `delay_us` to answer, then the reply bytes are released to the UART0 RX
+ * FIFO one by one by sim_hvps_poll(), at the line rate. The firmware thus sees
+ * replies arrive in pieces, as it would on target.
+ */
+
+/* 8 data bits, start, parity and stop bits */
+#define HVPS_BYTE_NS         (11 * 1000000000ull / 38400)
+#define HVPS_DELAY_US        (2000)
+
+/* Error codes of the `hxx` reply, see the C11204-02 command reference */
+#define HVPS_EMU_ERR_SYNTAX     (3)
+#define HVPS_EMU_ERR_CHECKSUM   (4)
+#define HVPS_EMU_ERR_COMMAND    (5)
+#define HVPS_EMU_ERR_PARAM      (6)
+#define HVPS_EMU_ERR_PARAM_LEN  (7)
+
+/* Status bits */
+#define HVPS_STATUS_ON         (1 << 0)
+#define HVPS_STATUS_TEMP_COMP  (1 << 6)
+
+/* 25 degC, in HGT units */
+#define HVPS_TEMP_25C        (0xb7d8)
+/* 90 V, in HBV units (1.812 mV/LSB); the highest voltage accepted */
+#define HVPS_VOLT_MAX        (0xc205)
+
+#define HVPS_FRAME_MAX       (64)
+#define HVPS_TXQ_LEN         (512)
+
+static struct {
+	pthread_mutex_t lock;
+
+	/* Device */
+	int on;
+	int temp_comp;
+	uint16_t corr[6];       /* dT'1, dT'2, dT1, dT2, Vb, Tb, as set by HST */
+	uint16_t vb;            /* Temporary voltage set by HBV */
+	int vb_set;
+
+	/* Frame being received */
+	char rx[HVPS_FRAME_MAX];
+	size_t rx_len;
+
+	/* Reply bytes and the time they are due on the line */
+	struct {
+		uint8_t c;
+		uint64_t t;
+	} txq[HVPS_TXQ_LEN];
+	size_t txq_rd, txq_wr;
+	uint64_t line_free;
+
+	/* Fault injection */
+	unsigned long delay_us;
+	unsigned long silent;
+	unsigned long corrupt_every;
+	unsigned int error;
+
+	struct sim_hvps_stats stats;
+} hvps = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.delay_us = HVPS_DELAY_US,
+};
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static int hex_field(const char *s, int digits, uint16_t *v)
+{
+	*v = 0;
+	for (int i = 0; i < digits; i++) {
+		char c = s[i];
+		int d;
+
+		if ((c >= '0') && (c <= '9'))
+			d = c - '0';
+		else if ((c >= 'A') && (c <= 'F'))
+			d = c - 'A' + 10;
+		else if ((c >= 'a') && (c <= 'f'))
+			d = c - 'a' + 10;
+		else
+			return -1;
+		*v = (*v << 4) | d;
+	}
+
+	return 0;
+}
+
+
+static uint16_t hvps_volt(void)
+{
+	if (!hvps.on)
+		return 0;
+	return hvps.vb_set ? hvps.vb : hvps.corr[4];
+}
+
+
+/* 1 MOhm load; 1.812 mV/LSB in, 4.98 uA/LSB out */
+static uint16_t hvps_curr(void)
+{
+	return (uint32_t)hvps_volt() * 1812 / 4980000;
+}
+
+
+static uint16_t hvps_status(void)
+{
+	return (hvps.on ? HVPS_STATUS_ON : 0) |
+	       (hvps.temp_comp ? HVPS_STATUS_TEMP_COMP : 0);
+}
+
+
+/*
+ * Run the command in `cmd`, with `len` parameter characters in `data`. Returns
+ * the number of reply fields written to `fields`, or minus an `hxx` code. The
+ * temperature stays at 25 degC, so compensation only shows in the status.
+ */
+static int hvps_exec(const char *cmd, const char *data, size_t len,
+                     uint16_t *fields)
+{
+	uint16_t v[6];
+
+	if (!strncmp(cmd, "HCM", 3)) {
+		if (len != 1)
+			return -HVPS_EMU_ERR_PARAM_LEN;
+		if ((data[0] != '0') && (data[0] != '1'))
+			return -HVPS_EMU_ERR_PARAM;
+		hvps.temp_comp = data[0] - '0';
+		return 0;
+	}
+	if (!strncmp(cmd, "HST", 3) || !strncmp(cmd, "HBV", 3)) {
+		int n = (cmd[1] == 'S') ? 6 : 1;
+		if (len != 4 * n)
+			return -HVPS_EMU_ERR_PARAM_LEN;
+		for (int i = 0; i < n; i++)
+			if (hex_field(data + 4*i, 4, &v[i]))
+				return -HVPS_EMU_ERR_PARAM;
+		if (v[n == 6 ? 4 : 0] > HVPS_VOLT_MAX)
+			return -HVPS_EMU_ERR_PARAM;
+		if (n == 6) {
+			memcpy(hvps.corr, v, sizeof(hvps.corr));
+			hvps.vb_set = 0;
+		} else {
+			hvps.vb = v[0];
+			hvps.vb_set = 1;
+		}
+		return 0;
+	}
+	if (len)
+		return -HVPS_EMU_ERR_PARAM_LEN;
+
+	if (!strncmp(cmd, "HON", 3)) {
+		hvps.on = 1;
+		return 0;
+	} else if (!strncmp(cmd, "HOF", 3)) {
+		hvps.on = 0;
+		return 0;
+	} else if (!strncmp(cmd, "HRE", 3)) {
+		hvps.on = 0;
+		hvps.vb_set = 0;
+		return 0;
+	} else if (!strncmp(cmd, "HGS", 3)) {
+		fields[0] = hvps_status();
+		return 1;
+	} else if (!strncmp(cmd, "HGV", 3)) {
+		fields[0] = hvps_volt();
+		return 1;
+	} else if (!strncmp(cmd, "HGC", 3)) {
+		fields[0] = hvps_curr();
+		return 1;
+	} else if (!strncmp(cmd, "HGT", 3)) {
+		fields[0] = HVPS_TEMP_25C;
+		return 1;
+	} else if (!strncmp(cmd, "HRT", 3)) {
+		memcpy(fields, hvps.corr, sizeof(hvps.corr));
+		return 6;
+	} else if (!strncmp(cmd, "HPO", 3)) {
+		/* Status, set voltage, compensation mode, then the monitors */
+		fields[0] = hvps_status();
+		fields[1] = hvps.vb_set ? hvps.vb : hvps.corr[4];
+		fields[2] = hvps.temp_comp;
+		fields[3] = hvps_volt();
+		fields[4] = hvps_curr();
+		fields[5] = HVPS_TEMP_25C;
+		return 6;
+	}
+
+	return -HVPS_EMU_ERR_COMMAND;
+}
+
+
+/* Queue a reply to go out on the line `delay_us` after `t_cmd_end` */
+static void hvps_reply(const char *cmd, int nfields, const uint16_t *fields,
+                       uint64_t t0, uint64_t t_cmd_end)
+{
+	char reply[HVPS_FRAME_MAX];
+	size_t n = 0;
+	unsigned int chksum = 0;
+	uint64_t t;
+
+	reply[n++] = STX;
+	if (nfields < 0) {
+		n += sprintf(reply + n, "hxx%04X", -nfields);
+		hvps.stats.errors++;
+	} else {
+		for (int i = 0; i < 3; i++)
+			reply[n++] = cmd[i] + 0x20;
+		for (int i = 0; i < nfields; i++)
+			n += sprintf(reply + n, "%04X", fields[i]);
+	}
+	reply[n++] = ETX;
+	for (size_t i = 0; i < n; i++)
+		chksum += (uint8_t)reply[i];
+	if (hvps.corrupt_every &&
+			((hvps.stats.replies + 1) % hvps.corrupt_every == 0)) {
+		chksum++;
+		hvps.stats.corrupted++;
+	}
+	n += sprintf(reply + n, "%02X", chksum & 0xff);
+	reply[n++] = CR;
+
+	t = t_cmd_end + hvps.delay_us * 1000ull;
+	if (t < hvps.line_free)
+		t = hvps.line_free;
+	for (size_t i = 0; i < n; i++) {
+		size_t next = (hvps.txq_wr + 1) % HVPS_TXQ_LEN;
+		if (next == hvps.txq_rd)
+			break;
+		t += HVPS_BYTE_NS;
+		hvps.txq[hvps.txq_wr].c = reply[i];
+		hvps.txq[hvps.txq_wr].t = t;
+		hvps.txq_wr = next;
+	}
+	hvps.line_free = t;
+
+	hvps.stats.replies++;
+	hvps.stats.latency_ns += t - t0;
+	if (t - t0 > hvps.stats.latency_max_ns)
+		hvps.stats.latency_max_ns = t - t0;
+}
+
+
+/* Handle a frame from STX to CR, received in full at `t_end` */
+static void hvps_frame(const char *f, size_t len, uint64_t t0, uint64_t t_end)
+{
+	uint16_t fields[6];
+	unsigned int chksum = 0;
+	uint16_t rx_chksum;
+	size_t etx = len - 4;
+	int nfields;
+
+	hvps.stats.cmds++;
+
+	if ((len < 8) || (f[etx] != ETX)) {
+		nfields = -HVPS_EMU_ERR_SYNTAX;
+	} else {
+		for (size_t i = 0; i <= etx; i++)
+			chksum += (uint8_t)f[i];
+		if (hex_field(f + etx + 1, 2, &rx_chksum) ||
+				(rx_chksum != (chksum & 0xff)))
+			nfields = -HVPS_EMU_ERR_CHECKSUM;
+		else
+			nfields = hvps_exec(f + 1, f + 4, etx - 4, fields);
+	}
+
+	if (hvps.error) {
+		nfields = -(int)hvps.error;
+		hvps.error = 0;
+	}
+	if (hvps.silent) {
+		hvps.silent--;
+		hvps.stats.dropped++;
+		return;
+	}
+
+	hvps_reply(f + 1, nfields, fields, t0, t_end);
+}
+
+
+void sim_hvps_uart_tx(const uint8_t *buf, size_t len)
+{
+	uint64_t t0 = now_ns();
+
+	pthread_mutex_lock(&hvps.lock);
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] == STX)
+			hvps.rx_len = 0;
+		if (hvps.rx_len < HVPS_FRAME_MAX)
+			hvps.rx[hvps.rx_len++] = buf[i];
+		if ((buf[i] == CR) && (hvps.rx[0] == STX)) {
+			hvps_frame(hvps.rx, hvps.rx_len, t0,
+			           t0 + (i + 1) * HVPS_BYTE_NS);
+			hvps.rx_len = 0;
+		}
+	}
+	pthread_mutex_unlock(&hvps.lock);
+}
+
+
+void sim_hvps_poll(void)
+{
+	uint8_t buf[HVPS_TXQ_LEN];
+	size_t n = 0;
+	uint64_t t = now_ns();
+
+	pthread_mutex_lock(&hvps.lock);
+	while ((hvps.txq_rd != hvps.txq_wr) && (hvps.txq[hvps.txq_rd].t <= t)) {
+		buf[n++] = hvps.txq[hvps.txq_rd].c;
+		hvps.txq_rd = (hvps.txq_rd + 1) % HVPS_TXQ_LEN;
+	}
+	pthread_mutex_unlock(&hvps.lock);
+
+	if (n)
+		sim_uart0_rx_push(buf, n);
+}
+
+
+void sim_hvps_set_delay(unsigned long us)
+{
+	pthread_mutex_lock(&hvps.lock);
+	hvps.delay_us = us;
+	pthread_mutex_unlock(&hvps.lock);
+}
+
+
+void sim_hvps_drop_replies(unsigned long n)
+{
+	pthread_mutex_lock(&hvps.lock);
+	hvps.silent = n;
+	pthread_mutex_unlock(&hvps.lock);
+}
+
+
+void sim_hvps_corrupt_every(unsigned long n)
+{
+	pthread_mutex_lock(&hvps.lock);
+	hvps.corrupt_every = n;
+	pthread_mutex_unlock(&hvps.lock);
+}
+
+
+void sim_hvps_inject_error(unsigned int code)
+{
+	pthread_mutex_lock(&hvps.lock);
+	hvps.error = code;
+	pthread_mutex_unlock(&hvps.lock);
+}
+
+
+void sim_hvps_get_stats(struct sim_hvps_stats *s)
+{
+	pthread_mutex_lock(&hvps.lock);
+	*s = hvps.stats;
+	pthread_mutex_unlock(&hvps.lock);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * ADS1015 HK ADC, on I2C0
+ * -----------------------------------------------------------------------------
+ */
+
+/*
+ * Single-shot conversions take one period of the configured data rate; the
+ * OS bit reads 0 and the conversion register keeps its old value until then.
+ * The inputs are set from the OBC script. Continuous mode is modelled as a
+ * conversion register that follows the inputs.
+ */
+
+#define ADS1015_PTR_CONV     (0)
+#define ADS1015_PTR_CONFIG   (1)
+#define ADS1015_OS           (0x8000)
+#define ADS1015_MODE_SINGLE  (0x0100)
+
+/* Data rate, in samples/s, per DR[2:0] */
+static const uint16_t ads1015_sps[8] = {
+	128, 250, 490, 920, 1600, 2400, 3300, 3300
+};
+
+/* Full-scale range, in mV, per PGA[2:0] */
+static const uint16_t ads1015_fsr_mv[8] = {
+	6144, 4096, 2048, 1024, 512, 256, 256, 256
+};
+
+static struct {
+	pthread_mutex_t lock;
+	uint8_t ptr;
+	uint16_t regs[4];       /* CONFIG without the OS bit */
+	uint16_t result;        /* Conversion in progress */
+	uint64_t conv_end;      /* 0 when no conversion is in progress */
+	int ain_mv[4];
+	unsigned long nack;
+	unsigned long conversions;
+} adc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.regs = { 0x0000, 0x0583, 0x8000, 0x7fff },
+};
+
+
+/* Sample the inputs selected by MUX[2:0], at the PGA[2:0] full-scale range */
+static uint16_t adc_sample(uint16_t config)
+{
+	static const int8_t mux_p[8] = { 0, 0, 1, 2, 0, 1, 2, 3 };
+	static const int8_t mux_n[8] = { 1, 3, 3, 3, -1, -1, -1, -1 };
+	int mux = (config >> 12) & 7;
+	int mv = adc.ain_mv[mux_p[mux]] - ((mux_n[mux] < 0) ? 0 :
+	                                   adc.ain_mv[mux_n[mux]]);
+	int code = mv * 2048 / ads1015_fsr_mv[(config >> 9) & 7];
+
+	if (code > 2047)
+		code = 2047;
+	else if (code < -2048)
+		code = -2048;
+
+	return (uint16_t)(code << 4);
+}
+
+
+static void adc_update(uint64_t t)
+{
+	if (adc.conv_end && (t >= adc.conv_end)) {
+		adc.regs[ADS1015_PTR_CONV] = adc.result;
+		adc.conv_end = 0;
+	}
+	if (!(adc.regs[ADS1015_PTR_CONFIG] & ADS1015_MODE_SINGLE))
+		adc.regs[ADS1015_PTR_CONV] = adc_sample(adc.regs[ADS1015_PTR_CONFIG]);
+}
+
+
+/* Take an injected NACK, if any is left */
+static int adc_nack(void)
+{
+	if (!adc.nack)
+		return 0;
+	adc.nack--;
+	return 1;
+}
+
+
+int sim_i2c0_dev_write(uint8_t addr, const uint8_t *buf, uint16_t len)
+{
+	uint64_t t = now_ns();
+	uint16_t v;
+
+	if ((addr != ADS1015_ADDR) || (len == 0))
+		return -1;
+
+	pthread_mutex_lock(&adc.lock);
+	if (adc_nack()) {
+		pthread_mutex_unlock(&adc.lock);
+		return -1;
+	}
+
+	adc_update(t);
+	adc.ptr = buf[0] & 0x03;
+	if ((len == 3) && (adc.ptr != ADS1015_PTR_CONV)) {
+		v = (buf[1] << 8) | buf[2];
+		if (adc.ptr == ADS1015_PTR_CONFIG) {
+			if ((v & ADS1015_OS) && (v & ADS1015_MODE_SINGLE) &&
+					!adc.conv_end) {
+				adc.result = adc_sample(v);
+				adc.conv_end = t + 1000000000ull /
+				               ads1015_sps[(v >> 5) & 7];
+				adc.conversions++;
+			}
+			v &= ~ADS1015_OS;
+		}
+		adc.regs[adc.ptr] = v;
+	}
+	pthread_mutex_unlock(&adc.lock);
+
+	return 0;
+}
+
+
+int sim_i2c0_dev_read(uint8_t addr, uint8_t *buf, uint16_t len)
+{
+	uint16_t v;
+
+	if (addr != ADS1015_ADDR)
+		return -1;
+
+	pthread_mutex_lock(&adc.lock);
+	if (adc_nack()) {
+		pthread_mutex_unlock(&adc.lock);
+		return -1;
+	}
+
+	adc_update(now_ns());
+	v = adc.regs[adc.ptr];
+	if ((adc.ptr == ADS1015_PTR_CONFIG) && !adc.conv_end)
+		v |= ADS1015_OS;
+	pthread_mutex_unlock(&adc.lock);
+
+	for (uint16_t i = 0; i < len; i++)
+		buf[i] = (i % 2) ? (v & 0xff) : (v >> 8);
+
+	return 0;
+}
+
+
+void sim_adc_set_input(unsigned int ain, int mv)
+{
+	pthread_mutex_lock(&adc.lock);
+	adc.ain_mv[ain & 3] = mv;
+	pthread_mutex_unlock(&adc.lock);
+}
+
+
+void sim_adc_nack(unsigned long n)
+{
+	pthread_mutex_lock(&adc.lock);
+	adc.nack = n;
+	pthread_mutex_unlock(&adc.lock);
+}
+
+
+unsigned long sim_adc_conversions(void)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&adc.lock);
+	n = adc.conversions;
+	pthread_mutex_unlock(&adc.lock);
+
+	return n;
+}
@@ -0,0 +1,406 @@
+/*
+ * CUBES host simulator: stand-ins for the MSS I2C, UART, GPIO and NVM drivers
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * The drivers keep the API of the Libero-generated ones, but transfers go
+ * straight to the device models in sim_devices.c (I2C0, UART0) or to the
+ * simulated OBC (I2C1 slave), without any register-level emulation. I2C0
+ * master transfers stay in progress for as long as they would take on the
+ * bus at the configured SCL rate.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "drivers/mss_i2c/mss_i2c.h"
+#include "drivers/mss_uart/mss_uart.h"
+#include "drivers/mss_gpio/mss_gpio.h"
+#include "drivers/mss_nvm/mss_nvm.h"
+#include "drivers_config/sys_config/sys_config_mss_clocks.h"
+
+#include "sim_hw.h"
+
+mss_i2c_instance_t g_mss_i2c0;
+mss_i2c_instance_t g_mss_i2c1;
+mss_uart_instance_t g_mss_uart0;
+mss_uart_instance_t g_mss_uart1;
+
+static uint64_t i2c1_isr_ns = 0;
+
+/* I2C0 master: SCL period and the transfer in progress */
+static uint64_t i2c0_bit_ns = 0;
+static uint64_t i2c0_done_ns = 0;
+static mss_i2c_status_t i2c0_result = MSS_I2C_SUCCESS;
+static struct sim_i2c0_stats i2c0_stats;
+
+/* UART0 RX FIFO, filled by the device models and emptied by the RX handler */
+#define UART_FIFO_LEN  (256)
+
+static uint8_t uart0_fifo[UART_FIFO_LEN];
+static size_t uart0_fifo_rd = 0;
+static size_t uart0_fifo_wr = 0;
+static pthread_mutex_t uart0_fifo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * I2C
+ * -----------------------------------------------------------------------------
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void MSS_I2C_init(mss_i2c_instance_t *this_i2c, uint8_t ser_address,
+                  mss_i2c_clock_divider_t ser_clock_speed)
+{
+	/* BCLK is taken to run at PCLK */
+	static const uint16_t divider[8] = { 256, 224, 192, 160, 960, 120, 60, 8 };
+
+	memset(this_i2c, 0, sizeof(*this_i2c));
+	this_i2c->ser_address = ser_address;
+	this_i2c->irqn = (this_i2c == &g_mss_i2c0) ? I2C0_IRQn : I2C1_IRQn;
+	this_i2c->master_status = MSS_I2C_SUCCESS;
+	if (this_i2c == &g_mss_i2c0)
+		i2c0_bit_ns = 1000000000ull * divider[ser_clock_speed & 7] /
+		              MSS_SYS_APB_0_CLK_FREQ;
+}
+
+
+/*
+ * Account for an I2C0 transfer of `bits` SCL periods and leave it in progress
+ * until the bus would have finished it. The devices act on it right away.
+ */
+static void i2c0_start(mss_i2c_instance_t *this_i2c, unsigned int bits,
+                       int nack)
+{
+	uint64_t now = now_ns();
+
+	if (this_i2c != &g_mss_i2c0) {
+		this_i2c->master_status = MSS_I2C_FAILED;
+		return;
+	}
+
+	i2c0_done_ns = now + bits * i2c0_bit_ns;
+	i2c0_result = nack ? MSS_I2C_FAILED : MSS_I2C_SUCCESS;
+	this_i2c->master_status = MSS_I2C_IN_PROGRESS;
+
+	i2c0_stats.transfers++;
+	i2c0_stats.nacks += nack;
+	i2c0_stats.bus_ns += bits * i2c0_bit_ns;
+}
+
+
+/* START, address, `len` bytes (if acknowledged), STOP */
+#define I2C_BITS(len)  (1 + 9 * (1 + (len)) + 1)
+
+void MSS_I2C_write(mss_i2c_instance_t *this_i2c, uint8_t serial_addr,
+                   const uint8_t *write_buffer, uint16_t write_size,
+                   uint8_t options)
+{
+	int nack = !!sim_i2c0_dev_write(serial_addr, write_buffer, write_size);
+
+	i2c0_start(this_i2c, I2C_BITS(nack ? 0 : write_size), nack);
+}
+
+
+void MSS_I2C_read(mss_i2c_instance_t *this_i2c, uint8_t serial_addr,
+                  uint8_t *read_buffer, uint16_t read_size, uint8_t options)
+{
+	int nack = !!sim_i2c0_dev_read(serial_addr, read_buffer, read_size);
+
+	i2c0_start(this_i2c, I2C_BITS(nack ? 0 : read_size), nack);
+}
+
+
+/* The read after a repeated START replaces the first STOP */
+void MSS_I2C_write_read(mss_i2c_instance_t *this_i2c, uint8_t serial_addr,
+                        const uint8_t *addr_offset, uint16_t offset_size,
+                        uint8_t *read_buffer, uint16_t read_size,
+                        uint8_t options)
+{
+	int nack = !!sim_i2c0_dev_write(serial_addr, addr_offset, offset_size);
+	unsigned int bits = I2C_BITS(nack ? 0 : offset_size);
+
+	if (!nack) {
+		nack = !!sim_i2c0_dev_read(serial_addr, read_buffer, read_size);
+		bits += I2C_BITS(nack ? 0 : read_size) - 1;
+	}
+
+	i2c0_start(this_i2c, bits, nack);
+}
+
+
+mss_i2c_status_t MSS_I2C_get_status(mss_i2c_instance_t *this_i2c)
+{
+	if ((this_i2c->master_status == MSS_I2C_IN_PROGRESS) &&
+			(now_ns() >= i2c0_done_ns))
+		this_i2c->master_status = i2c0_result;
+
+	return this_i2c->master_status;
+}
+
+
+mss_i2c_status_t MSS_I2C_wait_complete(mss_i2c_instance_t *this_i2c,
+                                       uint32_t timeout_ms)
+{
+	uint64_t end = now_ns() + timeout_ms * 1000000ull;
+
+	while (MSS_I2C_get_status(this_i2c) == MSS_I2C_IN_PROGRESS) {
+		if ((timeout_ms != MSS_I2C_NO_TIMEOUT) && (now_ns() >= end)) {
+			this_i2c->master_status = MSS_I2C_TIMED_OUT;
+			break;
+		}
+	}
+
+	return this_i2c->master_status;
+}
+
+
+void MSS_I2C_set_slave_tx_buffer(mss_i2c_instance_t *this_i2c,
+                                 const uint8_t *tx_buffer, uint16_t tx_size)
+{
+	this_i2c->slave_tx_buffer = tx_buffer;
+	this_i2c->slave_tx_size = tx_size;
+}
+
+
+void MSS_I2C_set_slave_rx_buffer(mss_i2c_instance_t *this_i2c,
+                                 uint8_t *rx_buffer, uint16_t rx_size)
+{
+	this_i2c->slave_rx_buffer = rx_buffer;
+	this_i2c->slave_rx_size = rx_size;
+}
+
+
+void MSS_I2C_register_write_handler(mss_i2c_instance_t *this_i2c,
+                                    mss_i2c_slave_wr_handler_t handler)
+{
+	this_i2c->slave_write_handler = handler;
+}
+
+
+void MSS_I2C_enable_slave(mss_i2c_instance_t *this_i2c)
+{
+	this_i2c->is_slave_enabled = 1;
+}
+
+
+void MSS_I2C_disable_slave(mss_i2c_instance_t *this_i2c)
+{
+	this_i2c->is_slave_enabled = 0;
+}
+
+
+void MSS_I2C_set_gca(mss_i2c_instance_t *this_i2c)
+{
+}
+
+
+void MSS_I2C_clear_gca(mss_i2c_instance_t *this_i2c)
+{
+}
+
+
+int sim_i2c1_slave_enabled(void)
+{
+	return __atomic_load_n(&g_mss_i2c1.is_slave_enabled, __ATOMIC_ACQUIRE) &&
+	       (g_mss_i2c1.slave_write_handler != NULL);
+}
+
+
+int sim_i2c1_master_write(const uint8_t *buf, uint16_t len)
+{
+	mss_i2c_instance_t *i2c = &g_mss_i2c1;
+	struct timespec t0, t1;
+
+	if (!sim_i2c1_slave_enabled() || (len > i2c->slave_rx_size))
+		return -1;
+
+	sim_irq_lock();
+	memcpy(i2c->slave_rx_buffer, buf, len);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+	i2c->slave_write_handler(i2c, i2c->slave_rx_buffer, len);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	sim_irq_unlock();
+
+	i2c1_isr_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ull +
+	               (t1.tv_nsec - t0.tv_nsec);
+
+	return 0;
+}
+
+
+uint16_t sim_i2c1_master_read(uint8_t *buf, uint16_t len)
+{
+	mss_i2c_instance_t *i2c = &g_mss_i2c1;
+
+	if (len > i2c->slave_tx_size)
+		len = i2c->slave_tx_size;
+
+	sim_irq_lock();
+	memcpy(buf, i2c->slave_tx_buffer, len);
+	sim_irq_unlock();
+
+	return len;
+}
+
+
+uint64_t sim_i2c1_isr_time_ns(void)
+{
+	return i2c1_isr_ns;
+}
+
+
+void sim_i2c0_get_stats(struct sim_i2c0_stats *s)
+{
+	*s = i2c0_stats;
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * UART
+ * -----------------------------------------------------------------------------
+ */
+void MSS_UART_init(mss_uart_instance_t *this_uart, uint32_t baud_rate,
+                   uint8_t line_config)
+{
+	memset(this_uart, 0, sizeof(*this_uart));
+	this_uart->irqn = (this_uart == &g_mss_uart0) ? UART0_IRQn : UART1_IRQn;
+	this_uart->baudrate = baud_rate;
+	this_uart->lineconfig = line_config;
+}
+
+
+void MSS_UART_set_rx_handler(mss_uart_instance_t *this_uart,
+                             mss_uart_irq_handler_t handler,
+                             mss_uart_rx_trig_level_t trigger_level)
+{
+	this_uart->rx_handler = handler;
+}
+
+
+void MSS_UART_polled_tx(mss_uart_instance_t *this_uart, const uint8_t *pbuff,
+                        uint32_t tx_size)
+{
+	if (this_uart == &g_mss_uart0)
+		sim_hvps_uart_tx(pbuff, tx_size);
+}
+
+
+/* The transfer is done by the time the call returns */
+void MSS_UART_irq_tx(mss_uart_instance_t *this_uart, const uint8_t *pbuff,
+                     uint32_t tx_size)
+{
+	MSS_UART_polled_tx(this_uart, pbuff, tx_size);
+}
+
+
+size_t MSS_UART_get_rx(mss_uart_instance_t *this_uart, uint8_t *rx_buff,
+                       size_t buff_size)
+{
+	size_t n = 0;
+
+	if (this_uart != &g_mss_uart0)
+		return 0;
+
+	pthread_mutex_lock(&uart0_fifo_lock);
+	while ((n < buff_size) && (uart0_fifo_rd != uart0_fifo_wr)) {
+		rx_buff[n++] = uart0_fifo[uart0_fifo_rd];
+		uart0_fifo_rd = (uart0_fifo_rd + 1) % UART_FIFO_LEN;
+	}
+	pthread_mutex_unlock(&uart0_fifo_lock);
+
+	return n;
+}
+
+
+void sim_uart0_rx_push(const uint8_t *buf, size_t len)
+{
+	pthread_mutex_lock(&uart0_fifo_lock);
+	for (size_t i = 0; i < len; i++) {
+		size_t next = (uart0_fifo_wr + 1) % UART_FIFO_LEN;
+		if (next == uart0_fifo_rd)
+			break;   /* overrun, as the hardware FIFO would */
+		uart0_fifo[uart0_fifo_wr] = buf[i];
+		uart0_fifo_wr = next;
+	}
+	pthread_mutex_unlock(&uart0_fifo_lock);
+}
+
+
+void sim_uart0_irq(void)
+{
+	int pending;
+
+	pthread_mutex_lock(&uart0_fifo_lock);
+	pending = (uart0_fifo_rd != uart0_fifo_wr);
+	pthread_mutex_unlock(&uart0_fifo_lock);
+
+	if (pending && g_mss_uart0.rx_handler)
+		g_mss_uart0.rx_handler(&g_mss_uart0);
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * GPIO
+ * -----------------------------------------------------------------------------
+ */
+void MSS_GPIO_init(void)
+{
+}
+
+
+void MSS_GPIO_config(mss_gpio_id_t port_id, uint32_t config)
+{
+}
+
+
+/*
+ * -----------------------------------------------------------------------------
+ * eNVM
+ * -----------------------------------------------------------------------------
+ */
+nvm_status_t NVM_write(uint32_t start_addr, const uint8_t *pidata,
+                       uint32_t length, uint32_t lock_page)
+{
+	memcpy((void *)(uintptr_t)start_addr, pidata, length);
+	return NVM_SUCCESS;
+}
+
+
+nvm_status_t NVM_unlock(uint32_t start_addr, uint32_t length)
+{
+	return NVM_SUCCESS;
+}
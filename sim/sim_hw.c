@@ -0,0 +1,176 @@
+/*
+ * CUBES host simulator hardware: memory map, core peripherals and interrupts
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "CMSIS/m2sxxx.h"
+#include "drivers_config/sys_config/sys_config_mss_clocks.h"
+#include "drivers/cubes_timekeeping/cubes_timekeeping.h"
+
+#include "sim_hw.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* Address ranges accessed by the firmware through pointers */
+static const struct {
+	uintptr_t base;
+	size_t size;
+} sim_regions[] = {
+	{ 0x20000000, 0x00010000 },   /* eSRAM                                */
+	{ 0x40000000, 0x04000000 },   /* MSS peripherals and bit-band alias   */
+	{ 0x50000000, 0x00040000 },   /* Fabric: timekeeping, Citiroc, RAMs   */
+	{ 0x60000000, 0x00100000 },   /* eNVM                                 */
+};
+
+uint32_t SystemCoreClock = MSS_SYS_M3_CLK_FREQ;
+
+SysTick_Type sim_systick;
+CoreDebug_Type sim_coredebug;
+static DWT_Type sim_dwt_regs;
+
+static pthread_mutex_t irq_lock;
+static pthread_t irq_thread;
+static volatile int irq_thread_run = 0;
+static unsigned long irq_timer_ms;
+
+extern void Timer1_IRQHandler(void);
+
+
+int sim_hw_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	for (size_t i = 0; i < sizeof(sim_regions)/sizeof(sim_regions[0]); i++) {
+		void *p = mmap((void *)sim_regions[i].base, sim_regions[i].size,
+		               PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+		               -1, 0);
+		if (p != (void *)sim_regions[i].base) {
+			fprintf(stderr, "sim: cannot map 0x%08lx\n",
+			        (unsigned long)sim_regions[i].base);
+			return -1;
+		}
+	}
+
+	/* ISRs may mask interrupts themselves, hence recursive */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&irq_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return 0;
+}
+
+
+void sim_irq_lock(void)
+{
+	pthread_mutex_lock(&irq_lock);
+}
+
+
+void sim_irq_unlock(void)
+{
+	pthread_mutex_unlock(&irq_lock);
+}
+
+
+DWT_Type *sim_dwt(void)
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	sim_dwt_regs.CYCCNT = (uint32_t)(ns * (SystemCoreClock / 1000000) / 1000);
+
+	return &sim_dwt_regs;
+}
+
+
+/*
+ * The delays are only used for LED blinking and settling times, which do not
+ * matter on the host.
+ */
+void timer_delay_init(void)
+{
+}
+
+
+void timer_delay(uint32_t ms)
+{
+	(void)ms;
+}
+
+
+static void *irq_thread_fn(void *arg)
+{
+	struct timespec tick = { 0, 100000 };   /* 100 us */
+	unsigned long ticks = 0;
+
+	while (irq_thread_run) {
+		nanosleep(&tick, NULL);
+		ticks++;
+
+		sim_irq_lock();
+		sim_hvps_poll();
+		sim_uart0_irq();
+		if (irq_timer_ms && (ticks >= irq_timer_ms * 10)) {
+			/* The gateware CUBES time counts along with the HK timer */
+			cubes_set_time(cubes_get_time() + 1);
+			Timer1_IRQHandler();
+			ticks = 0;
+		}
+		sim_irq_unlock();
+	}
+
+	return NULL;
+}
+
+
+int sim_irq_start(unsigned long timer_ms)
+{
+	irq_timer_ms = timer_ms;
+	irq_thread_run = 1;
+	if (pthread_create(&irq_thread, NULL, irq_thread_fn, NULL)) {
+		irq_thread_run = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+void sim_irq_stop(void)
+{
+	if (irq_thread_run) {
+		irq_thread_run = 0;
+		pthread_join(irq_thread, NULL);
+	}
+}
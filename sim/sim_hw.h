@@ -0,0 +1,222 @@
+/*
+ * CUBES host simulator hardware exported functions header
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SIM_HW_H_
+#define SIM_HW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * -----------------------------------------------------------------------------
+ * Memory map and interrupts (sim_hw.c)
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Map the MSS peripheral, fabric and eNVM address ranges in the host
+ *        process, so that the firmware can access them at their usual address
+ *
+ * @return 0 on success, -1 if an address range could not be mapped
+ */
+int sim_hw_init(void);
+
+/**
+ * @brief Start the interrupt thread
+ *
+ * The interrupt thread calls Timer1_IRQHandler() every `timer_ms`
+ * milliseconds and delivers UART0 data from the HVPS emulator to the
+ * registered RX handler. All simulated ISRs, including the I2C1 slave write
+ * handler, run with the interrupt lock held, so they never preempt each
+ * other; the firmware main loop runs in its own thread and is preempted by
+ * them.
+ *
+ * @param timer_ms Timer1 period, in milliseconds
+ * @return 0 on success, -1 otherwise
+ */
+int sim_irq_start(unsigned long timer_ms);
+
+/**
+ * @brief Stop the interrupt thread
+ */
+void sim_irq_stop(void);
+
+/*
+ * -----------------------------------------------------------------------------
+ * MSS driver stand-ins (sim_drivers.c)
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Check whether the firmware has enabled the I2C1 (MSP) slave
+ */
+int sim_i2c1_slave_enabled(void);
+
+/**
+ * @brief Write an I2C frame from the OBC to the I2C1 slave
+ *
+ * Runs the firmware's slave write handler, as the I2C1 ISR would.
+ *
+ * @param buf Frame to write
+ * @param len Length of the frame
+ * @return 0 on success, -1 if the slave is not enabled or the frame does not
+ *         fit in its RX buffer
+ */
+int sim_i2c1_master_write(const uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Read the I2C1 slave TX buffer, as the OBC would after a write
+ *
+ * @param buf Destination buffer
+ * @param len Number of bytes to read
+ * @return Number of bytes read, at most the size of the slave TX buffer
+ */
+uint16_t sim_i2c1_master_read(uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Get the CPU time spent in the I2C1 slave write handler so far
+ *
+ * @return Thread CPU time, in nanoseconds
+ */
+uint64_t sim_i2c1_isr_time_ns(void);
+
+/**
+ * @brief I2C0 master bus statistics
+ */
+struct sim_i2c0_stats {
+	unsigned long transfers;
+	unsigned long nacks;            /* Transfers not acknowledged by the device */
+	uint64_t bus_ns;                /* Time the transfers took on the bus */
+};
+
+/**
+ * @brief Get the I2C0 master bus statistics
+ */
+void sim_i2c0_get_stats(struct sim_i2c0_stats *s);
+
+/**
+ * @brief Queue data from a device on UART0, to be delivered to the firmware
+ *        by the interrupt thread
+ */
+void sim_uart0_rx_push(const uint8_t *buf, size_t len);
+
+/**
+ * @brief Deliver queued UART0 data to the registered RX handler, if any
+ *
+ * Called by the interrupt thread, with the interrupt lock held.
+ */
+void sim_uart0_irq(void);
+
+/*
+ * -----------------------------------------------------------------------------
+ * Device models (sim_devices.c)
+ * -----------------------------------------------------------------------------
+ */
+
+/**
+ * @brief HVPS emulator statistics
+ */
+struct sim_hvps_stats {
+	unsigned long cmds;             /* Frames received */
+	unsigned long replies;          /* Replies sent, including `hxx` */
+	unsigned long errors;           /* `hxx` replies */
+	unsigned long dropped;          /* Replies withheld by sim_hvps_drop_replies() */
+	unsigned long corrupted;        /* Replies sent with a broken checksum */
+	uint64_t latency_ns;            /* Sum of command start to reply end times */
+	uint64_t latency_max_ns;
+};
+
+/**
+ * @brief Data sent by the firmware to the HVPS on UART0
+ *
+ * The reply, if any, is queued with the time each byte is due on the line.
+ */
+void sim_hvps_uart_tx(const uint8_t *buf, size_t len);
+
+/**
+ * @brief Deliver the HVPS reply bytes that are due to the UART0 RX FIFO
+ *
+ * Called by the interrupt thread, before sim_uart0_irq().
+ */
+void sim_hvps_poll(void);
+
+/**
+ * @brief Set the HVPS response delay, from the end of a command to the start
+ *        of its reply
+ */
+void sim_hvps_set_delay(unsigned long us);
+
+/**
+ * @brief Have the HVPS ignore the next `n` commands, to force timeouts
+ */
+void sim_hvps_drop_replies(unsigned long n);
+
+/**
+ * @brief Break the checksum of every `n`-th HVPS reply; 0 to stop
+ */
+void sim_hvps_corrupt_every(unsigned long n);
+
+/**
+ * @brief Have the HVPS answer the next command with `hxx` and error `code`
+ */
+void sim_hvps_inject_error(unsigned int code);
+
+/**
+ * @brief Get the HVPS emulator statistics
+ */
+void sim_hvps_get_stats(struct sim_hvps_stats *s);
+
+/**
+ * @brief I2C0 master write from the firmware to a device
+ *
+ * @return 0 if the device acknowledged the transfer, -1 otherwise
+ */
+int sim_i2c0_dev_write(uint8_t addr, const uint8_t *buf, uint16_t len);
+
+/**
+ * @brief I2C0 master read by the firmware from a device
+ *
+ * @return 0 if the device acknowledged the transfer, -1 otherwise
+ */
+int sim_i2c0_dev_read(uint8_t addr, uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Set the voltage on an ADS1015 input
+ *
+ * @param ain Input, 0 to 3
+ * @param mv  Voltage, in millivolts
+ */
+void sim_adc_set_input(unsigned int ain, int mv);
+
+/**
+ * @brief Have the ADS1015 NACK the next `n` transfers
+ */
+void sim_adc_nack(unsigned long n);
+
+/**
+ * @brief Get the number of single-shot conversions the ADS1015 has started
+ */
+unsigned long sim_adc_conversions(void);
+
+#endif /* SIM_HW_H_ */
@@ -0,0 +1,124 @@
+/*
+ * CUBES MSP command queue functions
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "CMSIS/m2sxxx.h"
+#include "cmd_queue.h"
+
+
+static struct cmd_queue_entry entries[CMD_QUEUE_LEN];
+
+/*
+ * Free-running counters: the tail is only written by the producer and the head
+ * only by the consumer. The queue holds (tail - head) entries.
+ */
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+
+static struct cmd_queue_stats stats;
+
+
+void cmd_queue_init(void)
+{
+	head = 0;
+	tail = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+
+uint8_t *cmd_queue_tail_data(void)
+{
+	if (tail - head >= CMD_QUEUE_LEN)
+		return NULL;
+
+	return entries[tail % CMD_QUEUE_LEN].data;
+}
+
+
+int cmd_queue_push(uint8_t opcode, uint16_t len, uint8_t flags, uint32_t time)
+{
+	struct cmd_queue_entry *e;
+	uint32_t depth = tail - head;
+
+	if (depth >= CMD_QUEUE_LEN) {
+		stats.overflows++;
+		return 1;
+	}
+
+	e = &entries[tail % CMD_QUEUE_LEN];
+	e->time = time;
+	e->len = len;
+	e->opcode = opcode;
+	e->flags = flags;
+
+	/* The entry must be complete before the main loop can see it */
+	__DMB();
+	tail++;
+
+	stats.queued++;
+	if (depth + 1 > stats.high_water)
+		stats.high_water = depth + 1;
+
+	return 0;
+}
+
+
+void cmd_queue_drop(void)
+{
+	stats.overflows++;
+}
+
+
+struct cmd_queue_entry *cmd_queue_peek(void)
+{
+	if (head == tail)
+		return NULL;
+
+	/* Do not read the entry before having seen the new tail */
+	__DMB();
+	return &entries[head % CMD_QUEUE_LEN];
+}
+
+
+void cmd_queue_pop(uint32_t time)
+{
+	uint32_t wait = time - entries[head % CMD_QUEUE_LEN].time;
+
+	if (wait > stats.max_wait)
+		stats.max_wait = wait;
+
+	/* Done with the entry before the ISR may reuse it */
+	__DMB();
+	head++;
+}
+
+
+void cmd_queue_get_stats(struct cmd_queue_stats *s)
+{
+	*s = stats;
+}
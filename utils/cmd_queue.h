@@ -0,0 +1,125 @@
+/*
+ * CUBES MSP command queue exported functions header
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#ifndef UTILS_CMD_QUEUE_H_
+#define UTILS_CMD_QUEUE_H_
+
+#include <stdint.h>
+
+/*
+ * Queue of MSP commands, from the MSP callbacks (in the I2C ISR) to the main
+ * loop. It is a single-producer, single-consumer ring: the ISR is the only one
+ * to push commands and the main loop the only one to pop them, so no locking
+ * is needed, only ordering of the memory accesses.
+ *
+ * The data of a SEND command is received straight into the entry at the tail
+ * of the queue (see `cmd_queue_tail_data()`), which only becomes visible to
+ * the main loop once pushed. Commands that arrive while the queue is full are
+ * dropped and counted as overflows.
+ */
+#define CMD_QUEUE_LEN           (8)      // must be a power of two
+#define CMD_QUEUE_DATA_LEN      (256)    // largest SEND data, i.e. a batch
+
+/* Entry flags */
+#define CMD_QUEUE_STREAMED      (0x01)   // data was streamed to a receive sink
+
+struct cmd_queue_entry {
+	uint32_t time;       // time the command was queued, in clock cycles
+	uint16_t len;        // data length
+	uint8_t opcode;
+	uint8_t flags;
+	uint8_t data[CMD_QUEUE_DATA_LEN];
+};
+
+struct cmd_queue_stats {
+	uint32_t queued;     // commands queued since power-up
+	uint32_t overflows;  // commands dropped because the queue was full
+	uint32_t max_wait;   // longest time a command was queued, in clock cycles
+	uint8_t high_water;  // most commands queued at once
+};
+
+/**
+ * @brief Empty the queue and clear its statistics
+ */
+void cmd_queue_init(void);
+
+/**
+ * @brief Get the data buffer of the entry at the tail of the queue
+ *
+ * Producer side. The buffer can be filled in before the command is pushed.
+ *
+ * @return Pointer to CMD_QUEUE_DATA_LEN bytes, or NULL if the queue is full
+ */
+uint8_t *cmd_queue_tail_data(void);
+
+/**
+ * @brief Push a command onto the queue
+ *
+ * Producer side. Its data, if any, must already be in `cmd_queue_tail_data()`.
+ *
+ * @param opcode MSP opcode of the command
+ * @param len    Data length
+ * @param flags  CMD_QUEUE_ flags
+ * @param time   Current time, in clock cycles
+ * @return 0 if the command was queued, 1 if the queue is full
+ */
+int cmd_queue_push(uint8_t opcode, uint16_t len, uint8_t flags, uint32_t time);
+
+/**
+ * @brief Count a command dropped without being pushed, as an overflow
+ *
+ * Producer side, for a command whose data could not be received into the
+ * queue because it was full at the time.
+ */
+void cmd_queue_drop(void);
+
+/**
+ * @brief Get the command at the head of the queue, without removing it
+ *
+ * Consumer side.
+ *
+ * @return The oldest queued command, or NULL if the queue is empty
+ */
+struct cmd_queue_entry *cmd_queue_peek(void);
+
+/**
+ * @brief Remove the command at the head of the queue
+ *
+ * Consumer side, once done with the entry from `cmd_queue_peek()`.
+ *
+ * @param time Current time, in clock cycles
+ */
+void cmd_queue_pop(uint32_t time);
+
+/**
+ * @brief Get the queue statistics
+ *
+ * @param stats Destination
+ */
+void cmd_queue_get_stats(struct cmd_queue_stats *stats);
+
+
+#endif /* UTILS_CMD_QUEUE_H_ */
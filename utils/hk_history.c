@@ -0,0 +1,185 @@
+/*
+ * CUBES HK history functions
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "CMSIS/m2sxxx.h"
+#include "../msp/msp_endian.h"
+#include "hk_history.h"
+
+
+/*
+ * Records are kept serialized, so that a download is a plain copy. The ring
+ * holds num_recs records, the oldest one being just before next_rec.
+ */
+static uint8_t records[HK_HISTORY_RECORDS][HK_HISTORY_REC_LEN];
+static unsigned int next_rec = 0;
+static unsigned int num_recs = 0;
+
+static unsigned int depth = HK_HISTORY_RECORDS;
+static unsigned int decimation = 1;
+static unsigned int skip = 0;
+static uint32_t since = 0;
+
+static uint32_t overwritten = 0;
+static uint32_t missed = 0;
+
+/* Records being downloaded, from the ring slot frozen_first on */
+static unsigned int frozen = 0;
+static unsigned int frozen_first;
+static unsigned int frozen_num;
+static uint8_t hdr[HK_HISTORY_HDR_LEN];
+
+
+static uint32_t rec_time(unsigned int slot)
+{
+	return msp_from_bigendian32(records[slot]);
+}
+
+
+int hk_history_configure(unsigned int new_depth, unsigned int new_decimation)
+{
+	int ret = 1;
+
+	if ((new_depth < 1) || (new_depth > HK_HISTORY_RECORDS) ||
+			(new_decimation < 1))
+		return 1;
+
+	__disable_irq();
+	if (!frozen) {
+		depth = new_depth;
+		decimation = new_decimation;
+		skip = 0;
+		next_rec = 0;
+		num_recs = 0;
+		overwritten = 0;
+		missed = 0;
+		ret = 0;
+	}
+	__enable_irq();
+
+	return ret;
+}
+
+
+void hk_history_set_since(uint32_t time)
+{
+	since = time;
+}
+
+
+void hk_history_add(const uint8_t *rec)
+{
+	unsigned int oldest;
+
+	if (skip > 0) {
+		skip--;
+		return;
+	}
+	skip = decimation - 1;
+
+	/*
+	 * The MSP callbacks freeze and read the ring from the I2C ISR, so the ring
+	 * is only updated with interrupts masked; this is a single record copy.
+	 */
+	__disable_irq();
+	if (num_recs == depth) {
+		oldest = next_rec;
+		if (frozen && (frozen_num > 0) && (oldest == frozen_first)) {
+			missed++;
+			__enable_irq();
+			return;
+		}
+		if (rec_time(oldest) >= since)
+			overwritten++;
+	} else {
+		num_recs++;
+	}
+
+	memcpy(records[next_rec], rec, HK_HISTORY_REC_LEN);
+	next_rec = (next_rec + 1) % depth;
+	__enable_irq();
+}
+
+
+unsigned long hk_history_freeze(void)
+{
+	frozen = 1;
+
+	/* Skip the records older than the since time */
+	frozen_first = (next_rec + depth - num_recs) % depth;
+	frozen_num = num_recs;
+	while ((frozen_num > 0) && (rec_time(frozen_first) < since)) {
+		frozen_first = (frozen_first + 1) % depth;
+		frozen_num--;
+	}
+
+	hdr[0] = HK_HISTORY_VERSION;
+	hdr[1] = HK_HISTORY_REC_LEN;
+	hdr[2] = (frozen_num >> 8) & 0xff;
+	hdr[3] = frozen_num & 0xff;
+	msp_to_bigendian32(hdr + 4, overwritten);
+	msp_to_bigendian32(hdr + 8, missed);
+
+	return HK_HISTORY_HDR_LEN + frozen_num * HK_HISTORY_REC_LEN;
+}
+
+
+void hk_history_read(uint8_t *buf, unsigned long offset, unsigned long len)
+{
+	unsigned long rec, pos, n;
+
+	for (; (len > 0) && (offset < HK_HISTORY_HDR_LEN); len--)
+		*buf++ = hdr[offset++];
+
+	/* Copy the rest record by record, oldest first */
+	offset -= HK_HISTORY_HDR_LEN;
+	while (len > 0) {
+		rec = offset / HK_HISTORY_REC_LEN;
+		pos = offset % HK_HISTORY_REC_LEN;
+		if (rec >= frozen_num)
+			break;
+		n = HK_HISTORY_REC_LEN - pos;
+		if (n > len)
+			n = len;
+		memcpy(buf, records[(frozen_first + rec) % depth] + pos, n);
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+
+void hk_history_release(int downloaded)
+{
+	if (downloaded && (frozen_num > 0)) {
+		since = rec_time((frozen_first + frozen_num - 1) % depth) + 1;
+		overwritten = 0;
+		missed = 0;
+	}
+	frozen = 0;
+}
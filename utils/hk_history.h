@@ -0,0 +1,119 @@
+/*
+ * CUBES HK history exported functions header
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#ifndef UTILS_HK_HISTORY_H_
+#define UTILS_HK_HISTORY_H_
+
+#include <stdint.h>
+
+/*
+ * History of the HK packets, so that the OBC can get a time series without
+ * polling REQ_HK every second. HK packets are appended to a ring buffer in
+ * eSRAM, one out of every `decimation` packets, where the oldest records get
+ * overwritten once `depth` records are held.
+ *
+ * The history is downloaded via MSP_OP_REQ_CUBES_HK_HISTORY. Only the records
+ * from the "since" time on are sent. Once a download completes, the since
+ * time moves past the last record sent, so that the next download only holds
+ * new records.
+ */
+#define HK_HISTORY_RECORDS      (256)
+#define HK_HISTORY_REC_LEN      (50)
+
+/*
+ * Serialized history, as sent to the OBC. All multi-byte values are big-endian:
+ *   byte   0       : format version (HK_HISTORY_VERSION)
+ *   byte   1       : record length (HK_HISTORY_REC_LEN)
+ *   bytes  2..3    : number N of records
+ *   bytes  4..7    : records overwritten before they could be downloaded
+ *   bytes  8..11   : HK packets not recorded because the record they would
+ *                    have overwritten was being downloaded
+ *   bytes 12..     : N records, oldest first
+ *
+ * A record is a full HK packet, as sent for REQ_HK with all fields selected;
+ * its first four bytes are the CUBES time.
+ */
+#define HK_HISTORY_VERSION      (2)
+#define HK_HISTORY_HDR_LEN      (12)
+#define HK_HISTORY_MAX_LEN      (HK_HISTORY_HDR_LEN + \
+                                 HK_HISTORY_RECORDS*HK_HISTORY_REC_LEN)
+
+/**
+ * @brief Set the depth and decimation of the history, and clear it
+ *
+ * @param depth      Number of records held, 1 to HK_HISTORY_RECORDS
+ * @param decimation One HK packet out of `decimation` is recorded, at least 1
+ *
+ * @return 0 on success, 1 if a parameter is out of range or a download is
+ *         ongoing
+ */
+int hk_history_configure(unsigned int depth, unsigned int decimation);
+
+/**
+ * @brief Set the CUBES time from which the next download starts
+ */
+void hk_history_set_since(uint32_t time);
+
+/**
+ * @brief Record an HK packet, unless decimated out
+ *
+ * To be called from the main loop, each time HK is read.
+ *
+ * @param rec HK packet, HK_HISTORY_REC_LEN bytes long
+ */
+void hk_history_add(const uint8_t *rec);
+
+/**
+ * @brief Pick the records to download and hold them in the ring buffer
+ *
+ * To be called from msp_expsend_start(). The records are held until
+ * `hk_history_release()`.
+ *
+ * @return Number of bytes of the serialized history
+ */
+unsigned long hk_history_freeze(void);
+
+/**
+ * @brief Read part of the serialized history
+ *
+ * The history must have been frozen with `hk_history_freeze()`.
+ *
+ * @param buf    Destination buffer
+ * @param offset Offset into the serialized history
+ * @param len    Number of bytes to read
+ */
+void hk_history_read(uint8_t *buf, unsigned long offset, unsigned long len);
+
+/**
+ * @brief Release the records after a download
+ *
+ * @param downloaded Non-zero if the download completed, in which case the
+ *                   since time moves past the last record downloaded
+ */
+void hk_history_release(int downloaded);
+
+
+#endif /* UTILS_HK_HISTORY_H_ */
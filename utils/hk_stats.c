@@ -0,0 +1,179 @@
+/*
+ * CUBES HK statistics functions
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "CMSIS/m2sxxx.h"
+#include "../msp/msp_endian.h"
+#include "hk_stats.h"
+
+
+struct hk_stats_ch {
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	unsigned long n;
+	uint16_t out_of_limits;
+	uint32_t low;
+	uint32_t high;
+};
+
+static struct hk_stats_ch chans[HK_STATS_CHANNELS];
+static unsigned long window = HK_STATS_WINDOW_DEFAULT;
+static unsigned long samples = 0;
+static uint32_t start_time;
+static unsigned int limits_set = 0;
+
+/*
+ * Statistics of the last complete window. Like the HK packet in main.c, the
+ * main loop writes the buffer not being served and then increments the
+ * sequence counter, whose lowest bit selects the latest complete packet.
+ */
+static uint8_t packet[2][HK_STATS_LEN];
+static volatile uint32_t packet_seq = 0;
+
+
+static void put_value(uint8_t **p, uint32_t val, int is_32bit)
+{
+	if (is_32bit) {
+		msp_to_bigendian32(*p, val);
+		*p += 4;
+	} else {
+		(*p)[0] = (val >> 8) & 0xff;
+		(*p)[1] = val & 0xff;
+		*p += 2;
+	}
+}
+
+
+static void publish(void)
+{
+	uint8_t *p = packet[(packet_seq + 1) & 1];
+	struct hk_stats_ch *c;
+	unsigned int ch;
+	int is_32bit;
+
+	msp_to_bigendian32(p, start_time);
+	p[4] = (samples >> 8) & 0xff;
+	p[5] = samples & 0xff;
+	p += HK_STATS_HDR_LEN;
+
+	for (ch = 0; ch < HK_STATS_CHANNELS; ch++) {
+		c = &chans[ch];
+		is_32bit = HK_STATS_CH_IS_32BIT(ch);
+		if (c->n == 0) {
+			/* Every sample of the window was skipped */
+			put_value(&p, 0, is_32bit);
+			put_value(&p, 0, is_32bit);
+			put_value(&p, 0, is_32bit);
+		} else {
+			put_value(&p, c->min, is_32bit);
+			put_value(&p, c->max, is_32bit);
+			put_value(&p, (c->sum + c->n/2) / c->n, is_32bit);
+		}
+		put_value(&p, c->out_of_limits, 0);
+	}
+
+	/* The packet must be complete before it is published */
+	__DMB();
+	packet_seq++;
+}
+
+
+int hk_stats_set_window(unsigned long len)
+{
+	if ((len < 1) || (len > 0xffff))
+		return 1;
+
+	window = len;
+	samples = 0;
+
+	return 0;
+}
+
+
+int hk_stats_set_limits(unsigned int ch, uint32_t low, uint32_t high)
+{
+	if (ch >= HK_STATS_CHANNELS)
+		return 1;
+
+	chans[ch].low = low;
+	chans[ch].high = high;
+	limits_set |= (1 << ch);
+
+	return 0;
+}
+
+
+void hk_stats_add(uint32_t time, const uint32_t *vals, unsigned int skip)
+{
+	struct hk_stats_ch *c;
+	unsigned int ch;
+
+	for (ch = 0; ch < HK_STATS_CHANNELS; ch++) {
+		c = &chans[ch];
+		if (samples == 0) {
+			c->sum = 0;
+			c->n = 0;
+			c->out_of_limits = 0;
+		}
+		if (skip & (1 << ch))
+			continue;
+		if ((c->n == 0) || (vals[ch] < c->min))
+			c->min = vals[ch];
+		if ((c->n == 0) || (vals[ch] > c->max))
+			c->max = vals[ch];
+		c->sum += vals[ch];
+		c->n++;
+		if ((limits_set & (1 << ch)) &&
+				((vals[ch] < c->low) || (vals[ch] > c->high)))
+			c->out_of_limits++;
+	}
+
+	if (samples == 0)
+		start_time = time;
+
+	if (++samples >= window) {
+		publish();
+		samples = 0;
+	}
+}
+
+
+unsigned long hk_stats_read(uint8_t *dest)
+{
+	uint32_t seq;
+
+	do {
+		seq = packet_seq;
+		__DMB();
+		memcpy(dest, packet[seq & 1], HK_STATS_LEN);
+		__DMB();
+	} while (seq != packet_seq);
+
+	return HK_STATS_LEN;
+}
@@ -0,0 +1,120 @@
+/*
+ * CUBES HK statistics exported functions header
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#ifndef UTILS_HK_STATS_H_
+#define UTILS_HK_STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Statistics of the HK channels over a window of HK samples, so that short
+ * excursions can be seen without polling REQ_HK at a high rate. For each
+ * channel, the minimum, maximum and mean over the window are kept, as well as
+ * the number of samples out of the channel's limits.
+ *
+ * Windows follow each other without overlap. The statistics of the last
+ * complete window are sent via MSP_OP_REQ_CUBES_HK_STATS.
+ */
+#define HK_STATS_CH_HVPS_VOLT   (0)
+#define HK_STATS_CH_HVPS_CURR   (1)
+#define HK_STATS_CH_HVPS_TEMP   (2)
+#define HK_STATS_CH_BATT_VOLT   (3)
+#define HK_STATS_CH_BATT_CURR   (4)
+#define HK_STATS_CH_CITI_TEMP   (5)
+#define HK_STATS_CH_RATE_CH0    (6)   // trigger rates, counts per HK sample
+#define HK_STATS_CH_RATE_CH16   (7)
+#define HK_STATS_CH_RATE_CH31   (8)
+#define HK_STATS_CH_RATE_OR32   (9)
+#define HK_STATS_CHANNELS       (10)
+
+/* Channels before the trigger rates are 16-bit values, the rates 32-bit */
+#define HK_STATS_CH_IS_32BIT(ch)  ((ch) >= HK_STATS_CH_RATE_CH0)
+
+#define HK_STATS_WINDOW_DEFAULT (60)
+
+/*
+ * Serialized statistics, as sent to the OBC. All multi-byte values are
+ * big-endian:
+ *   bytes 0..3 : CUBES time of the first sample of the window
+ *   bytes 4..5 : number of samples in the window; 0 until a window completes
+ *   bytes 6..  : for each channel, in channel order:
+ *                  minimum, maximum and mean, 2 or 4 bytes each (see
+ *                  HK_STATS_CH_IS_32BIT()), 0 if the channel had no valid
+ *                  sample in the window;
+ *                  number of samples out of limits, 2 bytes
+ */
+#define HK_STATS_HDR_LEN        (6)
+#define HK_STATS_LEN            (HK_STATS_HDR_LEN + \
+                                 HK_STATS_CH_RATE_CH0 * (3*2 + 2) + \
+                                 (HK_STATS_CHANNELS - HK_STATS_CH_RATE_CH0) * \
+                                 (3*4 + 2))
+
+/**
+ * @brief Set the number of samples per window, and start a new window
+ *
+ * @param len Window length in samples, 1 to 65535
+ *
+ * @return 0 on success, 1 if the length is out of range
+ */
+int hk_stats_set_window(unsigned long len);
+
+/**
+ * @brief Set the limits of a channel
+ *
+ * Samples lower than `low` or higher than `high` are counted as out of limits.
+ * By default, no sample is out of limits.
+ *
+ * @return 0 on success, 1 if the channel does not exist
+ */
+int hk_stats_set_limits(unsigned int ch, uint32_t low, uint32_t high);
+
+/**
+ * @brief Add an HK sample to the current window
+ *
+ * To be called from the main loop, each time HK is read. When the window is
+ * complete, its statistics are published for `hk_stats_read()`.
+ *
+ * @param time CUBES time of the sample
+ * @param vals Value of each channel, HK_STATS_CHANNELS values
+ * @param skip Mask of the channels without a valid value in this sample,
+ *             bit `ch` for channel `ch`; these are left out of their
+ *             channel's statistics
+ */
+void hk_stats_add(uint32_t time, const uint32_t *vals, unsigned int skip);
+
+/**
+ * @brief Copy the statistics of the last complete window
+ *
+ * May be called from an ISR.
+ *
+ * @param dest Destination buffer, at least HK_STATS_LEN bytes long
+ *
+ * @return HK_STATS_LEN
+ */
+unsigned long hk_stats_read(uint8_t *dest);
+
+
+#endif /* UTILS_HK_STATS_H_ */
@@ -0,0 +1,142 @@
+/*
+ * CUBES MSP traffic capture functions
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "CMSIS/m2sxxx.h"
+#include "CMSIS/system_m2sxxx.h"
+#include "../msp/msp_endian.h"
+#include "msp_capture.h"
+
+
+/* Records are kept serialized, so that a download is a plain copy */
+static uint8_t records[MSP_CAPTURE_RECORDS][MSP_CAPTURE_REC_LEN];
+static unsigned int next_rec = 0;
+static unsigned int num_recs = 0;
+
+static uint32_t overwritten = 0;
+static uint32_t missed = 0;
+static unsigned int frozen = 0;
+static uint8_t hdr[MSP_CAPTURE_HDR_LEN];
+
+
+static void copy_frame(uint8_t *dest, const uint8_t *frame, unsigned long len)
+{
+	if (len > MSP_CAPTURE_FRAME_LEN)
+		len = MSP_CAPTURE_FRAME_LEN;
+	memcpy(dest, frame, len);
+	memset(dest + len, 0, MSP_CAPTURE_FRAME_LEN - len);
+}
+
+
+void msp_capture_frame(uint32_t time, uint32_t isr_time,
+                       const uint8_t *rx, unsigned long rx_len, int rx_ret,
+                       const uint8_t *tx, unsigned long tx_len, int tx_ret)
+{
+	uint8_t *rec;
+
+	if (frozen) {
+		missed++;
+		return;
+	}
+
+	if (isr_time > 0xffff)
+		isr_time = 0xffff;
+
+	rec = records[next_rec];
+	msp_to_bigendian32(rec, time);
+	rec[4] = (rx_len >> 8) & 0xff;
+	rec[5] = rx_len & 0xff;
+	rec[6] = (tx_len >> 8) & 0xff;
+	rec[7] = tx_len & 0xff;
+	rec[8] = (isr_time >> 8) & 0xff;
+	rec[9] = isr_time & 0xff;
+	rec[10] = (uint8_t)rx_ret;
+	rec[11] = (uint8_t)tx_ret;
+	copy_frame(rec + 12, rx, rx_len);
+	copy_frame(rec + 12 + MSP_CAPTURE_FRAME_LEN, tx, tx_len);
+
+	next_rec = (next_rec + 1) % MSP_CAPTURE_RECORDS;
+	if (num_recs < MSP_CAPTURE_RECORDS)
+		num_recs++;
+	else
+		overwritten++;
+}
+
+
+unsigned long msp_capture_freeze(void)
+{
+	frozen = 1;
+
+	hdr[0] = MSP_CAPTURE_VERSION;
+	hdr[1] = MSP_CAPTURE_REC_LEN;
+	hdr[2] = (num_recs >> 8) & 0xff;
+	hdr[3] = num_recs & 0xff;
+	msp_to_bigendian32(hdr + 4, overwritten);
+	msp_to_bigendian32(hdr + 8, missed);
+	msp_to_bigendian32(hdr + 12, SystemCoreClock);
+
+	return MSP_CAPTURE_HDR_LEN + num_recs * MSP_CAPTURE_REC_LEN;
+}
+
+
+void msp_capture_read(uint8_t *buf, unsigned long offset, unsigned long len)
+{
+	unsigned int first = (next_rec + MSP_CAPTURE_RECORDS - num_recs) %
+	                     MSP_CAPTURE_RECORDS;
+	unsigned long rec, pos, n;
+
+	for (; (len > 0) && (offset < MSP_CAPTURE_HDR_LEN); len--)
+		*buf++ = hdr[offset++];
+
+	/* Copy the rest record by record, oldest first */
+	offset -= MSP_CAPTURE_HDR_LEN;
+	while (len > 0) {
+		rec = offset / MSP_CAPTURE_REC_LEN;
+		pos = offset % MSP_CAPTURE_REC_LEN;
+		if (rec >= num_recs)
+			break;
+		n = MSP_CAPTURE_REC_LEN - pos;
+		if (n > len)
+			n = len;
+		memcpy(buf, records[(first + rec) % MSP_CAPTURE_RECORDS] + pos, n);
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+
+void msp_capture_release(int downloaded)
+{
+	if (downloaded) {
+		num_recs = 0;
+		overwritten = 0;
+		missed = 0;
+	}
+	frozen = 0;
+}
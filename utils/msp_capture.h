@@ -0,0 +1,121 @@
+/*
+ * CUBES MSP traffic capture exported functions header
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#ifndef UTILS_MSP_CAPTURE_H_
+#define UTILS_MSP_CAPTURE_H_
+
+#include <stdint.h>
+
+/*
+ * Capture of the MSP traffic, for debugging the link after the fact. Each run
+ * of the MSP I2C slave write handler is recorded in a ring buffer in eSRAM,
+ * where the oldest records get overwritten. A record holds both directions:
+ * the frame received from the OBC and the frame prepared for it to read.
+ *
+ * The capture is downloaded via MSP_OP_REQ_CUBES_MSP_CAPTURE and replayed on
+ * a host with the tool in sim/ (see sim/README.md).
+ *
+ * Frames longer than MSP_CAPTURE_FRAME_LEN bytes are truncated, which keeps
+ * header frames (9 bytes) complete but only the start of data frames.
+ */
+#define MSP_CAPTURE_RECORDS     (128)
+#define MSP_CAPTURE_FRAME_LEN   (10)
+
+/*
+ * Serialized capture, as sent to the OBC. All multi-byte values are big-endian:
+ *   byte   0       : format version (MSP_CAPTURE_VERSION)
+ *   byte   1       : record length (MSP_CAPTURE_REC_LEN)
+ *   bytes  2..3    : number N of records
+ *   bytes  4..7    : records overwritten before they could be downloaded
+ *   bytes  8..11   : frames not recorded because a download was ongoing
+ *   bytes 12..15   : clock frequency of the time stamps, in Hz
+ *   bytes 16..     : N records, oldest first
+ *
+ * Record layout:
+ *   bytes  0..3    : time stamp of the start of the handler, in clock cycles
+ *   bytes  4..5    : number of bytes received from the OBC
+ *   bytes  6..7    : number of bytes prepared for the OBC to read
+ *   bytes  8..9    : time spent in the handler, in clock cycles (saturated)
+ *   byte  10       : return value of msp_recv_callback() (signed)
+ *   byte  11       : return value of msp_send_callback() (signed)
+ *   bytes 12..21   : start of the received frame
+ *   bytes 22..31   : start of the frame prepared for the OBC
+ */
+#define MSP_CAPTURE_VERSION     (1)
+#define MSP_CAPTURE_HDR_LEN     (16)
+#define MSP_CAPTURE_REC_LEN     (12 + 2*MSP_CAPTURE_FRAME_LEN)
+#define MSP_CAPTURE_MAX_LEN     (MSP_CAPTURE_HDR_LEN + \
+                                 MSP_CAPTURE_RECORDS*MSP_CAPTURE_REC_LEN)
+
+/**
+ * @brief Record one run of the MSP I2C slave write handler
+ *
+ * Does nothing while a download is ongoing, see `msp_capture_freeze()`.
+ *
+ * @param time     Time stamp of the start of the handler, in clock cycles
+ * @param isr_time Time spent in the handler, in clock cycles
+ * @param rx       Frame received from the OBC
+ * @param rx_len   Number of bytes received from the OBC
+ * @param rx_ret   Return value of msp_recv_callback()
+ * @param tx       Frame prepared for the OBC to read
+ * @param tx_len   Number of bytes prepared for the OBC to read
+ * @param tx_ret   Return value of msp_send_callback()
+ */
+void msp_capture_frame(uint32_t time, uint32_t isr_time,
+                       const uint8_t *rx, unsigned long rx_len, int rx_ret,
+                       const uint8_t *tx, unsigned long tx_len, int tx_ret);
+
+/**
+ * @brief Stop recording, so that the capture can be downloaded
+ *
+ * To be called from msp_expsend_start(). Recording resumes with
+ * `msp_capture_release()`.
+ *
+ * @return Number of bytes of the serialized capture
+ */
+unsigned long msp_capture_freeze(void);
+
+/**
+ * @brief Read part of the serialized capture
+ *
+ * The capture must have been frozen with `msp_capture_freeze()`.
+ *
+ * @param buf    Destination buffer
+ * @param offset Offset into the serialized capture
+ * @param len    Number of bytes to read
+ */
+void msp_capture_read(uint8_t *buf, unsigned long offset, unsigned long len);
+
+/**
+ * @brief Resume recording after a download
+ *
+ * @param downloaded Non-zero if the download completed, in which case the
+ *                   downloaded records are dropped from the capture
+ */
+void msp_capture_release(int downloaded);
+
+
+#endif /* UTILS_MSP_CAPTURE_H_ */
@@ -0,0 +1,224 @@
+/*
+ * CUBES MSP link statistics functions
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "CMSIS/m2sxxx.h"
+#include "../msp/msp_endian.h"
+#include "../msp/msp_exp_state.h"
+#include "cmd_queue.h"
+#include "msp_stats.h"
+
+
+struct msp_stats_opcode {
+	uint16_t completed;
+	uint16_t failed;
+	uint16_t runs;
+	uint32_t run_max;
+	uint32_t run_total;
+	uint8_t seen;
+};
+
+static struct {
+	uint32_t rx_frames;
+	uint32_t rx_bytes;
+	uint32_t tx_frames;
+	uint32_t tx_bytes;
+	uint32_t rx_errors[MSP_STATS_FRAME_ERRORS];
+	uint32_t tx_errors[MSP_STATS_FRAME_ERRORS];
+	uint32_t trans_errors[MSP_STATS_TRANS_ERRORS];
+	uint32_t isr_hist[MSP_STATS_HIST_BINS];
+	uint32_t trans_hist[MSP_STATS_HIST_BINS];
+	struct msp_stats_opcode opcodes[MSP_STATS_OPCODES];
+} stats;
+
+/* Start of the ongoing transaction */
+static uint32_t trans_start_time;
+static unsigned int in_trans = 0;
+
+
+/*
+ * Histogram bin of a time value, i.e., floor(log2(t)). Done in a fixed number
+ * of steps, since this is called from the I2C ISR.
+ */
+static unsigned int hist_bin(uint32_t t)
+{
+	unsigned int bin = 0;
+
+	if (t >= (1ul << 16)) { t >>= 16; bin += 16; }
+	if (t >= (1ul <<  8)) { t >>=  8; bin +=  8; }
+	if (t >= (1ul <<  4)) { t >>=  4; bin +=  4; }
+	if (t >= (1ul <<  2)) { t >>=  2; bin +=  2; }
+	if (t >= (1ul <<  1)) {           bin +=  1; }
+
+	return bin;
+}
+
+
+static void count_frame_error(uint32_t *errors, int ret)
+{
+	if ((ret < 0) && (-ret <= MSP_STATS_FRAME_ERRORS))
+		errors[-ret - 1]++;
+}
+
+
+void msp_stats_init(void)
+{
+	memset(&stats, 0, sizeof(stats));
+	in_trans = 0;
+
+	/* Enable the DWT cycle counter */
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+
+uint32_t msp_stats_time(void)
+{
+	return DWT->CYCCNT;
+}
+
+
+void msp_stats_frame(unsigned long rx_len, int rx_ret,
+                     unsigned long tx_len, int tx_ret,
+                     uint32_t isr_time)
+{
+	if (rx_len) {
+		stats.rx_frames++;
+		stats.rx_bytes += rx_len;
+	}
+	if (tx_len) {
+		stats.tx_frames++;
+		stats.tx_bytes += tx_len;
+	}
+
+	count_frame_error(stats.rx_errors, rx_ret);
+	count_frame_error(stats.tx_errors, tx_ret);
+
+	stats.isr_hist[hist_bin(isr_time)]++;
+}
+
+
+void msp_stats_trans_start(unsigned char opcode)
+{
+	trans_start_time = msp_stats_time();
+	in_trans = 1;
+}
+
+
+void msp_stats_trans_end(unsigned char opcode, int error)
+{
+	struct msp_stats_opcode *op = &stats.opcodes[opcode % MSP_STATS_OPCODES];
+
+	op->seen = 1;
+	if (error) {
+		op->failed++;
+		if ((error > 0) && (error <= MSP_STATS_TRANS_ERRORS))
+			stats.trans_errors[error - 1]++;
+	} else {
+		op->completed++;
+	}
+
+	if (in_trans) {
+		stats.trans_hist[hist_bin(msp_stats_time() - trans_start_time)]++;
+		in_trans = 0;
+	}
+}
+
+
+void msp_stats_handler(unsigned char opcode, uint32_t time)
+{
+	struct msp_stats_opcode *op = &stats.opcodes[opcode % MSP_STATS_OPCODES];
+
+	/*
+	 * Called from the main loop, while msp_stats_serialize() runs from the
+	 * I2C ISR: the entry is updated with interrupts masked, so that it is
+	 * never serialized half-updated.
+	 */
+	__disable_irq();
+	op->seen = 1;
+	op->runs++;
+	op->run_total += time;
+	if (time > op->run_max)
+		op->run_max = time;
+	__enable_irq();
+}
+
+
+unsigned long msp_stats_serialize(uint8_t *buf)
+{
+	struct cmd_queue_stats cmdq;
+	unsigned long i, len = 0;
+	uint8_t num_opcodes = 0;
+
+	msp_to_bigendian32(buf + len, stats.rx_frames); len += 4;
+	msp_to_bigendian32(buf + len, stats.rx_bytes);  len += 4;
+	msp_to_bigendian32(buf + len, stats.tx_frames); len += 4;
+	msp_to_bigendian32(buf + len, stats.tx_bytes);  len += 4;
+
+	for (i = 0; i < MSP_STATS_FRAME_ERRORS; i++, len += 4)
+		msp_to_bigendian32(buf + len, stats.rx_errors[i]);
+	for (i = 0; i < MSP_STATS_FRAME_ERRORS; i++, len += 4)
+		msp_to_bigendian32(buf + len, stats.tx_errors[i]);
+	for (i = 0; i < MSP_STATS_TRANS_ERRORS; i++, len += 4)
+		msp_to_bigendian32(buf + len, stats.trans_errors[i]);
+	for (i = 0; i < MSP_STATS_HIST_BINS; i++, len += 4)
+		msp_to_bigendian32(buf + len, stats.isr_hist[i]);
+	for (i = 0; i < MSP_STATS_HIST_BINS; i++, len += 4)
+		msp_to_bigendian32(buf + len, stats.trans_hist[i]);
+
+	cmd_queue_get_stats(&cmdq);
+	msp_to_bigendian32(buf + len, cmdq.queued);    len += 4;
+	msp_to_bigendian32(buf + len, cmdq.overflows); len += 4;
+	msp_to_bigendian32(buf + len, cmdq.max_wait);  len += 4;
+	buf[len++] = cmdq.high_water;
+
+	/* So that the OBC can check that the MTU it set was applied */
+	buf[len++] = (msp_exp_state_get_mtu() >> 8) & 0xff;
+	buf[len++] = msp_exp_state_get_mtu() & 0xff;
+
+	/* Only the opcodes seen so far, the count goes before them */
+	len++;
+	for (i = 0; i < MSP_STATS_OPCODES; i++) {
+		struct msp_stats_opcode *op = &stats.opcodes[i];
+		if (!op->seen)
+			continue;
+		buf[len++] = i;
+		buf[len++] = (op->completed >> 8) & 0xff;
+		buf[len++] = op->completed & 0xff;
+		buf[len++] = (op->failed >> 8) & 0xff;
+		buf[len++] = op->failed & 0xff;
+		buf[len++] = (op->runs >> 8) & 0xff;
+		buf[len++] = op->runs & 0xff;
+		msp_to_bigendian32(buf + len, op->run_max);   len += 4;
+		msp_to_bigendian32(buf + len, op->run_total); len += 4;
+		num_opcodes++;
+	}
+	buf[MSP_STATS_HDR_LEN - 1] = num_opcodes;
+
+	return len;
+}
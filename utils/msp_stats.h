@@ -0,0 +1,152 @@
+/*
+ * CUBES MSP link statistics exported functions header
+ *
+ * Copyright © 2022 Theodor Stana
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef UTILS_MSP_STATS_H_
+#define UTILS_MSP_STATS_H_
+
+#include <stdint.h>
+
+/*
+ * Statistics kept on the MSP link since power-up. All counters wrap around.
+ *
+ * Frame errors are the negative return values of msp_recv_callback() and
+ * msp_send_callback() (MSP_EXP_ERR_IS_BUSY, MSP_EXP_ERR_FCS_MISMATCH, ...,
+ * MSP_EXP_ERR_NULL_POINTER), counted at index (-error - 1). Transaction errors
+ * are the error codes passed to msp_expsend_error() and msp_exprecv_error()
+ * (MSP_EXP_ERR_RECEIVED_NULL_FRAME, ...), counted at index (error - 1).
+ *
+ * Times are in Cortex-M3 clock cycles, as counted by the DWT cycle counter.
+ * Histogram bin i counts times in the range [2^i, 2^(i+1)); bin 0 also counts
+ * zero.
+ */
+#define MSP_STATS_FRAME_ERRORS  (9)
+#define MSP_STATS_TRANS_ERRORS  (3)
+#define MSP_STATS_HIST_BINS     (32)
+#define MSP_STATS_OPCODES       (128)
+
+/*
+ * Error code for msp_stats_trans_end(): the transaction completed, but CUBES
+ * rejected the data it carried. Counted as failed for the opcode, without a
+ * transaction error.
+ */
+#define MSP_STATS_REJECTED      (-1)
+
+/*
+ * Serialized statistics, as sent to the OBC via MSP_OP_REQ_CUBES_MSP_STATS.
+ * All multi-byte values are big-endian:
+ *   bytes   0..15  : RX frames, RX bytes, TX frames, TX bytes (32-bit each)
+ *   bytes  16..51  : RX frame errors (32-bit each)
+ *   bytes  52..87  : TX frame errors (32-bit each)
+ *   bytes  88..99  : transaction errors (32-bit each)
+ *   bytes 100..227 : I2C ISR time histogram (32-bit bins)
+ *   bytes 228..355 : transaction duration histogram (32-bit bins)
+ *   bytes 356..368 : command queue: commands queued, overflows and longest
+ *                    wait in clock cycles (32-bit each), high water mark
+ *   bytes 369..370 : MSP MTU in use (16-bit)
+ *   byte  371      : number N of opcodes seen so far
+ *   bytes 372..    : N x (opcode, completed, failed, runs, longest run,
+ *                    total run time), with 16-bit counters and 32-bit times
+ *
+ * Runs are the calls to the command handler in the main loop, including the
+ * ones for batched and time-tagged commands.
+ * Failed transactions include the SENDs whose data CUBES rejected on
+ * reception, e.g., an MSP MTU larger than CUBES supports.
+ */
+#define MSP_STATS_HDR_LEN       (16 + 4*(2*MSP_STATS_FRAME_ERRORS + \
+                                         MSP_STATS_TRANS_ERRORS + \
+                                         2*MSP_STATS_HIST_BINS) + 13 + 2 + 1)
+#define MSP_STATS_OPCODE_LEN    (15)
+#define MSP_STATS_MAX_LEN       (MSP_STATS_HDR_LEN + \
+                                 MSP_STATS_OPCODES*MSP_STATS_OPCODE_LEN)
+
+/**
+ * @brief Initialize MSP statistics and start the DWT cycle counter
+ */
+void msp_stats_init(void);
+
+/**
+ * @brief Get the current time, in clock cycles
+ *
+ * @return The DWT cycle counter value
+ */
+uint32_t msp_stats_time(void);
+
+/**
+ * @brief Account for one run of the MSP I2C slave write handler
+ *
+ * @param rx_len   Number of bytes received from the OBC
+ * @param rx_ret   Return value of msp_recv_callback()
+ * @param tx_len   Number of bytes prepared for the OBC to read
+ * @param tx_ret   Return value of msp_send_callback()
+ * @param isr_time Time spent in the two callbacks, in clock cycles
+ */
+void msp_stats_frame(unsigned long rx_len, int rx_ret,
+                     unsigned long tx_len, int tx_ret,
+                     uint32_t isr_time);
+
+/**
+ * @brief Mark the start of an MSP transaction
+ *
+ * To be called from msp_expsend_start() and msp_exprecv_start().
+ *
+ * @param opcode Opcode of the transaction
+ */
+void msp_stats_trans_start(unsigned char opcode);
+
+/**
+ * @brief Mark the end of an MSP transaction
+ *
+ * To be called from the msp_exp*_complete() and msp_exp*_error() callbacks.
+ * System commands, which consist of a single frame, are accounted for by
+ * calling this function without a prior msp_stats_trans_start().
+ *
+ * @param opcode Opcode of the transaction
+ * @param error  Zero if the transaction completed, the error code passed to
+ *               the msp_exp*_error() callback, or MSP_STATS_REJECTED
+ */
+void msp_stats_trans_end(unsigned char opcode, int error);
+
+/**
+ * @brief Account for one run of a command handler in the main loop
+ *
+ * @param opcode Opcode of the command
+ * @param time   Time spent in the handler, in clock cycles
+ */
+void msp_stats_handler(unsigned char opcode, uint32_t time);
+
+/**
+ * @brief Serialize the statistics for sending to the OBC
+ *
+ * Must be called from the same interrupt context that updates the transaction
+ * statistics (i.e., from an MSP callback), so that the snapshot is consistent;
+ * msp_stats_handler() updates the handler run times with interrupts masked.
+ *
+ * @param buf Destination buffer, at least MSP_STATS_MAX_LEN bytes long
+ * @return Number of bytes written to buf
+ */
+unsigned long msp_stats_serialize(uint8_t *buf);
+
+
+#endif /* UTILS_MSP_STATS_H_ */